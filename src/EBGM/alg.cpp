@@ -5,8 +5,10 @@
 #include "graph.hpp"
 
 #include <tuple>
+#include <algorithm>
 
 #include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
 
 
 #define PI 3.14159265358979323846F
@@ -14,60 +16,245 @@
 using namespace cv;
 using namespace std;
 
-// Generate 40 Garbor kernels.
-// Each kernel is a kernelSize*kernelSize matrix.
+// Get the size of the smallest square at the center of a kernel,
+// which contains at least (1 - energyThreshold) of its energy.
+// The result has the same parity as the size of the kernel, so
+// that the square is exactly at the center.
+static int truncatedKernelSize(
+    const Mat &re,
+    const Mat &im,
+    float energyThreshold
+)
+{
+    assert(re.rows == re.cols);
+
+    int kernelSize = re.rows;
+    if(energyThreshold <= 0.0F) {
+        return kernelSize;
+    }
+
+    Mat energy = re.mul(re) + im.mul(im);
+    double total = cv::sum(energy)[0];
+
+    for(int size = 2 - kernelSize%2; size < kernelSize; size += 2) {
+        int offset = (kernelSize - size) / 2;
+        double inside = cv::sum(energy(Rect(offset, offset, size, size)))[0];
+        if(inside >= (1.0 - energyThreshold) * total) {
+            return size;
+        }
+    }
+
+    return kernelSize;
+}
+
+// Generate the N Garbor kernels of BankOf<N>.
+// Each kernel is at most a kernelSize*kernelSize matrix.
+// The kernels of the same scale (nu) have the same size. With a
+// nonzero energyThreshold, the support of each scale is sized to
+// its Gaussian envelope, instead of kernelSize for all of them.
+template<int N>
 void genGaborKernels(
     int kernelSize,
-    Kernels<40> &result_kernels    // for function overloading
+    Kernels<N> &result_kernels,
+    float energyThreshold
 )
 {
+    using Bank = typename BankOf<N>::type;
+    const int nScales = Bank::SCALES;
+    const int nOrientations = Bank::ORIENTATIONS;
+
     assert(kernelSize > 0);
+    assert(energyThreshold >= 0.0F && energyThreshold < 1.0F);
 
     GarborKernel gk(kernelSize);
 
-    result_kernels.kx.reset(new float[40]);
-    result_kernels.ky.reset(new float[40]);
+    result_kernels.kx.reset(new float[N]);
+    result_kernels.ky.reset(new float[N]);
     float *kx_p = result_kernels.kx.get();
     float *ky_p = result_kernels.ky.get();
 
     #pragma omp parallel for collapse(2) schedule(static)
-    for (int nu = 0; nu <= 4; nu++){
-        for (int mu = 0; mu <= 7; mu++){
-            float k = powf(2.0F, -0.5F*(float)nu) * PI/2.0F;
-            float phi = (float)mu * PI/8.0F;
+    for (int nu = 0; nu < nScales; nu++){
+        for (int mu = 0; mu < nOrientations; mu++){
+            float k = Bank::waveNumber(nu);
+            float phi = (float)mu * PI/(float)nOrientations;
 
             float kx = k * cosf(phi);
             float ky = k * sinf(phi);
 
-            int j = mu + 8*nu;
+            int j = mu + nOrientations*nu;
 
             kx_p[j] = kx;
             ky_p[j] = ky;
             tie(result_kernels.re[j], result_kernels.im[j]) = 
-                gk.getKernel(2.0F*PI, kx, ky);
+                gk.getKernel(Bank::SIGMA, kx, ky);
+        }
+    }
+
+    if(energyThreshold <= 0.0F) {
+        return;
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int nu = 0; nu < nScales; nu++){
+        int size = 0;
+        for (int mu = 0; mu < nOrientations; mu++){
+            int j = mu + nOrientations*nu;
+            size = max(size, truncatedKernelSize(
+                result_kernels.re[j], result_kernels.im[j], energyThreshold
+            ));
+        }
+
+        int offset = (kernelSize - size) / 2;
+        for (int mu = 0; mu < nOrientations; mu++){
+            int j = mu + nOrientations*nu;
+            result_kernels.re[j] = 
+                result_kernels.re[j](Rect(offset, offset, size, size)).clone();
+            result_kernels.im[j] = 
+                result_kernels.im[j](Rect(offset, offset, size, size)).clone();
         }
     }
 }
 
 
 // return value: dx, dy
+template<int N>
 std::tuple<float/*dx*/,float/*dy*/>
 displacementWithFocus(
-    const Jet<40> &jet1, 
-    const Jet<40> &jet2, 
+    const Jet<N> &jet1, 
+    const Jet<N> &jet2, 
     int focus
 )
 {
-    assert(focus >=1 && focus <=5);
+    using Bank = typename BankOf<N>::type;
+
+    assert(focus >=1 && focus <= Bank::SCALES);
 
     float dx = 0, dy = 0;
     for(int i = 1; i <= focus; i++){
         int startIndex;
-        startIndex = 40 - 8*focus;
-        tie(dx, dy) = jet1.displacement(jet2, startIndex, 40, dx, dy);
+        startIndex = N - Bank::ORIENTATIONS*focus;
+        tie(dx, dy) = jet1.displacement(jet2, startIndex, N, dx, dy);
     }
 
     return make_tuple(dx, dy);
 }
 
+// same as displacementWithFocus(), but for ComplexJet.
+template<int N>
+std::tuple<float/*dx*/,float/*dy*/>
+complexDisplacementWithFocus(
+    const ComplexJet<N> &jet1, 
+    const ComplexJet<N> &jet2, 
+    int focus
+)
+{
+    return displacementWithFocus<N>(jet1, jet2, focus);
+}
+
+
+// The orientation of the bank of genGaborKernels() is
+// mu*PI/ORIENTATIONS, and j = mu + ORIENTATIONS*nu. The jet at
+// orientation mu of the result is that at orientation (mu + shift) of
+// jet, cyclically. Going round past PI negates the wave vector of the
+// kernel, i.e. conjugates its response, so the phase of such a jet is
+// negated.
+template<int N>
+Jet<N> shiftOrientations(const Jet<N> &jet, int shift)
+{
+    using Bank = typename BankOf<N>::type;
+    const int nOrientations = Bank::ORIENTATIONS;
+
+    Jet<N> ret = jet;
+
+    for(int nu = 0; nu < Bank::SCALES; nu++){
+        for(int mu = 0; mu < nOrientations; mu++){
+            // floor division: the number of times going round.
+            int src = mu + shift;
+            int turns = (src >= 0 ? src : src - (nOrientations - 1)) / 
+                nOrientations;
+            src -= nOrientations*turns;
+
+            float p = jet.p[src + nOrientations*nu];
+            if(turns % 2 != 0) {
+                p = -p;
+                if(p < -0.5F*PI) {
+                    p += 2.0F*PI;
+                }
+            }
+
+            ret.a[mu + nOrientations*nu] = jet.a[src + nOrientations*nu];
+            ret.p[mu + nOrientations*nu] = p;
+        }
+    }
+
+    return ret;
+}
+
+template<int N>
+Jet<N> shiftScales(const Jet<N> &jet, int shift, int nScales)
+{
+    using Bank = typename BankOf<N>::type;
+    const int nOrientations = Bank::ORIENTATIONS;
+    assert(shift >= 0 && nScales >= 0 && shift + nScales <= Bank::SCALES);
+
+    Jet<N> ret = jet;
+    std::fill(ret.a, ret.a + N, 0.0F);
+    std::fill(ret.p, ret.p + N, 0.0F);
+
+    int begin = nOrientations*shift;
+    int end = nOrientations*(shift + nScales);
+    std::copy(jet.a + begin, jet.a + end, ret.a);
+    std::copy(jet.p + begin, jet.p + end, ret.p);
+
+    return ret;
+}
+
+template<int N>
+void initDownsampledJets(
+    CalcJet<N> &calcJet,
+    const cv::Mat &src,
+    const Kernels<N> &kernels,
+    int levels,
+    size_t maxMemory
+)
+{
+    cv::Mat image = src;
+    for(int i=0; i<levels; i++){
+        cv::Mat down;
+        cv::pyrDown(image, down);
+        image = down;
+    }
+
+    int maxKernelRows, maxKernelCols;
+    std::tie(maxKernelRows, maxKernelCols) = kernels.getMaxSize();
+    if(maxMemory > 0) {
+        calcJet.initLazy(
+            image, kernels, maxKernelRows, maxKernelCols, maxMemory
+        );
+    }
+    else {
+        calcJet.init(image, kernels, maxKernelRows, maxKernelCols);
+    }
+}
+
 
+// the banks of BankOf.
+template void genGaborKernels(int, Kernels<Bank5x8::N>&, float);
+template void genGaborKernels(int, Kernels<Bank3x6::N>&, float);
+template std::tuple<float,float> displacementWithFocus(
+    const Jet<Bank5x8::N>&, const Jet<Bank5x8::N>&, int);
+template std::tuple<float,float> displacementWithFocus(
+    const Jet<Bank3x6::N>&, const Jet<Bank3x6::N>&, int);
+template std::tuple<float,float> complexDisplacementWithFocus(
+    const ComplexJet<Bank5x8::N>&, const ComplexJet<Bank5x8::N>&, int);
+template std::tuple<float,float> complexDisplacementWithFocus(
+    const ComplexJet<Bank3x6::N>&, const ComplexJet<Bank3x6::N>&, int);
+template Jet<Bank5x8::N> shiftOrientations(const Jet<Bank5x8::N>&, int);
+template Jet<Bank3x6::N> shiftOrientations(const Jet<Bank3x6::N>&, int);
+template Jet<Bank5x8::N> shiftScales(const Jet<Bank5x8::N>&, int, int);
+template Jet<Bank3x6::N> shiftScales(const Jet<Bank3x6::N>&, int, int);
+template void initDownsampledJets(CalcJet<Bank5x8::N>&, const cv::Mat&,
+    const Kernels<Bank5x8::N>&, int, size_t);
+template void initDownsampledJets(CalcJet<Bank3x6::N>&, const cv::Mat&,
+    const Kernels<Bank3x6::N>&, int, size_t);
@@ -9,6 +9,11 @@
 #include <tuple>
 #include <limits>
 #include <exception>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <array>
+#include <utility>
 
 #include <opencv2/core.hpp>
 
@@ -19,48 +24,168 @@
 
 
 
-// generate 40 Garbor kernels.
+// The banks which can be chosen at run time (see Cfg::kernelBank).
+enum class GaborBankType {
+    BANK_5X8,
+    BANK_3X6
+};
+
+
+// Generate the N Garbor kernels of BankOf<N>.
+// Instantiated for the banks of BankOf only.
+template<int N>
 void genGaborKernels(
-    int kernelSize,        // each kernel is a
+    int kernelSize,        // each kernel is at most a
                               // kernelSize*kernelSize matrix.
-    Kernels<40> &result_kernels
+    Kernels<N> &result_kernels,
+    float energyThreshold = 0.0F  // the kernels of each scale are truncated
+                                  // to the smallest square that loses at
+                                  // most this fraction of their energy.
+                                  // 0: no truncation.
 );
 
 
+// focus: from 1 to BankOf<N>::type::SCALES, the number of scales used
+// (the smallest wave numbers first).
 // return value: dx, dy
+template<int N>
 std::tuple<float/*dx*/,float/*dy*/>
 displacementWithFocus(
-    const Jet<40> &jet1, 
-    const Jet<40> &jet2, 
+    const Jet<N> &jet1, 
+    const Jet<N> &jet2, 
     int focus
 );
 
+// same as displacementWithFocus(), but for ComplexJet.
+template<int N>
+std::tuple<float/*dx*/,float/*dy*/>
+complexDisplacementWithFocus(
+    const ComplexJet<N> &jet1, 
+    const ComplexJet<N> &jet2, 
+    int focus
+);
 
-// Calculate a graph, whose nodes' positions are specified by 'points'.
+
+// jet is calculated in an image rotated by shift*PI/ORIENTATIONS (in
+// the direction of Points::rotate()) of BankOf<N>. Return the jet of
+// the same point in the image before rotating: the orientations of
+// jet, which must be calculated by the kernels of genGaborKernels(),
+// are shifted cyclically by 'shift'.
+template<int N>
+Jet<N> shiftOrientations(const Jet<N> &jet, int shift);
+
+
+// jet is calculated in an image downsampled by 2^levels, whose scale nu
+// has the wave number of the scale nu + shift in the original image
+// (shift = levels*SCALES_PER_OCTAVE of BankOf<N>). Return a jet whose
+// scale nu is the scale nu + shift of jet, for nu < nScales; the other
+// scales are zero. With shift = 0, it only keeps the first nScales.
 template<int N>
-Graph<N> pointsToGraph(
+Jet<N> shiftScales(const Jet<N> &jet, int shift, int nScales);
+
+
+// Initialize calcJet with the jets of src downsampled 'levels' times by
+// cv::pyrDown() (each halves the width and the height), for the image
+// pyramid of step1(). src: CV_32F, like in CalcJet::init().
+// If maxMemory > 0, the jets are computed on demand, with at most
+// maxMemory bytes of them in memory (see CalcJet::initLazy()).
+template<int N>
+void initDownsampledJets(
+    CalcJet<N> &calcJet,
+    const cv::Mat &src,
+    const Kernels<N> &kernels,
+    int levels,
+    size_t maxMemory = 0
+);
+
+
+// Calculate a graph, whose nodes' positions are specified by 'points',
+// into result. The memory of result is reused: no heap allocation if
+// it has held a graph of as many nodes.
+template<int N, int K>
+void pointsToGraph(
     const CalcJet<N> &calcJet,
-    const Points<int> &points
+    const Points<int, K> &points,
+    Graph<N, K> &result
 )
 {
-    Graph<N> ret;
-
     int nPoints = points.size();
+
+    result.clear();
+    result.reserve(nPoints);
     for(int i=0; i<nPoints; i++){
-        Jet<N> jet;
         auto point = points.get(i);
+        result.addNode(calcJet.calcJet(point.x, point.y));
+    }
+}
 
-        jet = calcJet.calcJet(point.x, point.y);
-        ret.addNode(jet);
+// Calculate a graph, whose nodes' positions are specified by 'points'.
+template<int N, int K>
+Graph<N, K> pointsToGraph(
+    const CalcJet<N> &calcJet,
+    const Points<int, K> &points
+)
+{
+    Graph<N, K> ret;
+    pointsToGraph(calcJet, points, ret);
+    return ret;
+}
+
+// The jet at the exact (sub-pixel) coordinates of the point i of
+// points (see Points::getExact()), by CalcJet::calcJet(float, float).
+// The coordinates are clamped to the image: Points::isInRange() checks
+// the rounded ones.
+template<int N, int K>
+Jet<N> exactPointJet(
+    const CalcJet<N> &calcJet,
+    const Points<int, K> &points,
+    int i
+)
+{
+    int srcWidth, srcHeight;
+    std::tie(srcWidth, srcHeight) = calcJet.getSrcSize();
+
+    float x, y;
+    std::tie(x, y) = points.getExact(i);
+    x = std::min(std::max(x, 0.0F), (float)(srcWidth - 1));
+    y = std::min(std::max(y, 0.0F), (float)(srcHeight - 1));
+
+    return calcJet.calcJet(x, y);
+}
+
+// Same as pointsToGraph(), but the jets are sampled at the exact
+// (sub-pixel) coordinates of points (see exactPointJet()).
+template<int N, int K>
+void pointsToGraphExact(
+    const CalcJet<N> &calcJet,
+    const Points<int, K> &points,
+    Graph<N, K> &result
+)
+{
+    int nPoints = points.size();
+
+    result.clear();
+    result.reserve(nPoints);
+    for(int i=0; i<nPoints; i++){
+        result.addNode(exactPointJet(calcJet, points, i));
     }
+}
 
+template<int N, int K>
+Graph<N, K> pointsToGraphExact(
+    const CalcJet<N> &calcJet,
+    const Points<int, K> &points
+)
+{
+    Graph<N, K> ret;
+    pointsToGraphExact(calcJet, points, ret);
     return ret;
 }
 
-template<int N>
-Points<int> graphToPoints(const Graph<N> &graph)
+template<int N, int K>
+Points<int, K> graphToPoints(const Graph<N, K> &graph)
 {
-    Points<int> ret;
+    Points<int, K> ret;
 
     for(auto &i: graph.getNodes()) {
         ret.addPoint({i.x, i.y});
@@ -70,15 +195,391 @@ Points<int> graphToPoints(const Graph<N> &graph)
 }
 
 
+// The search strategies of step3().
+enum class Step3Search {
+    GRID,       // all the scales and translations of a grid
+    PATTERN     // coarse-to-fine pattern search, see step3Pattern()
+};
+
+// The search strategies of step4().
+enum class Step4Search {
+    WINDOW,     // every offset of a 9x9 window around each node
+    PREDICT     // the offset predicted by the displacement, see step4Predict()
+};
+
+// Options of the EBGM algorithm (step1() - step4()).
+struct MatchOptions {
+    // step1(): score every translation with per-node similarity maps
+    // (see step1Maps()), instead of building a graph for each
+    // translation on a 4-pixel lattice.
+    bool step1Maps = false;
+
+    // step1(): if > 0, search the face on the image downsampled this
+    // number of times first (see step1Pyramid()), then refine only the
+    // step1TopK best translations at full resolution.
+    int step1Levels = 0;
+    int step1TopK = 4;
+
+    Step3Search step3Search = Step3Search::GRID;
+    // step3Pattern(): the max number of graphs evaluated.
+    int step3Budget = 200;
+    // step3Pattern(): stop when the steps of all the parameters are
+    // below this ratio of their initial steps, within (0, 1).
+    float step3Tolerance = 0.1F;
+
+    // step3(): also search the in-plane rotation of the face.
+    bool step3Rotation = false;
+    // step3(): the max number of graphs evaluated for each rotation.
+    int step3RotationBudget = 60;
+
+    // step1() (on the lattice) and step3Grid() (without a memo):
+    // compare each graph on the coarse bands first
+    // (BunchGraph::compareBound()), and on all the bands only if it
+    // can still beat the best graph so far. The results are the same.
+    bool cascade = false;
+
+    Step4Search step4Search = Step4Search::WINDOW;
+
+    // step3() and step4Predict(): sample the jets at the sub-pixel
+    // points (see pointsToGraphExact()) instead of rounding them, so
+    // that close scales and translations give different graphs. The
+    // memo is not used by step3() and step4(), since it is keyed by the
+    // rounded positions.
+    bool subpixel = false;
+};
+
+// The number of graphs in each stage of the cascade
+// (MatchOptions::cascade) of a step.
+struct CascadeStats {
+    long coarse = 0;    // compared on the coarse bands
+    long full = 0;      // not rejected, then compared on all the bands
+
+    void merge(const CascadeStats &other)
+    {
+        coarse += other.coarse;
+        full += other.full;
+    }
+};
+
+// Whether a graph can be rejected by the cascade: bound is the upper
+// bound of its similarity, best is the similarity of the best graph
+// so far. The margin covers the rounding errors of the bound.
+inline bool cascadeRejects(float bound, float best)
+{
+    return bound + 1e-5F < best;
+}
+
+
+// Find approximate face position, by per-node similarity maps.
+// The similarity map of node i holds the similarity between the node
+// and the jet at each pixel the node can reach (bunch.compareNode()).
+// The score of a translation is then the sum of one lookup per map,
+// so all translations (a 1-pixel lattice) are scored without
+// building any graph, and each jet is compared with each node once.
+// return value: Graph graph, Points points
+template<int N, int K>
+std::tuple<Graph<N, K>,Points<int, K>> step1Maps(
+    const CalcJet<N> &calcJet,
+    const BunchGraph<N> &bunch,
+    const Points<int, K> &startPoints
+)
+{
+    static_assert(std::numeric_limits<float>::is_iec559, "IEEE 754 required");
+    assert(!bunch.empty());
+    assert(!startPoints.empty());
+    assert(bunch.getNodes().size() == startPoints.size());
+
+    // Calculates the size of image and the range of startPoints. 
+    int graphMinX, graphMinY, graphMaxX, graphMaxY;
+    std::tie(graphMinX, graphMinY, graphMaxX, graphMaxY) = startPoints.getMinMax();
+    int graphWidth = graphMaxX - graphMinX + 1;
+    int graphHeight = graphMaxY - graphMinY + 1;
+    int srcWidth, srcHeight;
+    std::tie(srcWidth, srcHeight) = calcJet.getSrcSize();
+
+    // The range of startPoints must not be larger
+    // than that of original image.
+    if(graphWidth > srcWidth || graphHeight > srcHeight) {
+        throw std::out_of_range(
+            "Error in step1Maps(): The range of startPoints is "
+            "larger than that of source image."
+        );
+    }
+
+    int nHori = srcWidth - graphWidth + 1;
+    int nVert = srcHeight - graphHeight + 1;
+    int nNodes = startPoints.size();
+
+    Points<int, K> startpoints = startPoints;
+    startpoints.translate(-graphMinX, -graphMinY);
+
+    // scores[iy*nHori + ix]: the sum over the similarity maps of all
+    // the nodes at the translation (ix, iy). Each row of translations
+    // is accumulated by one thread.
+    std::vector<float> scores(size_t(nHori)*nVert, 0.0F);
+
+    #pragma omp parallel
+    {
+        std::vector<Jet<N>> jets(nHori);
+        std::vector<float> simi(nHori);
+
+        #pragma omp for schedule(static)
+        for(int iy=0; iy<nVert; iy++){
+            float *row = scores.data() + size_t(iy)*nHori;
+
+            for(int i=0; i<nNodes; i++){
+                auto point = startpoints.get(i);
+                for(int ix=0; ix<nHori; ix++){
+                    jets[ix] = calcJet.calcJet(point.x + ix, point.y + iy);
+                }
+                bunch.compareNode(i, jets.data(), nHori, simi.data());
+                for(int ix=0; ix<nHori; ix++){
+                    row[ix] += simi[ix];
+                }
+            }
+        }
+    }
+
+    // the first translation with the highest score.
+    size_t best = std::max_element(scores.begin(), scores.end()) - 
+        scores.begin();
+
+    Points<int, K> resultPoints = startpoints;
+    resultPoints.translate(int(best % nHori), int(best / nHori));
+
+    return std::make_tuple(pointsToGraph(calcJet, resultPoints), resultPoints);
+}
+
+
+// Find approximate face position on an image pyramid.
+// levelJets holds the jets of the image downsampled 'levels' times
+// (see initDownsampledJets()), computed by the same kernels: the scale
+// nu of levelJets has the wave number of the scale nu + shift of
+// calcJet (shift = levels*SCALES_PER_OCTAVE), so the bunch graph is
+// scaled down by 2^levels, and only the scales they have in common are
+// compared (see shiftScales()). The translations of a 2-pixel lattice
+// of levelJets are scored, then the topK best of them (at least 2
+// lattice steps apart) are refined at full resolution, each in a
+// window of +-2^levels pixels. Only those windows are read from
+// calcJet.
+// return value: Graph graph, Points points
+template<int N, int K>
+std::tuple<Graph<N, K>,Points<int, K>> step1Pyramid(
+    const CalcJet<N> &calcJet,
+    const CalcJet<N> &levelJets,
+    int levels,
+    int topK,
+    const BunchGraph<N> &bunch,
+    const Points<int, K> &startPoints
+)
+{
+    using Bank = typename BankOf<N>::type;
+    static_assert((Bank::SCALES - 1) % 2 == 0,
+        "The image pyramid needs an odd number of scales.");
+    static_assert(std::numeric_limits<float>::is_iec559, "IEEE 754 required");
+    assert(!bunch.empty());
+    assert(!startPoints.empty());
+    assert(bunch.getNodes().size() == startPoints.size());
+    assert(topK > 0);
+
+    int shift = levels*Bank::SCALES_PER_OCTAVE;
+    int nScales = Bank::SCALES - shift;
+    if(levels <= 0 || nScales <= 0) {
+        throw std::invalid_argument(
+            "Error in step1Pyramid(): The number of levels must be "
+            "between 1 and " +
+            std::to_string((Bank::SCALES - 1)/Bank::SCALES_PER_OCTAVE) +
+            " for this kernel bank."
+        );
+    }
+    const int factor = 1 << levels;
+
+    int graphMinX, graphMinY, graphMaxX, graphMaxY;
+    std::tie(graphMinX, graphMinY, graphMaxX, graphMaxY) = startPoints.getMinMax();
+    int srcWidth, srcHeight;
+    std::tie(srcWidth, srcHeight) = calcJet.getSrcSize();
+    int levelWidth, levelHeight;
+    std::tie(levelWidth, levelHeight) = levelJets.getSrcSize();
+
+    if(graphMaxX - graphMinX + 1 > srcWidth ||
+       graphMaxY - graphMinY + 1 > srcHeight) {
+        throw std::out_of_range(
+            "Error in step1Pyramid(): The range of startPoints is "
+            "larger than that of source image."
+        );
+    }
+
+    Points<int, K> startpoints = startPoints;
+    startpoints.translate(-graphMinX, -graphMinY);
+
+    // the bunch graph and the start points, scaled down.
+    BunchGraph<N> levelBunch;
+    int nNodes = startPoints.size();
+    int nModels = bunch.getNodes()[0].size();
+    for(int j=0; j<nModels; j++){
+        Graph<N> graph;
+        for(int i=0; i<nNodes; i++){
+            Jet<N> jet = shiftScales(bunch.getNodes()[i][j], shift, nScales);
+            jet.x = (int)round((float)jet.x / factor);
+            jet.y = (int)round((float)jet.y / factor);
+            graph.addNode(jet);
+        }
+        levelBunch.addGraph(graph);
+    }
+
+    Points<int, K> levelPoints = startpoints;
+    levelPoints.scale(0.0F, 0.0F, 1.0F/factor, 1.0F/factor);
+    int levelMaxX, levelMaxY;
+    std::tie(std::ignore, std::ignore, levelMaxX, levelMaxY) =
+        levelPoints.getMinMax();
+
+    // the level lattice: the score of each translation.
+    const int step = 2;
+    int spanX = levelWidth - 1 - levelMaxX;
+    int spanY = levelHeight - 1 - levelMaxY;
+    int nHori = spanX >= 0 ? spanX / step + 1 : 0;
+    int nVert = spanY >= 0 ? spanY / step + 1 : 0;
+    std::vector<float> scores(size_t(nHori)*nVert);
+
+    #pragma omp parallel
+    {
+        // reused by the candidates of this thread.
+        Points<int, K> points;
+        Graph<N, K> graph;
+
+        #pragma omp for collapse(2) schedule(static)
+        for(int ix=0; ix<nHori; ix++){
+            for(int iy=0; iy<nVert; iy++){
+                points = levelPoints;
+                points.translate(ix*step, iy*step);
+
+                graph.clear();
+                graph.reserve(nNodes);
+                for(int i=0; i<nNodes; i++){
+                    auto point = points.get(i);
+                    graph.addNode(shiftScales(
+                        levelJets.calcJet(point.x, point.y), 0, nScales
+                    ));
+                }
+                scores[size_t(ix)*nVert + iy] = levelBunch.compare(graph);
+            }
+        }
+    }
+
+    // the topK best translations, in the order of their scores (then
+    // of their indices), at least 2 lattice steps apart.
+    std::vector<int> order(scores.size());
+    for(size_t i=0; i<order.size(); i++){
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return scores[a] > scores[b];
+    });
+    std::vector<std::pair<int, int>> centers;
+    for(size_t i=0; i<order.size() && (int)centers.size() < topK; i++){
+        int ix = order[i] / nVert;
+        int iy = order[i] % nVert;
+        bool isolated = true;
+        for(const auto &c: centers){
+            if(std::abs(c.first - ix*step*factor) < 2*step*factor &&
+               std::abs(c.second - iy*step*factor) < 2*step*factor) {
+                isolated = false;
+                break;
+            }
+        }
+        if(isolated) {
+            centers.push_back({ix*step*factor, iy*step*factor});
+        }
+    }
+
+    // refine each of them at full resolution.
+    using Translation = std::pair<int, int>;
+    ArgMax<Translation> best;
+    const int window = 2*factor + 1;
+    int nCenters = centers.size();
+
+    #pragma omp parallel
+    {
+        ArgMax<Translation> local;
+        // reused by the candidates of this thread.
+        Points<int, K> points;
+        Graph<N, K> graph;
+
+        #pragma omp for collapse(3) schedule(static) nowait
+        for(int c=0; c<nCenters; c++){
+            for(int ix=0; ix<window; ix++){
+                for(int iy=0; iy<window; iy++){
+                    int tx = centers[c].first + ix - factor;
+                    int ty = centers[c].second + iy - factor;
+                    points = startpoints;
+                    points.translate(tx, ty);
+
+                    if( !points.isInRange(0, 0, srcWidth-1, srcHeight-1) ){
+                        continue;
+                    }
+
+                    pointsToGraph(calcJet, points, graph);
+                    float simi = bunch.compare(graph);
+                    local.update(
+                        simi, (long(c)*window + ix)*window + iy, {tx, ty}
+                    );
+                }
+            }
+        }
+
+        #pragma omp critical
+        best.merge(local);
+    }
+
+    if(!best.found()) {
+        throw std::out_of_range(
+            "Error in step1Pyramid(): No graph is in the range of "
+            "source image."
+        );
+    }
+
+    Points<int, K> resultPoints = startpoints;
+    resultPoints.translate(
+        best.getCandidate().first,
+        best.getCandidate().second
+    );
+
+    return std::make_tuple(pointsToGraph(calcJet, resultPoints), resultPoints);
+}
+
+
 // Find approximate face position.
 // return value: Graph graph, Points points
-template<int N>
-std::tuple<Graph<N>,Points<int>> step1(
+template<int N, int K>
+std::tuple<Graph<N, K>,Points<int, K>> step1(
     const CalcJet<N> &calcJet,
     const BunchGraph<N> &bunch,
-    const Points<int> &startPoints
+    const Points<int, K> &startPoints,
+    const MatchOptions &options = MatchOptions(),
+    CascadeStats *cascadeStats = nullptr,  // if not null, the graphs of
+                                           // options.cascade are
+                                           // counted into it.
+    const CalcJet<N> *levelJets = nullptr  // the jets of the image
+                                           // downsampled
+                                           // options.step1Levels times,
+                                           // needed by step1Pyramid().
 )
 {
+    if(options.step1Levels > 0) {
+        if(!levelJets) {
+            throw std::invalid_argument(
+                "Error in step1(): The jets of the downsampled image "
+                "are needed by options.step1Levels."
+            );
+        }
+        return step1Pyramid(calcJet, *levelJets, options.step1Levels,
+            options.step1TopK, bunch, startPoints);
+    }
+
+    if(options.step1Maps) {
+        return step1Maps(calcJet, bunch, startPoints);
+    }
+
     static_assert(std::numeric_limits<float>::is_iec559, "IEEE 754 required");
     assert(!bunch.empty());
     assert(!startPoints.empty());
@@ -104,10 +605,11 @@ std::tuple<Graph<N>,Points<int>> step1(
     int nHori = (srcWidth - graphWidth + 1) / step;
     int nVert = (srcHeight - graphHeight + 1) / step;
 
-    Points<int> startpoints;
-    Points<int> resultPoints;
-    Graph<N> resultGraph;
-    float maxSimi = -std::numeric_limits<float>::infinity();
+    Points<int, K> startpoints;
+
+    // the translations of startpoints.
+    using Translation = std::pair<int, int>;
+    ArgMax<Translation> best;
 
     // Test similarity at each location of a square lattice
     // with a spacing of 'step' pixels.
@@ -115,64 +617,110 @@ std::tuple<Graph<N>,Points<int>> step1(
     startpoints = startPoints;
     startpoints.translate(-graphMinX, -graphMinY);
 
-    #pragma omp parallel for collapse(2) schedule(static)
-    for(int ix=0; ix<nHori; ix++){
-        for(int iy=0; iy<nVert; iy++){
-            float simi;
-            Points<int> points;
-            Graph<N> graph;
-
-            points = startpoints;
-            points.translate(ix*step, iy*step);
-
-            graph = pointsToGraph(calcJet, points);
-            simi = bunch.compare(graph);
-
-            #pragma omp critical
-            {
-                if(simi > maxSimi) {
-                    maxSimi = simi;
-                    resultPoints = points;
-                    resultGraph = graph;
+    CascadeStats stats;
+
+    #pragma omp parallel
+    {
+        ArgMax<Translation> local;
+        CascadeStats localStats;
+        // reused by the candidates of this thread.
+        Points<int, K> points;
+        Graph<N, K> graph;
+
+        #pragma omp for collapse(2) schedule(static) nowait
+        for(int ix=0; ix<nHori; ix++){
+            for(int iy=0; iy<nVert; iy++){
+                points = startpoints;
+                points.translate(ix*step, iy*step);
+
+                pointsToGraph(calcJet, points, graph);
+                if(options.cascade) {
+                    localStats.coarse++;
+                    if(cascadeRejects(
+                        bunch.compareBound(graph), local.getScore()
+                    )) {
+                        continue;
+                    }
+                    localStats.full++;
                 }
+                float simi = bunch.compare(graph);
+                local.update(simi, ix*nVert + iy, {ix*step, iy*step});
             }
         }
+
+        #pragma omp critical
+        {
+            best.merge(local);
+            stats.merge(localStats);
+        }
     }
 
     // Repeat the scanning around the best fitting position
-    // with a spacing of 1 pixel.
-
-    startpoints = resultPoints;
-
-    #pragma omp parallel for collapse(2) schedule(static)
-    for(int ix=1-step; ix<step; ix++){
-        for(int iy=1-step; iy<step; iy++){
-
-            float simi;
-            Points<int> points;
-            Graph<N> graph;
-
-            points = startpoints;
-            points.translate(ix, iy);
-            
-            if( !points.isInRange(0, 0, srcWidth-1, srcHeight-1) ){
-                continue;
-            }
-
-            graph = pointsToGraph(calcJet, points);
-            simi = bunch.compare(graph);
+    // with a spacing of 1 pixel. The lattice position is kept
+    // unless another one is better.
+
+    Translation center = best.getCandidate();
+    ArgMax<Translation> refined;
+    refined.update(best.getScore(), -1, center);
+
+    #pragma omp parallel
+    {
+        ArgMax<Translation> local;
+        CascadeStats localStats;
+        // reused by the candidates of this thread.
+        Points<int, K> points;
+        Graph<N, K> graph;
+
+        #pragma omp for collapse(2) schedule(static) nowait
+        for(int ix=1-step; ix<step; ix++){
+            for(int iy=1-step; iy<step; iy++){
+                points = startpoints;
+                points.translate(center.first + ix, center.second + iy);
+                
+                if( !points.isInRange(0, 0, srcWidth-1, srcHeight-1) ){
+                    continue;
+                }
 
-            #pragma omp critical
-            {
-                if(simi > maxSimi) {
-                    maxSimi = simi;
-                    resultPoints = points;
-                    resultGraph = graph;
+                pointsToGraph(calcJet, points, graph);
+                if(options.cascade) {
+                    localStats.coarse++;
+                    // the lattice position wins the ties.
+                    if(cascadeRejects(
+                        bunch.compareBound(graph),
+                        std::max(local.getScore(), best.getScore())
+                    )) {
+                        continue;
+                    }
+                    localStats.full++;
                 }
+                float simi = bunch.compare(graph);
+                local.update(
+                    simi, 
+                    (ix + step - 1)*(2*step - 1) + (iy + step - 1), 
+                    {center.first + ix, center.second + iy}
+                );
             }
         }
+
+        #pragma omp critical
+        {
+            refined.merge(local);
+            stats.merge(localStats);
+        }
+    }
+
+    if(cascadeStats) {
+        *cascadeStats = stats;
     }
 
+    // the graph of the winner only.
+    Points<int, K> resultPoints = startpoints;
+    resultPoints.translate(
+        refined.getCandidate().first, 
+        refined.getCandidate().second
+    );
+    Graph<N, K> resultGraph = pointsToGraph(calcJet, resultPoints);
+
     return std::make_tuple(resultGraph, resultPoints);
     
 }
@@ -344,11 +892,11 @@ std::tuple<Graph<N>,Points<int>> step1(
 // and bunch::yScale.
 // return value: 
 //     Graph graph, Points points
-template<int N>
-std::tuple<Graph<N>,Points<int>> step2(
+template<int N, int K>
+std::tuple<Graph<N, K>,Points<int, K>> step2(
     const CalcJet<N> &calcJet,
     BunchGraph<N> &bunch,
-    const Points<int> &step1Points
+    const Points<int, K> &step1Points
 )
 {
     // This step is merged into step3.
@@ -361,151 +909,607 @@ std::tuple<Graph<N>,Points<int>> step2(
 }
 
 
-// My algorithm.
-// Refine size and find aspect ratio and position.
-// The scaling information will be stored in bunch::xScale
-// and bunch::yScale.
-// return value: 
-//     Graph graph, Points points
-template<int N>
-std::tuple<Graph<N>,Points<int>> step3(
+// The points of the graph evaluated by step3() for the parameters
+// (scaleX, scaleY, tx, ty): step2Points scaled, translated, then
+// rotated by shift*PI/ORIENTATIONS (of BankOf<N>) around its center.
+// Written into result, whose memory is reused.
+template<int N, int K>
+void step3Points(
+    const Points<int, K> &step2Points,
+    const float *params,
+    int shift,
+    Points<int, K> &result
+)
+{
+    result = step2Points;
+    result
+        .scale(params[0], params[1])
+        .translate(params[2], params[3]);
+    if(shift != 0) {
+        result.rotate(
+            (float)shift * PI/(float)BankOf<N>::type::ORIENTATIONS
+        );
+    }
+}
+
+// The graph of points, whose jets are calculated in calcJet and have
+// their orientations shifted back by shift (see shiftOrientations()),
+// so that the graph of a face rotated by shift*PI/ORIENTATIONS (of
+// BankOf<N>) is compared with the bunch graph as if it was not.
+// If subpixel, the jets are sampled at the exact positions of points
+// (see pointsToGraphExact()). Written into graph, whose memory is
+// reused.
+template<int N, int K>
+void rotatedPointsToGraph(
     const CalcJet<N> &calcJet,
-    BunchGraph<N> &bunch,
-    const Points<int> &step2Points
+    const Points<int, K> &points,
+    int shift,
+    bool subpixel,
+    Graph<N, K> &graph
 )
 {
-    static_assert(std::numeric_limits<float>::is_iec559, "IEEE 754 required");
-    assert(!bunch.empty());
-    assert(!step2Points.empty());
+    if(shift == 0) {
+        if(subpixel) {
+            pointsToGraphExact(calcJet, points, graph);
+        }
+        else {
+            pointsToGraph(calcJet, points, graph);
+        }
+        return;
+    }
 
+    graph.clear();
+    graph.reserve(points.size());
+    for(int i=0; i<points.size(); i++){
+        Jet<N> jet;
+        if(subpixel) {
+            jet = exactPointJet(calcJet, points, i);
+        }
+        else {
+            auto point = points.get(i);
+            jet = calcJet.calcJet(point.x, point.y);
+        }
+        graph.addNode(shiftOrientations(jet, shift));
+    }
+}
+
+// The memory of the candidates of step3Evaluate(), reused by the
+// candidates of one thread, so that building them does no heap
+// allocation.
+template<int N, int K>
+struct Step3Scratch {
+    Points<int, K> points;
+    Graph<N, K> graph;
+    // the graphs of the cascade of this thread.
+    CascadeStats cascade;
+};
+
+// The similarity of the graph of step3Points() with bunch. If shift is
+// not 0, the orientations of its jets are shifted back by
+// shiftOrientations(), instead of recalculating the jets.
+// -infinity if the graph is out of the image, or rejected by the
+// cascade.
+template<int N, int K>
+float step3Evaluate(
+    const CalcJet<N> &calcJet,
+    const BunchGraph<N> &bunch,
+    const Points<int, K> &step2Points,
+    const float *params,
+    int shift,
+    SimilarityMemo *memo,
+    Step3Scratch<N, K> &scratch,
+    bool subpixel,          // see MatchOptions::subpixel.
+    bool cascade = false,   // compare the graph on the coarse bands
+                            // first, and reject it if it can not beat
+                            // 'best' (counted into scratch.cascade).
+    float best = -std::numeric_limits<float>::infinity()
+)
+{
     int srcWidth, srcHeight;
     std::tie(srcWidth, srcHeight) = calcJet.getSrcSize();
 
+    Points<int, K> &points = scratch.points;
+    step3Points<N>(step2Points, params, shift, points);
+    if( !points.isInRange(0, 0, srcWidth-1, srcHeight-1) ){
+        return -std::numeric_limits<float>::infinity();
+    }
+
+    Graph<N, K> &graph = scratch.graph;
+    rotatedPointsToGraph(calcJet, points, shift, subpixel, graph);
+
+    if(cascade) {
+        scratch.cascade.coarse++;
+        if(cascadeRejects(bunch.compareBound(graph), best)) {
+            return -std::numeric_limits<float>::infinity();
+        }
+        scratch.cascade.full++;
+    }
+
+    return memo ? 
+        bunch.compare(graph, *memo, shift) : 
+        bunch.compare(graph);
+}
+
+// The grid search of step3(): all the scales from 0.8 to 1.2 (step 0.1)
+// and translations from -3 to 3 pixels.
+// params: the best (scaleX, scaleY, tx, ty).
+// return value: the similarity of params.
+template<int N, int K>
+float step3Grid(
+    const CalcJet<N> &calcJet,
+    const BunchGraph<N> &bunch,
+    const Points<int, K> &step2Points,
+    SimilarityMemo *memo,
+    float *params,
+    bool cascade = false,                 // see MatchOptions::cascade.
+    CascadeStats *cascadeStats = nullptr, // if not null, the graphs of
+                                          // the cascade are counted
+                                          // into it.
+    bool subpixel = false                 // see MatchOptions::subpixel.
+)
+{
     // The x- and y-dimensions are scaled independently.
     // Then translated by -delta to delta.
     const float minScale = 0.8F;
     const float maxScale = 1.2F;
     const float scaleStep = 0.1F;
-    //const float angles[] = {PI/6.0F, 0.0F, -PI/6.0F};
-    const float angles[] = {0.0F};
     const int delta = 3;
     int nScale = round((maxScale - minScale) / scaleStep) + 1;
+
+    // A lookup in memo costs less than a bound: once the nodes of the
+    // first graphs are in it, the cascade would only slow it down.
+    cascade = cascade && !memo;
     
-    //float minSumDisp2 = std::numeric_limits<float>::infinity();
-    float maxSimi = -std::numeric_limits<float>::infinity();
-    Graph<N> resultGraph;
-    Points<int> resultPoints;
-    float resultScaleX = 1.0F, resultScaleY = 1.0F;
-
-    #pragma omp parallel for collapse(4) schedule(static)
-    for(int ix=0; ix<nScale; ix++){
-        for(int iy=0; iy<nScale; iy++){
-            for(int jx=-delta; jx<=delta; jx++){
-                for(int jy=-delta; jy<=delta; jy++){
-                    for(float angle: angles){
-                        Points<int> points;
-                        Graph<N> graph;
-                        //float sumDisp2;
-                        float simi;
-                        float scaleX, scaleY;
-
-                        scaleX = minScale + (float)ix*scaleStep;
-                        scaleY = minScale + (float)iy*scaleStep;
-                        points = step2Points;
-                        points
-                            .scale(scaleX, scaleY)
-                            .translate(jx, jy)
-                            .rotate(angle);
-                        if( !points.isInRange(0, 0, srcWidth-1, srcHeight-1) ){
-                            continue;
-                        }
-
-                        graph = pointsToGraph(calcJet, points);
-
-                        //sumDisp2 = std::get<1>(bunch.compareWithPhaseFocus(
-                            //graph, 5, displacementWithFocus
-                        //));
-                        simi = bunch.compare(graph);
-
-                        #pragma omp critical
-                        {
-                            //if(sumDisp2 < minSumDisp2) {
-                            if(simi > maxSimi) {
-                                //minSumDisp2 = sumDisp2;
-                                maxSimi = simi;
-                                resultPoints = points;
-                                resultGraph = graph;
-                                resultScaleX = scaleX;
-                                resultScaleY = scaleY;
-                            }
-                        }
+    using Candidate = std::array<float, 4>;
+    ArgMax<Candidate> best;
+
+    #pragma omp parallel
+    {
+        ArgMax<Candidate> local;
+        Step3Scratch<N, K> scratch;
+
+        #pragma omp for collapse(4) schedule(static) nowait
+        for(int ix=0; ix<nScale; ix++){
+            for(int iy=0; iy<nScale; iy++){
+                for(int jx=-delta; jx<=delta; jx++){
+                    for(int jy=-delta; jy<=delta; jy++){
+                        Candidate candidate = {
+                            minScale + (float)ix*scaleStep,
+                            minScale + (float)iy*scaleStep,
+                            (float)jx,
+                            (float)jy
+                        };
+                        float simi = step3Evaluate(calcJet, bunch, 
+                            step2Points, candidate.data(), 0, memo, scratch,
+                            subpixel, cascade, local.getScore());
+
+                        long index = 
+                            ((ix*nScale + iy)*(2*delta + 1) + (jx + delta))*
+                            (2*delta + 1) + (jy + delta);
+                        local.update(simi, index, candidate);
                     }
                 }
             }
         }
 
+        #pragma omp critical
+        {
+            best.merge(local);
+            if(cascadeStats) {
+                cascadeStats->merge(scratch.cascade);
+            }
+        }
     }
 
-    bunch.xScale *= resultScaleX;
-    bunch.yScale *= resultScaleY;
+    std::copy(best.getCandidate().begin(), best.getCandidate().end(), params);
 
-    return std::make_tuple(
-        resultGraph,
-        resultPoints
+    return best.getScore();
+}
+
+// The pattern search of step3(): a coarse-to-fine search over
+// (scaleX, scaleY, tx, ty) within the same ranges as step3Grid(),
+// starting from params. All the neighbours of the current point at the
+// current steps are evaluated (in parallel), the best one becomes the
+// current point, and the steps are halved when none of them is better.
+// Stops when 'budget' graphs have been evaluated (the last round
+// evaluates only the neighbours the budget leaves), or when every step
+// is below options.step3Tolerance times its initial step.
+// params: the start point, and the best point on return.
+// return value: the similarity of params.
+template<int N, int K>
+float step3Pattern(
+    const CalcJet<N> &calcJet,
+    const BunchGraph<N> &bunch,
+    const Points<int, K> &step2Points,
+    SimilarityMemo *memo,
+    const MatchOptions &options,
+    int budget,
+    int shift,            // see step3Evaluate().
+    float *params
+)
+{
+    assert(budget > 0);
+    assert(options.step3Tolerance > 0.0F && options.step3Tolerance < 1.0F);
+
+    const int nParams = 4;
+    const float minParams[nParams] = {0.8F, 0.8F, -3.0F, -3.0F};
+    const float maxParams[nParams] = {1.2F, 1.2F, 3.0F, 3.0F};
+    const float initSteps[nParams] = {0.1F, 0.1F, 2.0F, 2.0F};
+    float steps[nParams], minSteps[nParams];
+    for(int i=0; i<nParams; i++){
+        steps[i] = initSteps[i];
+        minSteps[i] = initSteps[i] * options.step3Tolerance;
+    }
+    auto converged = [&]() {
+        for(int i=0; i<nParams; i++){
+            if(steps[i] >= minSteps[i]) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    Step3Scratch<N, K> scratch;
+    float maxSimi = step3Evaluate(calcJet, bunch, step2Points, params,
+        shift, memo, scratch, options.subpixel);
+    int nEvaluated = 1;
+
+    while(nEvaluated < budget && !converged()) {
+        // the neighbours: +step and -step on each parameter, as many as
+        // the budget allows.
+        const int maxNeighbours = 2*nParams;
+        const int nNeighbours = std::min(maxNeighbours, budget - nEvaluated);
+        float neighbours[maxNeighbours][nParams];
+        float simis[maxNeighbours];
+        for(int i=0; i<nNeighbours; i++){
+            std::copy(params, params + nParams, neighbours[i]);
+            float &param = neighbours[i][i/2];
+            param += (i%2 ? -1.0F : 1.0F) * steps[i/2];
+            param = std::min(std::max(param, minParams[i/2]), maxParams[i/2]);
+        }
+
+        #pragma omp parallel
+        {
+            Step3Scratch<N, K> scratch;
+
+            #pragma omp for schedule(static)
+            for(int i=0; i<nNeighbours; i++){
+                simis[i] = step3Evaluate(calcJet, bunch, step2Points, 
+                    neighbours[i], shift, memo, scratch, options.subpixel);
+            }
+        }
+        nEvaluated += nNeighbours;
+
+        // the first best neighbour, if it is better.
+        int best = std::max_element(simis, simis + nNeighbours) - simis;
+        if(simis[best] > maxSimi) {
+            maxSimi = simis[best];
+            std::copy(neighbours[best], neighbours[best] + nParams, params);
+        }
+        else {
+            for(float &step: steps){
+                step *= 0.5F;
+            }
+        }
+    }
+
+    return maxSimi;
+}
+
+
+// My algorithm.
+// Refine size and find aspect ratio and position, by step3Grid() or
+// step3Pattern() (options.step3Search).
+// If options.step3Rotation, the in-plane rotation of the face is
+// searched afterwards: for each rotation of shift*PI/ORIENTATIONS
+// (shift: -2 to 2, i.e. up to 45 degrees either way with 8
+// orientations), the scales and translation are
+// refined again by step3Pattern() with options.step3RotationBudget
+// graphs, since the scales found for a tilted face without rotation
+// are biased. The jets are rotated by shiftOrientations() instead of
+// being recalculated.
+// The scaling information will be stored in bunch::xScale
+// and bunch::yScale, and the rotation in bunch::orientationShift (0
+// without options.step3Rotation). The jets of the graph returned have
+// their orientations shifted back by it, like those compared by step4().
+// return value: 
+//     Graph graph, Points points
+template<int N, int K>
+std::tuple<Graph<N, K>,Points<int, K>> step3(
+    const CalcJet<N> &calcJet,
+    BunchGraph<N> &bunch,
+    const Points<int, K> &step2Points,
+    SimilarityMemo *memo = nullptr,  // if not null, the similarities
+                                     // are looked up in it first.
+    const MatchOptions &options = MatchOptions(),
+    double *rotationMs = nullptr,    // if not null, the time taken by
+                                     // the rotation search is stored
+                                     // in it, in milliseconds.
+    CascadeStats *cascadeStats = nullptr   // see step3Grid().
+)
+{
+    static_assert(std::numeric_limits<float>::is_iec559, "IEEE 754 required");
+    assert(!bunch.empty());
+    assert(!step2Points.empty());
+
+    // the memo is keyed by the rounded positions.
+    if(options.subpixel) {
+        memo = nullptr;
+    }
+
+    // scaleX, scaleY, tx, ty
+    float params[4] = {1.0F, 1.0F, 0.0F, 0.0F};
+    int shift = 0;
+    float maxSimi;
+
+    if(options.step3Search == Step3Search::PATTERN) {
+        maxSimi = step3Pattern(calcJet, bunch, step2Points, memo, 
+            options, options.step3Budget, 0, params);
+    }
+    else {
+        maxSimi = step3Grid(calcJet, bunch, step2Points, memo, params,
+            options.cascade, cascadeStats, options.subpixel);
+    }
+
+    if(options.step3Rotation) {
+        auto start = std::chrono::steady_clock::now();
+
+        for(int i: {-1, 1, -2, 2}){
+            float rotated[4] = {1.0F, 1.0F, 0.0F, 0.0F};
+            float simi = step3Pattern(calcJet, bunch, step2Points, memo,
+                options, options.step3RotationBudget, i, rotated);
+            if(simi > maxSimi) {
+                maxSimi = simi;
+                std::copy(rotated, rotated + 4, params);
+                shift = i;
+            }
+        }
+
+        auto end = std::chrono::steady_clock::now();
+        if(rotationMs) {
+            *rotationMs = 
+                std::chrono::duration<double, std::milli>(end - start).count();
+        }
+    }
+
+    if(maxSimi == -std::numeric_limits<float>::infinity()) {
+        throw std::out_of_range(
+            "Error in step3(): No graph is in the range of source image."
+        );
+    }
+
+    bunch.xScale *= params[0];
+    bunch.yScale *= params[1];
+    bunch.orientationShift = shift;
+
+    Points<int, K> resultPoints;
+    step3Points<N>(step2Points, params, shift, resultPoints);
+
+    Graph<N, K> resultGraph;
+    rotatedPointsToGraph(
+        calcJet, resultPoints, shift, options.subpixel, resultGraph
     );
 
+    return std::make_tuple(resultGraph, resultPoints);
+}
+
+// Local distortion, predicted by the displacement: each node is moved
+// by the displacement between its jet and the most similar model jet
+// of the bunch graph (BunchGraph::bestModel()), at most 4 pixels
+// either way. The 3x3 offsets around the predicted position and the
+// node itself are compared; the best one is refined to sub-pixel
+// precision by the displacement again, within half a pixel
+// (see Points::getExact()). The graph is built at the rounded points,
+// unless subpixel: then the predicted position is not rounded either,
+// and the jets are sampled at the sub-pixel positions (see
+// MatchOptions::subpixel).
+// The jets are compared in the orientations of bunch (shifted back by
+// bunch.orientationShift, like those of step3Graph), and the
+// displacements are rotated into the image.
+template<int N, int K>
+std::tuple<Graph<N, K>,Points<int, K>> step4Predict(
+    const CalcJet<N> &calcJet,
+    const BunchGraph<N> &bunch,
+    const Graph<N, K> &step3Graph,
+    SimilarityMemo *memo = nullptr,
+    bool subpixel = false
+)
+{
+    static_assert(std::numeric_limits<float>::is_iec559, "IEEE 754 required");
+    assert(!bunch.empty());
+    assert(!step3Graph.empty());
+
+    // the memo is keyed by the rounded positions.
+    if(subpixel) {
+        memo = nullptr;
+    }
+
+    int srcWidth, srcHeight;
+    std::tie(srcWidth, srcHeight) = calcJet.getSrcSize();
+
+    // the same range and weights as step4().
+    const float delta = 4.0F;
+    const float lambda = 2.0F;
+    const int focus = BankOf<N>::type::SCALES;
+
+    // the rotation of the face found by step3().
+    const int shift = bunch.orientationShift;
+    const float angle = 
+        (float)shift * PI/(float)BankOf<N>::type::ORIENTATIONS;
+    const float cosAngle = cosf(angle);
+    const float sinAngle = sinf(angle);
+    // a displacement between the jets, from the orientations of bunch
+    // into the image, in which the face is rotated by angle. 0 if it is
+    // not finite.
+    auto toImage = [&](float &dispX, float &dispY) {
+        if(!std::isfinite(dispX) || !std::isfinite(dispY)) {
+            dispX = dispY = 0.0F;
+        }
+        else if(shift != 0) {
+            float x = dispX*cosAngle - dispY*sinAngle;
+            dispY = dispX*sinAngle + dispY*cosAngle;
+            dispX = x;
+        }
+    };
+
+    Points<int, K> resultPoints = graphToPoints(step3Graph);
+
+    auto terms = bunch.initScoreTerms(step3Graph, focus, lambda, memo);
+
+    int nNodes = step3Graph.getNodes().size();
+    // the best position of each node, written by one thread each.
+    std::vector<std::pair<float, float>> bestPoints(nNodes);
+
+    #pragma omp parallel for schedule(static)
+    for(int n=0; n<nNodes; n++) {
+        const Jet<N> &base = step3Graph.getNodes()[n];
+        const Jet<N> &model =
+            bunch.getNodes()[n][bunch.bestModel(n, base)];
+
+        // the model jet is found at base - displacement.
+        float dispX, dispY;
+        std::tie(dispX, dispY) = displacementWithFocus(model, base, focus);
+        toImage(dispX, dispY);
+        dispX = std::min(std::max(dispX, -delta), delta);
+        dispY = std::min(std::max(dispY, -delta), delta);
+        float predX = (float)base.x - (subpixel ? dispX : round(dispX));
+        float predY = (float)base.y - (subpixel ? dispY : round(dispY));
+
+        // the node itself (a delta of 0), then the 3x3 offsets.
+        float maxDelta = 0.0F;
+        Jet<N> best = base;
+        float bestX = base.x, bestY = base.y;
+
+        for(int ix=-1; ix<=1; ix++) {
+            for(int iy=-1; iy<=1; iy++) {
+                float x = predX + (float)ix;
+                float y = predY + (float)iy;
+
+                if(x < 0.0F || x > (float)(srcWidth - 1) ||
+                   y < 0.0F || y > (float)(srcHeight - 1) ||
+                   (x == (float)base.x && y == (float)base.y)){
+                    continue;
+                }
+
+                Jet<N> jet = subpixel ?
+                    calcJet.calcJet(x, y) :
+                    calcJet.calcJet((int)x, (int)y);
+                if(shift != 0) {
+                    jet = shiftOrientations(jet, shift);
+                }
+                float simiDelta = bunch.moveNodeDelta(terms, n, jet, memo);
+
+                if(simiDelta > maxDelta) {
+                    maxDelta = simiDelta;
+                    best = jet;
+                    bestX = x;
+                    bestY = y;
+                }
+            }
+        }
+
+        std::tie(dispX, dispY) = displacementWithFocus(model, best, focus);
+        toImage(dispX, dispY);
+        bestPoints[n] = {
+            bestX + std::min(std::max(-dispX, -0.5F), 0.5F),
+            bestY + std::min(std::max(-dispY, -0.5F), 0.5F)
+        };
+    }
+
+    for(int n=0; n<nNodes; n++) {
+        resultPoints.modifyPointExact(
+            bestPoints[n].first, bestPoints[n].second, n
+        );
+    }
+
+    Graph<N, K> resultGraph;
+    rotatedPointsToGraph(calcJet, resultPoints, shift, subpixel, resultGraph);
+
+    return std::make_tuple(resultGraph, resultPoints);
 }
 
 // Local distortion.
-template<int N>
-std::tuple<Graph<N>,Points<int>> step4(
+// The jets are compared in the orientations of bunch (shifted back by
+// bunch.orientationShift, like those of step3Graph), and so are those
+// of the graph returned.
+template<int N, int K>
+std::tuple<Graph<N, K>,Points<int, K>> step4(
     const CalcJet<N> &calcJet,
     const BunchGraph<N> &bunch,
-    const Graph<N> &step3Graph
+    const Graph<N, K> &step3Graph,
+    SimilarityMemo *memo = nullptr,  // if not null, the similarities
+                                     // are looked up in it first.
+    const MatchOptions &options = MatchOptions()
 )
 {
+    if(options.step4Search == Step4Search::PREDICT) {
+        return step4Predict(
+            calcJet, bunch, step3Graph, memo, options.subpixel
+        );
+    }
+
     static_assert(std::numeric_limits<float>::is_iec559, "IEEE 754 required");
     assert(!bunch.empty());
     assert(!step3Graph.empty());
 
+    // the memo is keyed by the rounded positions, and the jets of
+    // step3Graph are sampled at the sub-pixel positions.
+    if(options.subpixel) {
+        memo = nullptr;
+    }
+
     int srcWidth, srcHeight;
     std::tie(srcWidth, srcHeight) = calcJet.getSrcSize();
 
     // the position of each node is varied between -delta and delta.
     const int delta = 4;
     const float lambda = 2.0F;
+    // all the scales of the bank.
+    const int focus = BankOf<N>::type::SCALES;
+    // the rotation of the face found by step3().
+    const int shift = bunch.orientationShift;
     
-    Points<int> resultPoints = graphToPoints(step3Graph);
+    Points<int, K> resultPoints = graphToPoints(step3Graph);
+
+    // Each node is moved alone, the other nodes stay where they are in
+    // step3Graph: only the score change of the node and its edges is
+    // computed for each offset.
+    auto terms = bunch.initScoreTerms(step3Graph, focus, lambda, memo);
 
     int nNodes = step3Graph.getNodes().size();
+    // the best position of each node, written by one thread each.
+    std::vector<std::pair<int, int>> bestPoints(nNodes);
+
     #pragma omp parallel for schedule(static)
     for(int n=0; n<nNodes; n++) {
-        Graph<N> graph;
-        float maxSimi;
+        const Jet<N> &base = step3Graph.getNodes()[n];
+        float maxDelta;
         int bestX, bestY;
 
-        maxSimi = -std::numeric_limits<float>::infinity(); 
-        graph = step3Graph;
-        bestX = step3Graph.getNodes()[n].x;
-        bestY = step3Graph.getNodes()[n].y;
+        maxDelta = -std::numeric_limits<float>::infinity(); 
+        bestX = base.x;
+        bestY = base.y;
 
         for(int ix=-delta; ix<=delta; ix++) {
             for(int iy=-delta; iy<=delta; iy++) {
                 int x, y;
                 float dispX, dispY, disp2;
-                float simi;
+                float simiDelta;
                 Jet<N> jet;
     
-                x = graph.getNodes()[n].x + ix;
-                y = graph.getNodes()[n].y + ix;
+                x = base.x + ix;
+                y = base.y + iy;
 
                 if(x < 0 || x >= srcWidth || y < 0 || y >= srcHeight ){
                     continue;
                 }
 
                 jet = calcJet.calcJet(x, y);
+                if(shift != 0) {
+                    jet = shiftOrientations(jet, shift);
+                }
                 std::tie(dispX, dispY) = displacementWithFocus(
-                    graph.getNodes()[n], jet, 5
+                    base, jet, focus
                 );
                 disp2 = dispX*dispX + dispY*dispY;
                 
@@ -513,31 +1517,138 @@ std::tuple<Graph<N>,Points<int>> step4(
                     continue;
                 }
 
-                graph.replaceNode(jet, n);
-
-                simi = std::get<0>(bunch.compareWithPhaseFocus(
-                    graph, 5, displacementWithFocus, lambda
-                ));
+                simiDelta = bunch.moveNodeDelta(terms, n, jet, memo);
 
-                if(simi > maxSimi) {
-                    maxSimi = simi;
+                if(simiDelta > maxDelta) {
+                    maxDelta = simiDelta;
                     bestX = x;
                     bestY = y;
                 }
             }
         }
 
-        #pragma omp critical
-        {
-            resultPoints.modifyPoint({bestX, bestY}, n);
-        }
+        bestPoints[n] = {bestX, bestY};
+    }
+
+    for(int n=0; n<nNodes; n++) {
+        resultPoints.modifyPoint({bestPoints[n].first, bestPoints[n].second}, n);
     }
 
-    Graph<N> resultGraph = pointsToGraph(calcJet, resultPoints);
+    Graph<N, K> resultGraph;
+    rotatedPointsToGraph(calcJet, resultPoints, shift, false, resultGraph);
 
     return std::make_tuple(resultGraph, resultPoints);
 
 }
 
 
-#undef PI
\ No newline at end of file
+#undef PI
+
+// The node counts of the bunch graphs for which matchGraph() uses
+// graphs and points of a fixed number of nodes, separated by commas.
+// 0: none. Set by the CMake cache variable of the same name.
+#ifndef EBGM_FIXED_NODE_COUNTS
+#define EBGM_FIXED_NODE_COUNTS 14
+#endif
+
+// step1() to step4(), with Graph<N, K> and Points<int, K>.
+template<int N, int K>
+std::tuple<Graph<N>,Points<int>> __matchGraph(
+    const CalcJet<N> &calcJet,
+    BunchGraph<N> &bunch,
+    const Points<int> &startPoints,
+    SimilarityMemo *memo,
+    const MatchOptions &options,
+    double *rotationMs,
+    CascadeStats *cascadeStats,
+    const CalcJet<N> *levelJets
+)
+{
+    Graph<N, K> graph;
+    Points<int, K> points(startPoints);
+
+    std::tie(graph, points) = step1(
+        calcJet, bunch, points, options, cascadeStats, levelJets
+    );
+    std::tie(graph, points) = step2(calcJet, bunch, points);
+    std::tie(graph, points) = step3(calcJet, bunch, points, memo, options,
+        rotationMs, cascadeStats ? cascadeStats + 1 : nullptr);
+    std::tie(graph, points) = step4(calcJet, bunch, graph, memo, options);
+
+    return std::make_tuple(Graph<N>(graph), Points<int>(points));
+}
+
+template<int N>
+std::tuple<Graph<N>,Points<int>> __matchGraph(
+    const CalcJet<N> &calcJet,
+    BunchGraph<N> &bunch,
+    const Points<int> &startPoints,
+    SimilarityMemo *memo,
+    const MatchOptions &options,
+    double *rotationMs,
+    CascadeStats *cascadeStats,
+    const CalcJet<N> *levelJets,
+    std::integer_sequence<int>
+)
+{
+    return __matchGraph<N, 0>(
+        calcJet, bunch, startPoints, memo, options, rotationMs, cascadeStats,
+        levelJets
+    );
+}
+
+template<int N, int K, int... Ks>
+std::tuple<Graph<N>,Points<int>> __matchGraph(
+    const CalcJet<N> &calcJet,
+    BunchGraph<N> &bunch,
+    const Points<int> &startPoints,
+    SimilarityMemo *memo,
+    const MatchOptions &options,
+    double *rotationMs,
+    CascadeStats *cascadeStats,
+    const CalcJet<N> *levelJets,
+    std::integer_sequence<int, K, Ks...>
+)
+{
+    if(K > 0 && (int)bunch.getNodes().size() == K) {
+        return __matchGraph<N, K>(
+            calcJet, bunch, startPoints, memo, options, rotationMs,
+            cascadeStats, levelJets
+        );
+    }
+    return __matchGraph(
+        calcJet, bunch, startPoints, memo, options, rotationMs, cascadeStats,
+        levelJets, std::integer_sequence<int, Ks...>()
+    );
+}
+
+// Match the bunch graph with an image: step1() to step4().
+// If the bunch graph has one of EBGM_FIXED_NODE_COUNTS nodes, the
+// steps use graphs and points of that fixed number of nodes (no heap
+// allocation for them, and unrolled loops over their nodes and edges).
+// Otherwise they use Graph<N> and Points<int>. The results are the
+// same either way.
+// return value: Graph graph, Points points
+template<int N>
+std::tuple<Graph<N>,Points<int>> matchGraph(
+    const CalcJet<N> &calcJet,
+    BunchGraph<N> &bunch,
+    const Points<int> &startPoints,
+    SimilarityMemo *memo = nullptr,  // shared by step3() and step4().
+    const MatchOptions &options = MatchOptions(),
+    double *rotationMs = nullptr,    // see step3().
+    CascadeStats *cascadeStats = nullptr,  // if not null, the graphs of
+                                           // options.cascade in step1()
+                                           // and step3() are counted
+                                           // into cascadeStats[0] and
+                                           // cascadeStats[1].
+    const CalcJet<N> *levelJets = nullptr  // see step1().
+)
+{
+    assert(bunch.getNodes().size() == startPoints.size());
+
+    return __matchGraph(
+        calcJet, bunch, startPoints, memo, options, rotationMs, cascadeStats,
+        levelJets, std::integer_sequence<int, EBGM_FIXED_NODE_COUNTS>()
+    );
+}
@@ -0,0 +1,63 @@
+#include "cpu.h"
+
+#include <atomic>
+
+using namespace std;
+
+
+static CpuLevel detect()
+{
+#ifdef EBGM_CPU_DISPATCH
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        return CpuLevel::AVX512;
+    }
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return CpuLevel::AVX2;
+    }
+    if(__builtin_cpu_supports("sse4.2")) {
+        return CpuLevel::SSE42;
+    }
+#endif
+    return CpuLevel::GENERIC;
+}
+
+CpuLevel detectedCpuLevel()
+{
+    static const CpuLevel level = detect();
+    return level;
+}
+
+// -1: not set, i.e. detectedCpuLevel().
+static atomic<int> g_cpuLevel(-1);
+
+CpuLevel cpuLevel()
+{
+    int level = g_cpuLevel.load(memory_order_relaxed);
+    if(level < 0) {
+        return detectedCpuLevel();
+    }
+    return (CpuLevel)level;
+}
+
+void setCpuLevel(CpuLevel level)
+{
+    if((int)level > (int)detectedCpuLevel()) {
+        level = detectedCpuLevel();
+    }
+    g_cpuLevel.store((int)level, memory_order_relaxed);
+}
+
+const char *cpuLevelName(CpuLevel level)
+{
+    switch(level) {
+    case CpuLevel::SSE42:
+        return "SSE4.2";
+    case CpuLevel::AVX2:
+        return "AVX2";
+    case CpuLevel::AVX512:
+        return "AVX-512";
+    default:
+        return "generic";
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+// Runtime dispatch of the numeric kernels on the instruction sets of
+// the CPU. The kernels are compiled for each level with the target
+// attribute of GCC and Clang, and the best level supported by the CPU
+// is chosen when a kernel is called, so one binary built for the
+// baseline x86-64 uses AVX2 or AVX-512 where they are available.
+//
+// The kernels dispatched: the convolution (Convolution::calcConvBank(),
+// used by the lazy jets; the FFT is OpenCV's), the complex-to-polar
+// conversion (fastComplex2mag(), or libmComplex2mag() out of the fast
+// math mode), the jet comparison (Jet::compareWithPhase(): the
+// fast math kernel, or libmPhaseCos()), the comparison with a bunch
+// graph (BunchGraph::compare(), by planeDots()) and the scoring of a
+// bunch node (BunchGraph::compareNodeWithPhase()). The atan() and cos()
+// of libm, called by libmComplex2mag() and libmPhaseCos(), stay scalar.
+// Except for the convolution, which uses FMA from AVX2 on, the results
+// are the same at all the levels.
+//
+// Other compilers and CPUs only have the GENERIC level, i.e. what the
+// compiler picks at build time.
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define EBGM_CPU_DISPATCH
+// A kernel compiled for the instruction sets isa, e.g. "avx2".
+#define EBGM_TARGET(isa) __attribute__((target(isa)))
+// The body of a kernel, shared by all the levels: inlined into the
+// function of each level, and compiled for its instruction sets.
+#define EBGM_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define EBGM_TARGET(isa)
+#define EBGM_ALWAYS_INLINE inline
+#endif
+
+// The levels, from the oldest CPUs.
+enum class CpuLevel {
+    GENERIC,    // the instruction sets of the build (SSE2 on x86-64)
+    SSE42,      // SSE4.2
+    AVX2,       // AVX2 and FMA
+    AVX512      // AVX-512F
+};
+
+// The best level supported by the CPU (detected once).
+CpuLevel detectedCpuLevel();
+
+// The level used by the kernels: detectedCpuLevel(), unless lowered
+// by setCpuLevel().
+CpuLevel cpuLevel();
+
+// Use at most level, e.g. to compare the kernels of different levels.
+// Levels above detectedCpuLevel() are lowered to it.
+void setCpuLevel(CpuLevel level);
+
+// "generic", "SSE4.2", "AVX2" or "AVX-512".
+const char *cpuLevelName(CpuLevel level);
@@ -1,4 +1,5 @@
 #include "cvutils.h"
+#include "fastmath.h"
 
 #include <tuple>
 
@@ -17,6 +18,7 @@ using namespace Eigen;
 // Convert real and imaginary parts of complex numbers
 // to magnitudes and phases. Phases are within [-0.5pi, 1.5pi).
 // The depth of Re and Im must be CV_32F.
+// In the fast math mode (see setFastMath()), by fastComplex2mag().
 std::tuple<cv::Mat/*Magnitude*/,cv::Mat/*Phase*/>
 complex2magF(const cv::Mat &Re, const cv::Mat &Im)
 {
@@ -24,6 +26,16 @@ complex2magF(const cv::Mat &Re, const cv::Mat &Im)
     assert(Re.type() == Im.type());
     assert(Re.size == Im.size);
 
+    if(fastMath() && Re.dims == 2 &&
+        Re.isContinuous() && Im.isContinuous()) {
+        Mat mag(Re.rows, Re.cols, Re.type());
+        Mat phase(Re.rows, Re.cols, Re.type());
+        fastComplex2mag((const float*)Re.data, (const float*)Im.data,
+            (float*)mag.data, (float*)phase.data,
+            Re.total()*Re.channels());
+        return make_tuple(mag, phase);
+    }
+
     Mat mag = Re.mul(Re) + Im.mul(Im);
     cv::pow(mag, 0.5, mag);
 
@@ -2,6 +2,7 @@
 #include "kernels.h"
 #include "cvutils.h"
 #include "utils.h"
+#include "cpu.h"
 #include "alg.h"
 #include "graph.hpp"
 #include "jet.hpp"
@@ -36,9 +37,16 @@ int main_recog(int argc, char* argv[]);
 // process common command-line arguments
 void common_args(char *arg);
 
+// run with the kernel bank of Cfg::kernelBank.
 int train();
 int recog();
 
+template<typename Bank> int trainWithBank();
+template<typename Bank> int recogWithBank();
+
+// log the instruction sets the numeric kernels use (see cpu.h).
+void logCpuLevel();
+
 
 iofiles Cfg::bunchFiles;
 boost::filesystem::path Cfg::bunchDirectory;
@@ -47,6 +55,11 @@ iofiles Cfg::knownGraphFiles;
 std::string Cfg::startGraphFile;
 std::string Cfg::recogResultFile;
 bool Cfg::noOverwrite = false;
+float Cfg::kernelTruncation = 0.0F;
+size_t Cfg::jetsMemory = 0;
+JetStorage Cfg::jetsStorage = JetStorage::FLOAT32;
+MatchOptions Cfg::matchOptions;
+GaborBankType Cfg::kernelBank = GaborBankType::BANK_5X8;
 
 
 const char *helptext =
@@ -96,6 +109,99 @@ Common Options:
     Skip current input file if the corresponding output file exists.
     Zero-length files are considered to be non-exsistent.
 
+    --kernel-truncation <ratio>
+    Truncate the Gabor kernels of each scale to the smallest square
+    that loses at most <ratio> of their energy (e.g. 0.001). The
+    default is 0 (no truncation). The ".jets" files generated with
+    other kernels are detected and regenerated automatically.
+
+    --kernel-bank <5x8|3x6>
+    The Gabor kernels used to calculate the jets: <scales>x<orientations>.
+    5x8: the 40 kernels of the original algorithm. 3x6: 18 kernels over
+    the same range of scales, which calculates and compares the jets
+    about twice as fast, but may be less accurate. The default is 5x8.
+    The ".graph" files of one bank can not be used with another bank.
+
+    --jets-memory <MB>
+    Compute the jets of an image on demand, tile by tile, and keep at
+    most <MB> megabytes of them in memory (least recently used tiles
+    are released first). Useful for large images. The ".jets" files
+    are neither read nor generated in this mode. With --step1-pyramid,
+    the jets of the downsampled image are computed on demand too, and
+    count toward the same <MB>.
+
+    --jets-storage <float32|fp16|log8>
+    How the jets are stored in memory and in the ".jets" files.
+    fp16: 16-bit magnitudes and phases (half the size of float32).
+    log8: 8-bit log-quantized magnitudes and 8-bit phases (a quarter
+    of the size). The default is float32. The ".jets" files with
+    another storage are regenerated. Ignored with --jets-memory.
+
+    --step1-maps
+    Find the approximate face position by per-node similarity maps:
+    every translation (1-pixel step) is scored, with each jet compared
+    with each node of the bunch graph only once. By default, graphs
+    are built and compared on a 4-pixel lattice, then refined.
+
+    --step3-search <grid|pattern>
+    How the size, aspect ratio and position of the face are refined.
+    grid: try all of the 5x5 scales and 7x7 translations (1225 graphs).
+    pattern: a coarse-to-fine pattern search, which usually needs
+    5-10 times fewer graphs and finds finer scales. The default is grid.
+
+    --step3-budget <n>
+    The max number of graphs tried by "--step3-search pattern".
+    The default is 200.
+
+    --step3-tolerance <ratio>
+    "--step3-search pattern" stops when the steps of the scales and of
+    the translations are all below <ratio> of their initial steps
+    (0.1 for the scales, 2 pixels for the translations), within (0, 1).
+    The default is 0.1.
+
+    --step3-rotation
+    Also find the in-plane rotation of the face (up to 45 degrees
+    either way, in steps of 22.5 degrees; 60 and 30 degrees with
+    "--kernel-bank 3x6"). At most 240 more graphs are tried per image,
+    whose jets are rotated instead of recalculated.
+    The time taken is logged for each image.
+
+    --cascade
+    Compare the graphs of the face position search (step 1) on the
+    coarsest two scales of the kernels first, and on all the scales
+    only if they can still be the best. The results are the same.
+    The number of graphs rejected early is logged for each image.
+
+    --step1-pyramid <levels>
+    Find the approximate face position on the image downsampled
+    <levels> times (1 or 2) first, with the finer scales of the kernels
+    left out, then refine the 4 best positions at full resolution.
+    Much fewer graphs are compared on large images. Only the scales
+    the levels have in common are compared, so it may be less accurate.
+
+    --step4-search <window|predict>
+    How the position of each key point is refined at last.
+    window: try all the positions of a 9x9 window (81 jets per point).
+    predict: move the point by the displacement estimated between its
+    jet and the most similar jet of the bunch graph, and try only the
+    3x3 positions around the new one (up to 10 jets per point).
+    Faster, but the result may be a little worse.
+    The default is window.
+
+    --subpixel
+    Calculate the jets of the size and aspect ratio search (step 3) and
+    of "--step4-search predict" at the exact sub-pixel positions of
+    the key points, interpolated from the jets of the 4 nearest pixels,
+    instead of rounding them. Finer scales can be told apart, mostly
+    with "--step3-search pattern"; step 3 takes about 10 times longer.
+
+    --fast-math
+    Use faster approximations of atan2, sin, cos and 1/sqrt (within
+    5e-6) instead of the C library when calculating and comparing the
+    jets. The similarities differ from the default by about 5e-6; the
+    points found are almost always the same. The ".jets" files
+    generated in the other mode are regenerated.
+
 <input>:
 
     Input image file name or directory name. If it is a directory, you can
@@ -157,6 +263,67 @@ void common_args(char *arg)
             state = 0;
             break;
         }
+        else if(!strcmp(arg, "--kernel-truncation")){
+            state = 3;
+            break;
+        }
+        else if(!strcmp(arg, "--jets-memory")){
+            state = 4;
+            break;
+        }
+        else if(!strcmp(arg, "--jets-storage")){
+            state = 5;
+            break;
+        }
+        else if(!strcmp(arg, "--step1-maps")){
+            Cfg::matchOptions.step1Maps = true;
+            state = 0;
+            break;
+        }
+        else if(!strcmp(arg, "--step3-search")){
+            state = 6;
+            break;
+        }
+        else if(!strcmp(arg, "--step3-budget")){
+            state = 7;
+            break;
+        }
+        else if(!strcmp(arg, "--step3-tolerance")){
+            state = 11;
+            break;
+        }
+        else if(!strcmp(arg, "--step3-rotation")){
+            Cfg::matchOptions.step3Rotation = true;
+            state = 0;
+            break;
+        }
+        else if(!strcmp(arg, "--cascade")){
+            Cfg::matchOptions.cascade = true;
+            state = 0;
+            break;
+        }
+        else if(!strcmp(arg, "--kernel-bank")){
+            state = 8;
+            break;
+        }
+        else if(!strcmp(arg, "--step1-pyramid")){
+            state = 9;
+            break;
+        }
+        else if(!strcmp(arg, "--step4-search")){
+            state = 10;
+            break;
+        }
+        else if(!strcmp(arg, "--subpixel")){
+            Cfg::matchOptions.subpixel = true;
+            state = 0;
+            break;
+        }
+        else if(!strcmp(arg, "--fast-math")){
+            setFastMath(true);
+            state = 0;
+            break;
+        }
         errmsg = string("Unrecognized parameter: '") + arg + "'.";
         Log::error(errmsg);
         throw(runtime_error(errmsg));
@@ -192,6 +359,153 @@ void common_args(char *arg)
         throw(runtime_error(errmsg));
         break;
 
+    case 3:        // after --kernel-truncation
+        try{
+            float ratio = stof(arg);
+            if(ratio >= 0.0F && ratio < 1.0F){
+                Cfg::kernelTruncation = ratio;
+                state = 0;
+                break;
+            }
+        }
+        catch(...){
+        }
+        errmsg = string("The ratio of --kernel-truncation must be "
+            "within [0, 1): '") + arg + "'.";
+        Log::error(errmsg);
+        throw(runtime_error(errmsg));
+        break;
+
+    case 4:        // after --jets-memory
+        try{
+            int mb = stoi(arg);
+            if(mb > 0){
+                Cfg::jetsMemory = size_t(mb) * 1024U * 1024U;
+                state = 0;
+                break;
+            }
+        }
+        catch(...){
+        }
+        errmsg = string("The size of --jets-memory must be "
+            "a positive integer: '") + arg + "'.";
+        Log::error(errmsg);
+        throw(runtime_error(errmsg));
+        break;
+
+    case 5:        // after --jets-storage
+        if(parseJetStorage(arg, Cfg::jetsStorage)){
+            state = 0;
+            break;
+        }
+        errmsg = string("The storage of --jets-storage must be "
+            "float32, fp16 or log8: '") + arg + "'.";
+        Log::error(errmsg);
+        throw(runtime_error(errmsg));
+        break;
+
+    case 6:        // after --step3-search
+        if(!strcmp(arg, "grid")){
+            Cfg::matchOptions.step3Search = Step3Search::GRID;
+            state = 0;
+            break;
+        }
+        else if(!strcmp(arg, "pattern")){
+            Cfg::matchOptions.step3Search = Step3Search::PATTERN;
+            state = 0;
+            break;
+        }
+        errmsg = string("The strategy of --step3-search must be "
+            "grid or pattern: '") + arg + "'.";
+        Log::error(errmsg);
+        throw(runtime_error(errmsg));
+        break;
+
+    case 7:        // after --step3-budget
+        try{
+            int budget = stoi(arg);
+            if(budget > 0){
+                Cfg::matchOptions.step3Budget = budget;
+                state = 0;
+                break;
+            }
+        }
+        catch(...){
+        }
+        errmsg = string("The number of --step3-budget must be "
+            "a positive integer: '") + arg + "'.";
+        Log::error(errmsg);
+        throw(runtime_error(errmsg));
+        break;
+
+    case 8:        // after --kernel-bank
+        if(!strcmp(arg, "5x8")){
+            Cfg::kernelBank = GaborBankType::BANK_5X8;
+            state = 0;
+            break;
+        }
+        else if(!strcmp(arg, "3x6")){
+            Cfg::kernelBank = GaborBankType::BANK_3X6;
+            state = 0;
+            break;
+        }
+        errmsg = string("The bank of --kernel-bank must be "
+            "5x8 or 3x6: '") + arg + "'.";
+        Log::error(errmsg);
+        throw(runtime_error(errmsg));
+        break;
+
+    case 9:        // after --step1-pyramid
+        try{
+            int levels = stoi(arg);
+            if(levels == 1 || levels == 2){
+                Cfg::matchOptions.step1Levels = levels;
+                state = 0;
+                break;
+            }
+        }
+        catch(...){
+        }
+        errmsg = string("The number of --step1-pyramid must be "
+            "1 or 2: '") + arg + "'.";
+        Log::error(errmsg);
+        throw(runtime_error(errmsg));
+        break;
+
+    case 10:       // after --step4-search
+        if(!strcmp(arg, "window")){
+            Cfg::matchOptions.step4Search = Step4Search::WINDOW;
+            state = 0;
+            break;
+        }
+        else if(!strcmp(arg, "predict")){
+            Cfg::matchOptions.step4Search = Step4Search::PREDICT;
+            state = 0;
+            break;
+        }
+        errmsg = string("The strategy of --step4-search must be "
+            "window or predict: '") + arg + "'.";
+        Log::error(errmsg);
+        throw(runtime_error(errmsg));
+        break;
+
+    case 11:       // after --step3-tolerance
+        try{
+            float ratio = stof(arg);
+            if(ratio > 0.0F && ratio < 1.0F){
+                Cfg::matchOptions.step3Tolerance = ratio;
+                state = 0;
+                break;
+            }
+        }
+        catch(...){
+        }
+        errmsg = string("The ratio of --step3-tolerance must be "
+            "within (0, 1): '") + arg + "'.";
+        Log::error(errmsg);
+        throw(runtime_error(errmsg));
+        break;
+
     default:
         errmsg = "Unknown state in common_args().";
         Log::error(errmsg);
@@ -457,15 +771,46 @@ int main_recog(int argc, char* argv[])
 }
 
 
+void logCpuLevel()
+{
+    // the jets are convolved by calcConvBank() only when computed lazily;
+    // otherwise by the FFT of OpenCV.
+    string kernels = "bunch comparisons, ";
+    if(fastMath()) {
+        kernels += "complex-to-polar conversion, jet comparisons";
+    } else {
+        kernels += "complex-to-polar conversion and jet comparisons "
+            "(except their atan() and cos(), see --fast-math)";
+    }
+    if(Cfg::jetsMemory != 0) {
+        kernels += ", convolution";
+    }
+    Log::info(string("Numeric kernels: ") + cpuLevelName(cpuLevel()) + 
+        " for the " + kernels + ".");
+}
+
 int train()
+{
+    logCpuLevel();
+
+    switch(Cfg::kernelBank) {
+    case GaborBankType::BANK_3X6:
+        return trainWithBank<Bank3x6>();
+    default:
+        return trainWithBank<Bank5x8>();
+    }
+}
+
+template<typename Bank>
+int trainWithBank()
 {
     using namespace boost::filesystem;
 
-    Kernels<40> kernels;
-    genGaborKernels(101, kernels);
+    Kernels<Bank::N> kernels;
+    genGaborKernels(Bank::KERNEL_SIZE, kernels, Cfg::kernelTruncation);
 
-    Graph<40> graph;
-    BunchGraph<40> bunch;
+    Graph<Bank::N> graph;
+    BunchGraph<Bank::N> bunch;
     Points<int> points;
     Points<int> startPoints;
     bool modified;
@@ -630,18 +975,31 @@ int train()
 }
 
 int recog()
+{
+    logCpuLevel();
+
+    switch(Cfg::kernelBank) {
+    case GaborBankType::BANK_3X6:
+        return recogWithBank<Bank3x6>();
+    default:
+        return recogWithBank<Bank5x8>();
+    }
+}
+
+template<typename Bank>
+int recogWithBank()
 {
     using namespace boost::filesystem;
 
-    Kernels<40> kernels;
-    genGaborKernels(101, kernels);
+    Kernels<Bank::N> kernels;
+    genGaborKernels(Bank::KERNEL_SIZE, kernels, Cfg::kernelTruncation);
 
-    Graph<40> graph;
-    BunchGraph<40> bunch;
+    Graph<Bank::N> graph;
+    BunchGraph<Bank::N> bunch;
     Points<int> points;
     Points<int> startPoints;
     bool modified;
-    vector<tuple<Graph<40>,string>> knownGraphs;
+    vector<tuple<Graph<Bank::N>,string>> knownGraphs;
     std::ofstream resultfile;
 
     path ifilepath, ofilepath;
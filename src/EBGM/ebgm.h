@@ -29,75 +29,152 @@ public:
     static std::string startGraphFile;
     static std::string recogResultFile;
     static bool noOverwrite;
+    static float kernelTruncation;
+    static size_t jetsMemory;       // in bytes, 0: not in lazy mode
+    static JetStorage jetsStorage;
+    static MatchOptions matchOptions;
+    static GaborBankType kernelBank;
 };
 
 
+// Read an image file in grayscale: 8UC1 (if the image file is 8-bit).
+// Throw a runtime_error if failed.
+inline cv::Mat __readGrayImage(const std::string &imgfilename)
+{
+    cv::Mat image = cv::imread(imgfilename, cv::IMREAD_GRAYSCALE);
+    if(image.data == NULL) {
+        std::string err = 
+            std::string("Failed to open image file: '") + imgfilename + "'.";
+        Log::error(err);
+        throw std::runtime_error(err);
+    }
+    return image;
+}
+
+
 // If both the image file and the cache file exists, use the cache.
-// Else, generate new cache file. 
+// Else, generate new cache file from image, the content of the file.
 // You should pass image files ONLY!
 template<int N> CalcJet<N> __getCalcJetWithCache(
     const std::string &imgfilename,
+    const cv::Mat &image,
     const Kernels<N> &kernels
 )
 {
     CalcJet<N> ret;
-    std::string err;
-
-    cv::Mat image;
-    // image: 8UC1 (if image file is 8-bit)
-    image = cv::imread(imgfilename, cv::IMREAD_GRAYSCALE);
-    if(image.data == NULL) {
-        err = std::string("Failed to open image file: '") + imgfilename + "'.";
-        Log::error(err);
-        throw std::runtime_error(err);
-    }
 
     std::string cachename = imgfilename + ".jets";
     if(fileexists(cachename)){
         try {
-            ret.m_kx = kernels.kx;
-            ret.m_ky = kernels.ky;
-
-            std::ifstream cachefile(cachename);
-            boost::archive::binary_iarchive ia(cachefile);
-            ia >> ret;
+            ret.mapFile(cachename, kernels, Cfg::jetsStorage);
+            if(ret.getSrcSize() != std::make_tuple(image.cols, image.rows)) {
+                throw std::runtime_error("The size of the image has changed.");
+            }
 
             Log::info(std::string("Using cache: '") + cachename + "'.");
 
             return ret;
         }
-        catch(...) {
+        catch(const std::exception &e) {
             // if failed to read the cache file, regenerate it.
             Log::warning(
                 std::string("Failed to read cache file: '") +
                 cachename +
-                "'. "
+                "'. " +
+                e.what()
             );
         }
     }
 
-    image.convertTo(image, CV_32F);
-    ret.init(image, kernels, 101, 101);
+    cv::Mat image32F;
+    image.convertTo(image32F, CV_32F);
+    int maxKernelRows, maxKernelCols;
+    std::tie(maxKernelRows, maxKernelCols) = kernels.getMaxSize();
+    ret.init(image32F, kernels, maxKernelRows, maxKernelCols, 
+        ConvMethod::FFT, Cfg::jetsStorage);
 
     try {
-        std::ofstream cachefile(cachename, std::ios::trunc);
-        boost::archive::binary_oarchive oa(cachefile);
-        oa << ret;
+        ret.saveFile(cachename, kernels);
 
         Log::info(std::string("Generated cache: '") + cachename + "'.");
     }
-    catch(...) {
+    catch(const std::exception &e) {
         // if failed to generate the cache file
         Log::warning(
             std::string("Failed to generate cache file: '") +
             cachename +
-            "'. "
+            "'. " +
+            e.what()
         );
     }
 
     return ret;
 }
 
+template<int N> CalcJet<N> __getCalcJetWithCache(
+    const std::string &imgfilename,
+    const Kernels<N> &kernels
+)
+{
+    return __getCalcJetWithCache(
+        imgfilename, __readGrayImage(imgfilename), kernels
+    );
+}
+
+
+// Compute the jets of image on demand, with at most maxMemory bytes
+// of jets in memory. Does not use the cache file.
+template<int N> CalcJet<N> __getLazyCalcJet(
+    const cv::Mat &image,
+    const Kernels<N> &kernels,
+    size_t maxMemory
+)
+{
+    CalcJet<N> ret;
+
+    cv::Mat image32F;
+    image.convertTo(image32F, CV_32F);
+    int maxKernelRows, maxKernelCols;
+    std::tie(maxKernelRows, maxKernelCols) = kernels.getMaxSize();
+    ret.initLazy(image32F, kernels, maxKernelRows, maxKernelCols, maxMemory);
+
+    return ret;
+}
+
+
+// The bytes of jets the image pyramid of step1() (see
+// getDownsampledCalcJet()) may keep in memory in lazy mode: its share
+// of Cfg::jetsMemory, in proportion to its number of pixels (1/4 per
+// level), so that the jets of the image and of the pyramid together
+// stay within Cfg::jetsMemory. 0 if not in lazy mode or without a
+// pyramid.
+inline size_t __pyramidJetsMemory()
+{
+    int levels = Cfg::matchOptions.step1Levels;
+    if(Cfg::jetsMemory == 0 || levels <= 0) {
+        return 0;
+    }
+    return Cfg::jetsMemory / ((size_t(1) << 2*levels) + 1);
+}
+
+
+// Get jet calculator for a file, whose content is image (see
+// __readGrayImage()).
+// You should pass image files ONLY!
+template<int N>
+CalcJet<N> getCalcJet(
+    const std::string &imgfilename, 
+    const cv::Mat &image,
+    const Kernels<N> &kernels
+)
+{
+    if(Cfg::jetsMemory > 0){
+        return __getLazyCalcJet(
+            image, kernels, Cfg::jetsMemory - __pyramidJetsMemory()
+        );
+    }
+    return __getCalcJetWithCache(imgfilename, image, kernels);
+}
 
 // Get jet calculator for a file.
 // You should pass image files ONLY!
@@ -107,7 +184,30 @@ CalcJet<N> getCalcJet(
     const Kernels<N> &kernels
 )
 {
-    return __getCalcJetWithCache(imgfilename, kernels);
+    return getCalcJet(imgfilename, __readGrayImage(imgfilename), kernels);
+}
+
+
+// Get jet calculator for image (see __readGrayImage()) downsampled
+// 'levels' times (see step1Pyramid()). Does not use the cache file.
+// In lazy mode, the jets are computed on demand within
+// __pyramidJetsMemory() bytes.
+template<int N>
+CalcJet<N> getDownsampledCalcJet(
+    const cv::Mat &image,
+    const Kernels<N> &kernels,
+    int levels
+)
+{
+    CalcJet<N> ret;
+
+    cv::Mat image32F;
+    image.convertTo(image32F, CV_32F);
+    initDownsampledJets(
+        ret, image32F, kernels, levels, __pyramidJetsMemory()
+    );
+
+    return ret;
 }
 
 
@@ -130,7 +230,8 @@ std::tuple<Graph<N>, Points<int>, bool> genGraph(
     Points<int> points;
     bool modified = false;
 
-    CalcJet<N> calcJet = getCalcJet(imgfilename, kernels);
+    cv::Mat grayImg = __readGrayImage(imgfilename);
+    CalcJet<N> calcJet = getCalcJet(imgfilename, grayImg, kernels);
     cv::Mat rgbImg = cv::imread(imgfilename, cv::IMREAD_COLOR);
 
     if(startPoints.empty()){
@@ -161,10 +262,43 @@ std::tuple<Graph<N>, Points<int>, bool> genGraph(
     }
 
     try {
-        std::tie(graph, points) = step1(calcJet, bunch, startPoints);
-        std::tie(graph, points) = step2(calcJet, bunch, points);
-        std::tie(graph, points) = step3(calcJet, bunch, points);
-        std::tie(graph, points) = step4(calcJet, bunch, graph);
+        // the similarities computed by step3 and step4 are shared.
+        SimilarityMemo memo;
+        double rotationMs = 0;
+        CascadeStats cascadeStats[2];
+        CalcJet<N> levelJets;
+        if(Cfg::matchOptions.step1Levels > 0) {
+            levelJets = getDownsampledCalcJet(
+                grayImg, kernels, Cfg::matchOptions.step1Levels
+            );
+        }
+        std::tie(graph, points) = matchGraph(calcJet, bunch, startPoints,
+            &memo, Cfg::matchOptions, &rotationMs, cascadeStats,
+            &levelJets);
+        if(Cfg::matchOptions.step3Rotation) {
+            Log::info(
+                std::string("Rotation search of '") + imgfilename + "': " +
+                std::to_string(rotationMs) + " ms."
+            );
+        }
+        if(Cfg::matchOptions.cascade) {
+            const char *steps[2] = {"step1", "step3"};
+            for(int i=0; i<2; i++) {
+                const CascadeStats &stats = cascadeStats[i];
+                if(stats.coarse == 0) {
+                    continue;
+                }
+                Log::info(
+                    std::string("Cascade of ") + steps[i] + " of '" +
+                    imgfilename + "': " + std::to_string(stats.coarse) +
+                    " graphs compared on the coarse bands, " +
+                    std::to_string(stats.coarse - stats.full) + " (" +
+                    std::to_string(
+                        100*(stats.coarse - stats.full) / stats.coarse
+                    ) + "%) rejected."
+                );
+            }
+        }
     }
     catch(std::exception err){
         std::string errstr = 
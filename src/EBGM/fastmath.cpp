@@ -0,0 +1,738 @@
+#include "fastmath.h"
+#include "cpu.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+
+static atomic<bool> g_fastMath(false);
+
+void setFastMath(bool on)
+{
+    g_fastMath.store(on, memory_order_relaxed);
+}
+
+bool fastMath()
+{
+    return g_fastMath.load(memory_order_relaxed);
+}
+
+
+// The kernels below are written once (the *Loop() functions) and
+// compiled for each level of cpu.h by the functions that inline them.
+// The loops are vectorized by the compiler; -ffp-contract=off (see
+// CMakeLists.txt) keeps the results the same at all the levels.
+
+static EBGM_ALWAYS_INLINE void complex2magLoop(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+)
+{
+    for(int i=0; i<n; i++) {
+        float square = re[i]*re[i] + im[i]*im[i];
+        float angle = fastAtan2(im[i], re[i]);
+        mag[i] = square*fastRsqrt(square);
+        phase[i] = angle + (angle < -1.57079633F ? 6.28318531F : 0.0F);
+    }
+}
+
+static EBGM_ALWAYS_INLINE void phaseCosLoop(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+)
+{
+    for(int i=0; i<n; i++) {
+        float sinValue;
+        fastSinCos(p1[i] - p2[i] - (dx*kx[i] + dy*ky[i]),
+            sinValue, cosValue[i]);
+    }
+}
+
+static EBGM_ALWAYS_INLINE void libmComplex2magLoop(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+)
+{
+    // the PI of utils.h, added in double by complex2mag().
+    const double pi = 3.14159265358979323846;
+
+    // vectorized: sqrtf() is an instruction with -fno-math-errno (see
+    // CMakeLists.txt), and the sum of squares is never negative.
+    for(int i=0; i<n; i++) {
+        mag[i] = sqrtf(re[i]*re[i] + im[i]*im[i]);
+        phase[i] = im[i]/re[i];
+    }
+    for(int i=0; i<n; i++) {
+        phase[i] = (float)atan((double)phase[i]);
+    }
+    // phase += pi if re < 0, selected on the bits (see fastSinCos()),
+    // so that -0 stays -0 otherwise.
+    for(int i=0; i<n; i++) {
+        float shifted = (float)((double)phase[i] + pi);
+        uint32_t phaseBits, shiftedBits;
+        std::memcpy(&phaseBits, &phase[i], sizeof(phaseBits));
+        std::memcpy(&shiftedBits, &shifted, sizeof(shiftedBits));
+        uint32_t negative = 0U - (uint32_t)(re[i] < 0.0F);
+        phaseBits = (shiftedBits & negative) | (phaseBits & ~negative);
+        std::memcpy(&phase[i], &phaseBits, sizeof(phaseBits));
+    }
+}
+
+static EBGM_ALWAYS_INLINE void libmPhaseCosLoop(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+)
+{
+    for(int i=0; i<n; i++) {
+        cosValue[i] = p1[i] - p2[i] - (dx*kx[i] + dy*ky[i]);
+    }
+    for(int i=0; i<n; i++) {
+        cosValue[i] = cosf(cosValue[i]);
+    }
+}
+
+// dots[m] for m in [m0, m0 + BLOCK), whose sums stay in registers
+// over all the planes.
+template<int BLOCK>
+static EBGM_ALWAYS_INLINE void planeDotsBlock(
+    const float *planes,
+    size_t stride,
+    int m0,
+    const float *x,
+    int n,
+    float *dots
+)
+{
+    float sum[BLOCK] = {};
+    for(int i=0; i<n; i++) {
+        const float *plane = planes + i*stride + m0;
+        const float xi = x[i];
+        for(int m=0; m<BLOCK; m++) {
+            sum[m] += plane[m]*xi;
+        }
+    }
+    std::memcpy(dots + m0, sum, sizeof(sum));
+}
+
+static EBGM_ALWAYS_INLINE void planeDotsLoop(
+    const float *planes,
+    size_t stride,
+    int nRows,
+    const float *x,
+    int n,
+    float *dots
+)
+{
+    // vectorized across the rows, by blocks of 32 and then 8 rows, and
+    // the last rows one by one: each row sums in the order of i.
+    int m0 = 0;
+    for(; m0+32<=nRows; m0+=32) {
+        planeDotsBlock<32>(planes, stride, m0, x, n, dots);
+    }
+    for(; m0+8<=nRows; m0+=8) {
+        planeDotsBlock<8>(planes, stride, m0, x, n, dots);
+    }
+    for(; m0<nRows; m0++) {
+        float sum = 0.0F;
+        for(int i=0; i<n; i++) {
+            sum += planes[i*stride + m0]*x[i];
+        }
+        dots[m0] = sum;
+    }
+}
+
+static EBGM_ALWAYS_INLINE void phaseLanesLoop(
+    const PhaseLanes &lanes,
+    float *simi,
+    float *dx,
+    float *dy
+)
+{
+    // the PI of jet.hpp, as in Jet::displacement().
+    const float pi = 3.14159265358979323846F;
+    const int nLanes = lanes.nLanes;
+    const size_t stride = lanes.stride;
+
+    for(int m=0; m<nLanes; m++) {
+        dx[m] = 0.0F;
+        dy[m] = 0.0F;
+    }
+
+    // refined 'focus' times on the same bands, like
+    // displacementWithFocus(), each time with the operations of
+    // Jet::displacement().
+    for(int iter=0; iter<lanes.focus; iter++) {
+        float phiX[PHASE_LANES] = {};
+        float phiY[PHASE_LANES] = {};
+        float gammaXX[PHASE_LANES] = {};
+        float gammaYY[PHASE_LANES] = {};
+        float gammaXY[PHASE_LANES] = {};
+
+        for(int i=lanes.start; i<lanes.n; i++) {
+            const float *a1 = lanes.a + i*stride;
+            const float *p1 = lanes.p + i*stride;
+            const float a2 = lanes.probeA[i];
+            const float p2 = lanes.probeP[i];
+            const float kxi = lanes.kx[i];
+            const float kyi = lanes.ky[i];
+
+            for(int m=0; m<nLanes; m++) {
+                float aa = a1[m]*a2;
+                float deltaPhi = p1[m] - p2;
+                float ddotk = dx[m]*kxi + dy[m]*kyi;
+                float adjust =
+                    (fastWrapAngle(deltaPhi - ddotk + pi) - pi) -
+                    (deltaPhi - ddotk);
+                deltaPhi += adjust;
+
+                phiX[m] += aa*kxi*deltaPhi;
+                phiY[m] += aa*kyi*deltaPhi;
+                gammaXY[m] += aa*kxi*kyi;
+                gammaXX[m] += aa*kxi*kxi;
+                gammaYY[m] += aa*kyi*kyi;
+            }
+        }
+
+        for(int m=0; m<nLanes; m++) {
+            float denominator =
+                gammaXX[m]*gammaYY[m] - gammaXY[m]*gammaXY[m];
+            dx[m] = (gammaYY[m]*phiX[m] - gammaXY[m]*phiY[m]) /
+                denominator;
+            dy[m] = (gammaXX[m]*phiY[m] - gammaXY[m]*phiX[m]) /
+                denominator;
+        }
+    }
+
+    // Re(c1 * conj(c2) * exp(-i*(d*k))), as in
+    // ComplexJet::compareWithPhase().
+    for(int m=0; m<nLanes; m++) {
+        simi[m] = 0.0F;
+    }
+    for(int i=0; i<lanes.n; i++) {
+        const float *re1 = lanes.re + i*stride;
+        const float *im1 = lanes.im + i*stride;
+        const float re2 = lanes.probeRe[i];
+        const float im2 = lanes.probeIm[i];
+        const float kxi = lanes.kx[i];
+        const float kyi = lanes.ky[i];
+
+        for(int m=0; m<nLanes; m++) {
+            float sinValue, cosValue;
+            fastSinCos(dx[m]*kxi + dy[m]*kyi, sinValue, cosValue);
+            float zre = re1[m]*re2 + im1[m]*im2;
+            float zim = im1[m]*re2 - re1[m]*im2;
+            simi[m] += zre*cosValue + zim*sinValue;
+        }
+    }
+}
+
+// One function per kernel and level (see cpu.h).
+
+static void complex2magGeneric(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+)
+{
+    complex2magLoop(re, im, mag, phase, n);
+}
+
+#ifdef EBGM_CPU_DISPATCH
+
+EBGM_TARGET("sse4.2")
+static void complex2magSse42(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+)
+{
+    complex2magLoop(re, im, mag, phase, n);
+}
+
+EBGM_TARGET("avx2")
+static void complex2magAvx2(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+)
+{
+    complex2magLoop(re, im, mag, phase, n);
+}
+
+EBGM_TARGET("avx512f")
+static void complex2magAvx512(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+)
+{
+    complex2magLoop(re, im, mag, phase, n);
+}
+
+#endif
+
+static void phaseCosGeneric(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+)
+{
+    phaseCosLoop(p1, p2, kx, ky, dx, dy, cosValue, n);
+}
+
+#ifdef EBGM_CPU_DISPATCH
+
+EBGM_TARGET("sse4.2")
+static void phaseCosSse42(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+)
+{
+    phaseCosLoop(p1, p2, kx, ky, dx, dy, cosValue, n);
+}
+
+EBGM_TARGET("avx2")
+static void phaseCosAvx2(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+)
+{
+    phaseCosLoop(p1, p2, kx, ky, dx, dy, cosValue, n);
+}
+
+EBGM_TARGET("avx512f")
+static void phaseCosAvx512(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+)
+{
+    phaseCosLoop(p1, p2, kx, ky, dx, dy, cosValue, n);
+}
+
+#endif
+
+static void libmComplex2magGeneric(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+)
+{
+    libmComplex2magLoop(re, im, mag, phase, n);
+}
+
+#ifdef EBGM_CPU_DISPATCH
+
+EBGM_TARGET("sse4.2")
+static void libmComplex2magSse42(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+)
+{
+    libmComplex2magLoop(re, im, mag, phase, n);
+}
+
+EBGM_TARGET("avx2")
+static void libmComplex2magAvx2(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+)
+{
+    libmComplex2magLoop(re, im, mag, phase, n);
+}
+
+EBGM_TARGET("avx512f")
+static void libmComplex2magAvx512(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+)
+{
+    libmComplex2magLoop(re, im, mag, phase, n);
+}
+
+#endif
+
+static void libmPhaseCosGeneric(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+)
+{
+    libmPhaseCosLoop(p1, p2, kx, ky, dx, dy, cosValue, n);
+}
+
+#ifdef EBGM_CPU_DISPATCH
+
+EBGM_TARGET("sse4.2")
+static void libmPhaseCosSse42(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+)
+{
+    libmPhaseCosLoop(p1, p2, kx, ky, dx, dy, cosValue, n);
+}
+
+EBGM_TARGET("avx2")
+static void libmPhaseCosAvx2(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+)
+{
+    libmPhaseCosLoop(p1, p2, kx, ky, dx, dy, cosValue, n);
+}
+
+EBGM_TARGET("avx512f")
+static void libmPhaseCosAvx512(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+)
+{
+    libmPhaseCosLoop(p1, p2, kx, ky, dx, dy, cosValue, n);
+}
+
+#endif
+
+static void planeDotsGeneric(
+    const float *planes,
+    size_t stride,
+    int nRows,
+    const float *x,
+    int n,
+    float *dots
+)
+{
+    planeDotsLoop(planes, stride, nRows, x, n, dots);
+}
+
+#ifdef EBGM_CPU_DISPATCH
+
+EBGM_TARGET("sse4.2")
+static void planeDotsSse42(
+    const float *planes,
+    size_t stride,
+    int nRows,
+    const float *x,
+    int n,
+    float *dots
+)
+{
+    planeDotsLoop(planes, stride, nRows, x, n, dots);
+}
+
+EBGM_TARGET("avx2")
+static void planeDotsAvx2(
+    const float *planes,
+    size_t stride,
+    int nRows,
+    const float *x,
+    int n,
+    float *dots
+)
+{
+    planeDotsLoop(planes, stride, nRows, x, n, dots);
+}
+
+EBGM_TARGET("avx512f")
+static void planeDotsAvx512(
+    const float *planes,
+    size_t stride,
+    int nRows,
+    const float *x,
+    int n,
+    float *dots
+)
+{
+    planeDotsLoop(planes, stride, nRows, x, n, dots);
+}
+
+#endif
+
+static void phaseLanesGeneric(
+    const PhaseLanes &lanes,
+    float *simi,
+    float *dx,
+    float *dy
+)
+{
+    phaseLanesLoop(lanes, simi, dx, dy);
+}
+
+#ifdef EBGM_CPU_DISPATCH
+
+EBGM_TARGET("sse4.2")
+static void phaseLanesSse42(
+    const PhaseLanes &lanes,
+    float *simi,
+    float *dx,
+    float *dy
+)
+{
+    phaseLanesLoop(lanes, simi, dx, dy);
+}
+
+EBGM_TARGET("avx2")
+static void phaseLanesAvx2(
+    const PhaseLanes &lanes,
+    float *simi,
+    float *dx,
+    float *dy
+)
+{
+    phaseLanesLoop(lanes, simi, dx, dy);
+}
+
+EBGM_TARGET("avx512f")
+static void phaseLanesAvx512(
+    const PhaseLanes &lanes,
+    float *simi,
+    float *dx,
+    float *dy
+)
+{
+    phaseLanesLoop(lanes, simi, dx, dy);
+}
+
+#endif
+
+
+void fastComplex2mag(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+)
+{
+    switch(cpuLevel()) {
+#ifdef EBGM_CPU_DISPATCH
+    case CpuLevel::AVX512:
+        complex2magAvx512(re, im, mag, phase, n);
+        break;
+    case CpuLevel::AVX2:
+        complex2magAvx2(re, im, mag, phase, n);
+        break;
+    case CpuLevel::SSE42:
+        complex2magSse42(re, im, mag, phase, n);
+        break;
+#endif
+    default:
+        complex2magGeneric(re, im, mag, phase, n);
+    }
+}
+
+void fastPhaseCos(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+)
+{
+    switch(cpuLevel()) {
+#ifdef EBGM_CPU_DISPATCH
+    case CpuLevel::AVX512:
+        phaseCosAvx512(p1, p2, kx, ky, dx, dy, cosValue, n);
+        break;
+    case CpuLevel::AVX2:
+        phaseCosAvx2(p1, p2, kx, ky, dx, dy, cosValue, n);
+        break;
+    case CpuLevel::SSE42:
+        phaseCosSse42(p1, p2, kx, ky, dx, dy, cosValue, n);
+        break;
+#endif
+    default:
+        phaseCosGeneric(p1, p2, kx, ky, dx, dy, cosValue, n);
+    }
+}
+
+void phaseLanes(
+    const PhaseLanes &lanes,
+    float *simi,
+    float *dx,
+    float *dy
+)
+{
+    switch(cpuLevel()) {
+#ifdef EBGM_CPU_DISPATCH
+    case CpuLevel::AVX512:
+        phaseLanesAvx512(lanes, simi, dx, dy);
+        break;
+    case CpuLevel::AVX2:
+        phaseLanesAvx2(lanes, simi, dx, dy);
+        break;
+    case CpuLevel::SSE42:
+        phaseLanesSse42(lanes, simi, dx, dy);
+        break;
+#endif
+    default:
+        phaseLanesGeneric(lanes, simi, dx, dy);
+    }
+}
+
+void libmComplex2mag(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+)
+{
+    switch(cpuLevel()) {
+#ifdef EBGM_CPU_DISPATCH
+    case CpuLevel::AVX512:
+        libmComplex2magAvx512(re, im, mag, phase, n);
+        break;
+    case CpuLevel::AVX2:
+        libmComplex2magAvx2(re, im, mag, phase, n);
+        break;
+    case CpuLevel::SSE42:
+        libmComplex2magSse42(re, im, mag, phase, n);
+        break;
+#endif
+    default:
+        libmComplex2magGeneric(re, im, mag, phase, n);
+    }
+}
+
+void libmPhaseCos(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+)
+{
+    switch(cpuLevel()) {
+#ifdef EBGM_CPU_DISPATCH
+    case CpuLevel::AVX512:
+        libmPhaseCosAvx512(p1, p2, kx, ky, dx, dy, cosValue, n);
+        break;
+    case CpuLevel::AVX2:
+        libmPhaseCosAvx2(p1, p2, kx, ky, dx, dy, cosValue, n);
+        break;
+    case CpuLevel::SSE42:
+        libmPhaseCosSse42(p1, p2, kx, ky, dx, dy, cosValue, n);
+        break;
+#endif
+    default:
+        libmPhaseCosGeneric(p1, p2, kx, ky, dx, dy, cosValue, n);
+    }
+}
+
+void planeDots(
+    const float *planes,
+    size_t stride,
+    int nRows,
+    const float *x,
+    int n,
+    float *dots
+)
+{
+    switch(cpuLevel()) {
+#ifdef EBGM_CPU_DISPATCH
+    case CpuLevel::AVX512:
+        planeDotsAvx512(planes, stride, nRows, x, n, dots);
+        break;
+    case CpuLevel::AVX2:
+        planeDotsAvx2(planes, stride, nRows, x, n, dots);
+        break;
+    case CpuLevel::SSE42:
+        planeDotsSse42(planes, stride, nRows, x, n, dots);
+        break;
+#endif
+    default:
+        planeDotsGeneric(planes, stride, nRows, x, n, dots);
+    }
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+// Approximations of the functions of libm on the hot paths of the jets.
+// They use only multiply-adds, compares and conversions, without
+// branches, so that loops calling them can be vectorized by the
+// compiler (libm calls are not, without -ffast-math). The maximum errors
+// are measured by test43().
+//
+// fastWrapAngle() is exact and always used. fastSinCos() and
+// fastAtan2() are always used by ComplexJet and the sub-pixel jets;
+// elsewhere (the jets of CalcJet, Jet::compareWithPhase() and
+// complex2magF()), the approximations are used instead of libm only in
+// the fast math mode (see setFastMath()).
+//
+// Out of the fast math mode, the same hot paths use libmComplex2mag()
+// and libmPhaseCos(), and BunchGraph::compare() uses planeDots(). Like
+// the fast kernels, they are dispatched on the CPU (see cpu.h).
+
+// Turn the fast math mode on or off (off by default) for all threads.
+// Set it before the jets are calculated: the phases of the jets differ
+// a little between the modes.
+void setFastMath(bool on);
+
+// Whether the fast math mode is on.
+bool fastMath();
+
+// Same as wrapAngle<float>() (see utils.h), bit for bit, but floor() is
+// done by a conversion to int and a compare (|angle| < 2^31 * 2pi).
+inline float fastWrapAngle(float angle)
+{
+    const float twoPi = 6.28318530717958647692;
+    float q = angle/twoPi;
+    // floor(q), corrected on the integer so that loops over it are
+    // vectorized.
+    int f = (int)q;
+    f -= (float)f > q;
+    // in double, like floor(double) in wrapAngle().
+    return angle - twoPi*(double)f;
+}
+
+// sin(angle) and cos(angle). Max error 3.7e-7 for |angle| < 1000.
+inline void fastSinCos(float angle, float &sinValue, float &cosValue)
+{
+    // angle = q*(pi/2) + r, -pi/4 <= r <= pi/4
+    float qf = angle * 0.636619772F;
+    int q = (int)(qf + (qf >= 0.0F ? 0.5F : -0.5F));
+    float r = angle - q*1.5703125F;
+    r -= q*4.837512969970703125e-4F;
+    r -= q*7.54978995489188216e-8F;
+
+    float r2 = r*r;
+    float s = r + r*r2*(-1.66666667e-1F + r2*(8.33333333e-3F + r2*-1.98412698e-4F));
+    float c = 1.0F + r2*(-0.5F + r2*(4.16666667e-2F + r2*(-1.38888889e-3F + r2*2.48015873e-5F)));
+
+    // q%4 == 0: ( s,  c)    q%4 == 1: ( c, -s)
+    // q%4 == 2: (-s, -c)    q%4 == 3: (-c,  s)
+    // On the bits, so that s and c are both computed even if only one
+    // of sinValue and cosValue is used (see fastAtan2()).
+    uint32_t sBits, cBits;
+    std::memcpy(&sBits, &s, sizeof(s));
+    std::memcpy(&cBits, &c, sizeof(c));
+    uint32_t swap = 0U - (uint32_t)(q & 1);
+    uint32_t sinBits = (cBits & swap) | (sBits & ~swap);
+    uint32_t cosBits = (sBits & swap) | (cBits & ~swap);
+    sinBits ^= (uint32_t)(q & 2) << 30;
+    cosBits ^= (uint32_t)((q + 1) & 2) << 30;
+    std::memcpy(&sinValue, &sinBits, sizeof(sinValue));
+    std::memcpy(&cosValue, &cosBits, sizeof(cosValue));
+}
+
+// atan2(y, x) within [-pi, pi], with one division. Max error 2e-6
+// radians. Return 0 if x == y == 0.
+inline float fastAtan2(float y, float x)
+{
+    float ax = fabsf(x), ay = fabsf(y);
+    float mx = ax > ay ? ax : ay;
+    float mn = ax > ay ? ay : ax;
+
+    // atan(a), 0 <= a <= 1 (a = 0 if mx == 0)
+    float a = mn / (mx + (mx > 0.0F ? 0.0F : 1.0F));
+    float s = a*a;
+    float r = a*(0.99997726F + s*(-0.33262347F + s*(0.19354346F +
+        s*(-0.11643287F + s*(0.05265332F + s*-0.01172120F)))));
+
+    // The compares select constants only: with -ftrapping-math (the
+    // default), a loop whose arithmetic depends on a compare is not
+    // vectorized.
+    r = (ay > ax ? 1.57079633F : 0.0F) + (ay > ax ? -1.0F : 1.0F)*r;
+    r = (x < 0.0F ? 3.14159265F : 0.0F) + (x < 0.0F ? -1.0F : 1.0F)*r;
+    return (y < 0.0F ? -1.0F : 1.0F)*r;
+}
+
+// 1/sqrt(x), x > 0: the estimate of the bits of x refined by two
+// Newton steps. Max relative error 4.7e-6.
+inline float fastRsqrt(float x)
+{
+    uint32_t i;
+    float y;
+    std::memcpy(&i, &x, sizeof(i));
+    i = 0x5f375a86 - (i >> 1);
+    std::memcpy(&y, &i, sizeof(y));
+    y = y*(1.5F - 0.5F*x*y*y);
+    y = y*(1.5F - 0.5F*x*y*y);
+    return y;
+}
+
+// Magnitudes and phases of n complex numbers, like complex2mag() (see
+// utils.h): the phases are within [-0.5pi, 1.5pi). The magnitudes are
+// x*fastRsqrt(x) (sqrtf() is not vectorized, because of errno), and the
+// phases are from fastAtan2() (0 instead of NaN at 0).
+// Dispatched on the CPU (see cpu.h).
+void fastComplex2mag(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+);
+
+// cosValue[i] = cos(p1[i] - p2[i] - (dx*kx[i] + dy*ky[i])) for
+// i = 0, 1, ..., n-1, by fastSinCos(). Dispatched on the CPU.
+void fastPhaseCos(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+);
+
+// Magnitudes and phases of n complex numbers with the operations of
+// complex2mag() (see utils.h): sqrtf() and the atan() of libm. The
+// magnitudes, the divisions and the quadrants are vectorized; the calls
+// to atan() are not. The default conversion of the jets of CalcJet.
+// Dispatched on the CPU; the results are the same at all the levels.
+void libmComplex2mag(
+    const float *re,
+    const float *im,
+    float *mag,
+    float *phase,
+    int n
+);
+
+// cosValue[i] = cosf(p1[i] - p2[i] - (dx*kx[i] + dy*ky[i])) for
+// i = 0, 1, ..., n-1, with the cosf() of libm: the arguments are
+// vectorized, the calls to cosf() are not. The default cosines of
+// Jet::compareWithPhase(). Dispatched on the CPU.
+void libmPhaseCos(
+    const float *p1,
+    const float *p2,
+    const float *kx,
+    const float *ky,
+    float dx,
+    float dy,
+    float *cosValue,
+    int n
+);
+
+// dots[m] = the sum of x[i]*planes[i*stride + m] over i = 0, 1, ...,
+// n-1 (in this order), for m = 0, 1, ..., nRows-1: the dot products of
+// x with nRows vectors stored in planes, like the models of PhaseLanes.
+// The kernel of BunchGraph::compare(). Dispatched on the CPU; the
+// results are the same at all the levels.
+void planeDots(
+    const float *planes,
+    size_t stride,
+    int nRows,
+    const float *x,
+    int n,
+    float *dots
+);
+
+// The number of models compared together by phaseLanes().
+constexpr int PHASE_LANES = 16;
+
+// Up to PHASE_LANES models of a bunch node and a probe jet, for
+// phaseLanes(). The bands of the models are stored in planes: band i of
+// model m at [i*stride + m].
+struct PhaseLanes {
+    const float *a;        // magnitudes
+    const float *p;        // phases
+    const float *re;       // the normalized complex jets (ComplexJet)
+    const float *im;
+    size_t stride;
+    int nLanes;            // the number of models, 1 to PHASE_LANES
+
+    // the probe: n bands, and its ComplexJet
+    const float *probeA;
+    const float *probeP;
+    const float *probeRe;
+    const float *probeIm;
+    const float *kx;
+    const float *ky;
+    int n;
+
+    // the displacement is estimated on bands [start, n), refined
+    // focus times, like displacementWithFocus() (see alg.h).
+    int start;
+    int focus;
+};
+
+// For each model m: its displacement (dx[m], dy[m]) from the probe,
+// with the operations of Jet::displacement(), and the similarity
+// simi[m] of ComplexJet::compareWithPhase() at that displacement.
+// The kernel of BunchGraph::compareNodeWithPhase(). Dispatched on the
+// CPU; the results are the same at all the levels.
+void phaseLanes(const PhaseLanes &lanes, float *simi, float *dx, float *dy);
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cassert>
+#include <array>
+#include <vector>
+#include <type_traits>
+#include <utility>
+
+
+// A vector of at most K elements, stored in a std::array: no heap
+// allocation. Has the part of the interface of std::vector used by
+// Points and Graph.
+template<typename T, int K>
+class FixedVector {
+    static_assert(K > 0, "The 'K' in FixedVector<T, K> must be a positive integer.");
+
+private:
+    std::array<T, K> m_data;
+    int m_size = 0;
+
+public:
+    using value_type = T;
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    static constexpr int capacity()
+    {
+        return K;
+    }
+
+    int size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    void clear()
+    {
+        m_size = 0;
+    }
+
+    // Does nothing: the memory of K elements is always there.
+    void reserve(int n)
+    {
+        assert(n <= K);
+        (void)n;
+    }
+
+    // The new elements (if any) are not initialized.
+    void resize(int n)
+    {
+        assert(n >= 0 && n <= K);
+        m_size = n;
+    }
+
+    void push_back(const T &value)
+    {
+        assert(m_size < K);
+        m_data[m_size++] = value;
+    }
+
+    T &operator[](int i)
+    {
+        assert(i >= 0 && i < m_size);
+        return m_data[i];
+    }
+
+    const T &operator[](int i) const
+    {
+        assert(i >= 0 && i < m_size);
+        return m_data[i];
+    }
+
+    T *data()
+    {
+        return m_data.data();
+    }
+
+    const T *data() const
+    {
+        return m_data.data();
+    }
+
+    iterator begin()
+    {
+        return m_data.data();
+    }
+
+    iterator end()
+    {
+        return m_data.data() + m_size;
+    }
+
+    const_iterator begin() const
+    {
+        return m_data.data();
+    }
+
+    const_iterator end() const
+    {
+        return m_data.data() + m_size;
+    }
+};
+
+
+// The storage of the elements of a set of K points, nodes, etc.:
+// FixedVector<T, K> if K > 0, std::vector<T> (any number of elements)
+// if K is 0.
+template<typename T, int K>
+using Storage = typename std::conditional<
+    K == 0, std::vector<T>, FixedVector<T, K>
+>::type;
+
+
+template<typename F, int... I>
+inline void __forEachIndex(
+    int n,
+    F &&f,
+    std::integer_sequence<int, I...>
+)
+{
+    assert(n == sizeof...(I));
+    (void)n;
+    // the calls are evaluated from left to right.
+    int dummy[] = {0, (f(I), 0)...};
+    (void)dummy;
+}
+
+template<typename F>
+inline void __forEachIndex(
+    int n,
+    F &&f,
+    std::integer_sequence<int>
+)
+{
+    for(int i=0; i<n; i++) {
+        f(i);
+    }
+}
+
+// Call f(i) for i from 0 to n-1, in order. If K > 0 (then n must be K),
+// the loop is unrolled at compile time, so that i is a constant in
+// each call once f is inlined.
+template<int K, typename F>
+inline void forEachIndex(int n, F &&f)
+{
+    __forEachIndex(n, f, std::make_integer_sequence<int, K>());
+}
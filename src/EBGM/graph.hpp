@@ -1,6 +1,7 @@
 #pragma once
 
 #include "jet.hpp"
+#include "fixedvector.hpp"
 
 #include <vector>
 #include <tuple>
@@ -8,10 +9,18 @@
 #include <functional>
 #include <cmath>
 #include <memory>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+#include <stdexcept>
 
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
 
+#include <Eigen/Core>
+
 #ifndef NDEBUG
 #include <sstream>
 #include <string>
@@ -19,30 +28,33 @@
 #endif
 
 
+// the number of edges of a graph of nNodes nodes.
+constexpr int edgeCount(int nNodes)
+{
+    return nNodes*(nNodes - 1)/2;
+}
+
+
 // N: The size of jet, same as the 'N' in 'Jet<N>'.
+// K: the number of nodes, if it is fixed at compile time: the nodes and
+// edges are stored in std::arrays (see Storage), and the loops over
+// them in BunchGraph are unrolled. 0: any number of nodes.
 // node: jet
 // edge: the distance vector between two jets
-template<int N>
+template<int N, int K = 0>
 class Graph {
     static_assert(N > 0, "The 'N' in Graph<N> must be a positive integer.");
+    static_assert(K == 0 || K >= 2, "The 'K' in Graph<N, K> must be 0 or at least 2.");
 
 public:
     using Edge = struct {int x; int y;};
     using Node = Jet<N>;
 
-    // When constructed by deserialization:
-    //     If not set, the kx and ky of jets will use the value saved in file.
-    //     If set, the kx and ky of jets will use these variables directly.
-    // When constructed by addNodes():
-    //     These variables are ignored and will always be null.
-    std::shared_ptr<float[]> m_kx;
-    std::shared_ptr<float[]> m_ky;
-
 private:
     // DO NOT modify edges and nodes manually!
     // Use addNode() and replaceNode().
-    std::vector<Node> m_nodes;
-    std::vector<Edge> m_edges;
+    Storage<Node, K> m_nodes;
+    Storage<Edge, edgeCount(K)> m_edges;
 
     // get the edge between two nodes. 
     // (the edge direction: from smaller node to bigger node)
@@ -50,25 +62,8 @@ private:
     {
         assert(index1 < m_nodes.size() && index1 >= 0);
         assert(index2 < m_nodes.size() && index2 >= 0);
-        assert(index1 != index2);
-
-        float index1f, index2f;
-
-        // node1f will always < node2f
-        if(index1 > index2) {
-            index1f = (float)index2;
-            index2f = (float)index1;
-        }
-        else {
-            index1f = (float)index1;
-            index2f = (float)index2;
-        }
-
-
-        float edgeIndexf = 0.5F*index2f*(index2f-1.0F) + index1f;
-        int edgeIndex = (int)round(edgeIndexf);
 
-        return m_edges[edgeIndex];
+        return m_edges[getEdgeIndex(index1, index2)];
     }
 
     friend class boost::serialization::access;
@@ -85,22 +80,19 @@ private:
         if(nNodes == 0) {
             return;
         }
+        if(nNodes < 0 || (K > 0 && nNodes > K)) {
+            throw std::runtime_error("Invalid number of nodes.");
+        }
 
-        std::shared_ptr<float[]> tmpkx(new float[N]);
-        std::shared_ptr<float[]> tmpky(new float[N]);
-        float *kx = tmpkx.get();
-        float *ky = tmpky.get();
+        // all the graphs with the same ks share one copy of them.
+        float kx[N], ky[N];
         for(int i=0; i<N; i++) {
             ar & kx[i];
         }
         for(int i=0; i<N; i++) {
             ar & ky[i];
         }
-
-        if(!m_kx || !m_ky){
-            m_kx = tmpkx;
-            m_ky = tmpky;
-        }
+        int bank = KernelRegistry::intern(kx, ky, N);
 
         m_nodes.reserve(nNodes);
         for(int i=0; i<nNodes; i++) {
@@ -109,8 +101,7 @@ private:
             ar & jet.y;
             ar & jet.a;
             ar & jet.p;
-            jet.kx = m_kx;
-            jet.ky = m_ky;
+            jet.bank = bank;
 
             m_nodes.push_back(jet);
         }
@@ -118,6 +109,13 @@ private:
         int nEdges;
         ar & nEdges;
 
+        // e.g. a graph of the jets of another kernel bank (another N).
+        if(nEdges != edgeCount(nNodes)) {
+            throw std::runtime_error(
+                "The number of edges does not match the number of nodes."
+            );
+        }
+
         m_edges.reserve(nEdges);
         for(int i=0; i<nEdges; i++) {
             Edge edge;
@@ -137,8 +135,8 @@ private:
             return;
         }
 
-        float *kx = m_nodes[0].kx.get();
-        float *ky = m_nodes[0].ky.get();
+        const float *kx = m_nodes[0].getKx();
+        const float *ky = m_nodes[0].getKy();
         for(int i=0; i<N; i++) {
             ar & kx[i];
         }
@@ -167,6 +165,35 @@ private:
     BOOST_SERIALIZATION_SPLIT_MEMBER()
 
 public:
+    // the index (in getEdges()) of the edge between two nodes.
+    // (the edge direction: from smaller node to bigger node)
+    // A constant if both indices are.
+    static constexpr int getEdgeIndex(int index1, int index2)
+    {
+        assert(index1 >= 0 && index2 >= 0);
+        assert(index1 != index2);
+
+        // the edges of the node i (to the nodes 0 to i-1) follow the
+        // edges of the nodes before it.
+        return index1 > index2 ?
+            edgeCount(index1) + index2 :
+            edgeCount(index2) + index1;
+    }
+
+    Graph() noexcept {}
+
+    // Convert between the fixed and the dynamic number of nodes.
+    template<int K2>
+    explicit Graph(const Graph<N, K2> &graph)
+    {
+        assert(K == 0 || graph.getNodes().size() <= K);
+
+        reserve(graph.getNodes().size());
+        for(const auto &i: graph.getNodes()) {
+            addNode(i);
+        }
+    }
+
     constexpr const decltype(m_nodes) &getNodes() const
     {
         return const_cast<const decltype(m_nodes)&>(m_nodes);
@@ -177,12 +204,21 @@ public:
         return const_cast<const decltype(m_edges)&>(m_edges);
     }
 
+    // The memory is kept: adding the same number of nodes again
+    // does no heap allocation.
     void clear()
     {
         m_nodes.clear();
         m_edges.clear();
     }
 
+    // Reserve the memory of nNodes nodes and their edges.
+    void reserve(int nNodes)
+    {
+        m_nodes.reserve(nNodes);
+        m_edges.reserve(nNodes*(nNodes - 1)/2);
+    }
+
     bool empty() const
     {
         return m_nodes.empty();
@@ -192,7 +228,7 @@ public:
     // This is an O(n) operation.
     void addNode(const Node &node)
     {
-        for(auto i: m_nodes) {
+        for(const auto &i: m_nodes) {
             Edge edge;
             edge.x = node.x - i.x;
             edge.y = node.y - i.y;
@@ -223,7 +259,7 @@ public:
         }
     }
 
-    float compare(const Graph<N> &graph) const
+    float compare(const Graph &graph) const
     {
         assert(m_nodes.size() == graph.getNodes().size());
 
@@ -292,6 +328,128 @@ public:
 
 
 
+// A table of the similarities between the nodes of a bunch graph
+// and the jets of one image, keyed by (kind, variant, node, x, y), so
+// that each of them is computed only once when the steps of one match
+// score overlapping graphs (see the BunchGraph functions taking a memo).
+// Can be used by multiple threads concurrently.
+class SimilarityMemo {
+public:
+    // the kind of similarity.
+    enum Kind {
+        MAGNITUDE = 0,    // BunchGraph::compare()
+        PHASE = 1         // BunchGraph::compareWithPhaseFocusComplex()
+    };
+
+    struct Entry {
+        float simi;
+        float disp2;      // square displacement, PHASE only
+    };
+
+private:
+    static constexpr int N_SHARDS = 64;
+
+    // each shard is guarded by its own mutex.
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, Entry> map;
+    };
+
+    std::array<Shard, N_SHARDS> m_shards;
+    std::atomic<uint64_t> m_hits{0};
+    std::atomic<uint64_t> m_misses{0};
+
+    static uint64_t makeKey(Kind kind, int variant, int node, int x, int y)
+    {
+        assert(variant >= -32 && variant < 32);
+        assert(node >= 0 && node < (1 << 11));
+        assert(x >= 0 && x < (1 << 23));
+        assert(y >= 0 && y < (1 << 23));
+        return (uint64_t)kind << 63 | (uint64_t)(variant + 32) << 57 |
+            (uint64_t)node << 46 | (uint64_t)x << 23 | (uint64_t)y;
+    }
+
+    Shard &getShard(uint64_t key)
+    {
+        return m_shards[(key * 0x9E3779B97F4A7C15ULL) >> 58];
+    }
+
+public:
+    SimilarityMemo() noexcept {}
+    SimilarityMemo(const SimilarityMemo&) = delete;
+    SimilarityMemo &operator=(const SimilarityMemo&) = delete;
+
+    // Return the entry of (kind, node, x, y). If it is not in the
+    // table, call compute() (without holding any lock) and store its
+    // return value.
+    template<typename Compute>
+    Entry get(
+        Kind kind, 
+        int variant,      // distinguishes the jets transformed in
+                          // different ways at the same position,
+                          // within [-32, 32). 0: not transformed.
+        int node, 
+        int x, 
+        int y, 
+        Compute &&compute
+    )
+    {
+        uint64_t key = makeKey(kind, variant, node, x, y);
+        Shard &shard = getShard(key);
+
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.map.find(key);
+            if(it != shard.map.end()) {
+                m_hits.fetch_add(1, std::memory_order_relaxed);
+                return it->second;
+            }
+        }
+
+        // Two threads may compute the same entry at the same time;
+        // they get the same value.
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        Entry entry = compute();
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.map.emplace(key, entry);
+        return entry;
+    }
+
+    // the number of lookups found in the table.
+    uint64_t getHits() const
+    {
+        return m_hits.load(std::memory_order_relaxed);
+    }
+
+    // the number of lookups computed.
+    uint64_t getMisses() const
+    {
+        return m_misses.load(std::memory_order_relaxed);
+    }
+
+    size_t size()
+    {
+        size_t ret = 0;
+        for(auto &i: m_shards) {
+            std::lock_guard<std::mutex> lock(i.mutex);
+            ret += i.map.size();
+        }
+        return ret;
+    }
+
+    void clear()
+    {
+        for(auto &i: m_shards) {
+            std::lock_guard<std::mutex> lock(i.mutex);
+            i.map.clear();
+        }
+        m_hits = 0;
+        m_misses = 0;
+    }
+};
+
+
 // N: The size of jet, same as the 'N' in 'Jet<N>'.
 // node: consists of the jets on the same fiducial point
 // edge: the averaged distance vector
@@ -307,6 +465,13 @@ public:
     // Has an effect on edge comparing.
     float xScale = 1.0F;
     float yScale = 1.0F;
+    // The in-plane rotation of the face found by step3(), in steps of
+    // PI/ORIENTATIONS of BankOf<N>, in the direction of Points::rotate():
+    // the edges are rotated by it after scaling, and the jets compared
+    // with phase must have their orientations shifted back by it (see
+    // shiftOrientations() in alg.h). Also the variant of their entries
+    // in a SimilarityMemo.
+    int orientationShift = 0;
 
 private:
     // the number of graphs added to this bunch graph.
@@ -317,26 +482,159 @@ private:
     std::vector<Node> m_nodes;
     std::vector<Edge> m_edges;
 
+    // m_nodes in complex form, used by compareWithPhaseFocusComplex().
+    std::vector<std::vector<ComplexJet<N>>> m_complexNodes;
+
+    // The magnitudes of the jets in m_nodes, normalized so that the
+    // sum of a^2 is 1: the magnitudes of m_nodes[i][j] are in the row
+    // (i*m_capacity + j). Column-major, so that the models of a node
+    // are contiguous in each band (see planeDots()).
+    // Used by compare().
+    Eigen::Matrix<float, Eigen::Dynamic, N> m_packedA;
+    // the number of rows reserved for each node in m_packedA.
+    int m_capacity = 0;
+
+    // The norm of the fine bands (the magnitudes before COARSE_START of
+    // BankOf<N>) of each row of m_packedA, at the same index.
+    // Used by compareBound().
+    static constexpr int N_COARSE = N - BankOf<N>::type::COARSE_START;
+    Eigen::VectorXf m_fineNorms;
+
+    // The jets of m_nodes as planes: the magnitudes, the phases, and the
+    // real and imaginary parts of the normalized responses (see
+    // ComplexJet) of m_nodes[i][j] are in the row (i*m_capacity + j).
+    // Column-major, so that the models of a node are contiguous in each
+    // band. Used by compareNodeWithPhase().
+    Eigen::Matrix<float, Eigen::Dynamic, N> m_planeA;
+    Eigen::Matrix<float, Eigen::Dynamic, N> m_planeP;
+    Eigen::Matrix<float, Eigen::Dynamic, N> m_planeRe;
+    Eigen::Matrix<float, Eigen::Dynamic, N> m_planeIm;
+
+    // compare() processes at most this number of models at a time.
+    static constexpr int MODEL_CHUNK = 1024;
+
+    // dots[m] = the dot product of probe (bands [start, start + n) of
+    // the normalized magnitudes) with the same bands of the model
+    // model + m of the node 'node' in m_packedA, for m in [0, nModels),
+    // nModels <= MODEL_CHUNK.
+    void dotModels(
+        int node,
+        int model,
+        int nModels,
+        const float *probe,
+        int start,
+        int n,
+        float *dots
+    ) const
+    {
+        assert(nModels > 0 && nModels <= MODEL_CHUNK);
+        size_t stride = m_packedA.rows();
+        planeDots(
+            m_packedA.data() + start*stride + node*m_capacity + model,
+            stride, nModels, probe, n, dots
+        );
+    }
+
+    // Copy the normalized magnitudes of jet into dst.
+    template<typename Dst>
+    static void normalizeMagnitudes(const Jet<N> &jet, Dst &&dst)
+    {
+        float sum_aa = 0;
+        for(int i=0; i<N; i++) {
+            sum_aa += jet.a[i]*jet.a[i];
+        }
+        float scale = sum_aa > 0.0F ? 1.0F / sqrtf(sum_aa) : 0.0F;
+        for(int i=0; i<N; i++) {
+            dst(i) = jet.a[i]*scale;
+        }
+    }
+
+    // Append the jets of graph to m_packedA, as model m_nGraphs.
+    void packGraph(const Graph<N> &graph)
+    {
+        int nNodes = m_nodes.size();
+
+        if(m_nGraphs >= m_capacity) {
+            int capacity = std::max(2*m_capacity, 4);
+            Eigen::Matrix<float, Eigen::Dynamic, N> 
+                packedA(nNodes*capacity, N);
+            Eigen::VectorXf fineNorms(nNodes*capacity);
+            Eigen::Matrix<float, Eigen::Dynamic, N> planes[4];
+            decltype(m_planeA) *oldPlanes[4] = {
+                &m_planeA, &m_planeP, &m_planeRe, &m_planeIm
+            };
+            for(auto &plane: planes) {
+                plane.resize(nNodes*capacity, N);
+            }
+            for(int i=0; i<nNodes; i++) {
+                packedA.middleRows(i*capacity, m_nGraphs) = 
+                    m_packedA.middleRows(i*m_capacity, m_nGraphs);
+                fineNorms.segment(i*capacity, m_nGraphs) =
+                    m_fineNorms.segment(i*m_capacity, m_nGraphs);
+                for(int k=0; k<4; k++) {
+                    planes[k].middleRows(i*capacity, m_nGraphs) =
+                        oldPlanes[k]->middleRows(i*m_capacity, m_nGraphs);
+                }
+            }
+            m_packedA.swap(packedA);
+            m_fineNorms.swap(fineNorms);
+            for(int k=0; k<4; k++) {
+                oldPlanes[k]->swap(planes[k]);
+            }
+            m_capacity = capacity;
+        }
+
+        const int coarseStart = BankOf<N>::type::COARSE_START;
+        for(int i=0; i<nNodes; i++) {
+            int row = i*m_capacity + m_nGraphs;
+            normalizeMagnitudes(graph.getNodes()[i], m_packedA.row(row));
+            m_fineNorms(row) = 
+                m_packedA.row(row).template head<coarseStart>().norm();
+
+            const ComplexJet<N> jet(graph.getNodes()[i]);
+            for(int k=0; k<N; k++) {
+                m_planeA(row, k) = jet.a[k];
+                m_planeP(row, k) = jet.p[k];
+                m_planeRe(row, k) = jet.re[k];
+                m_planeIm(row, k) = jet.im[k];
+            }
+        }
+    }
+
     // always < 0. 
-    float compareEdges(const Graph<N> &graph) const
+    // the distortion of the edge i, if its vector is (x2, y2) in
+    // the graph compared. compareEdges() sums them up.
+    float compareEdge(int i, float x2, float y2) const
+    {
+        float x1, y1;
+        x1 = m_edges[i].x * xScale;
+        y1 = m_edges[i].y * yScale;
+        if(orientationShift != 0) {
+            float angle = (float)orientationShift * 
+                PI/(float)BankOf<N>::type::ORIENTATIONS;
+            float x = x1*cosf(angle) - y1*sinf(angle);
+            y1 = x1*sinf(angle) + y1*cosf(angle);
+            x1 = x;
+        }
+
+        return
+            ((x1-x2)*(x1-x2) + (y1-y2)*(y1-y2)) /
+            (x1*x1 + y1*y1);
+    }
+
+    template<int K>
+    float compareEdges(const Graph<N, K> &graph) const
     {
         assert(m_edges.size() == graph.getEdges().size());
 
         float sum = 0;
-        float nEdges = m_edges.size();
+        int nEdges = m_edges.size();
 
-        for(int i=0; i<nEdges; i++) {
-            float x1, x2, y1, y2;
-            x1 = m_edges[i].x * xScale;
-            y1 = m_edges[i].y * yScale;
-            x2 = graph.getEdges()[i].x;
-            y2 = graph.getEdges()[i].y;
-
-            sum +=
-                ((x1-x2)*(x1-x2) + (y1-y2)*(y1-y2)) /
-                (x1*x1 + y1*y1);
-            
-        }
+        forEachIndex<edgeCount(K)>(nEdges, [&](int i) {
+            sum += compareEdge(
+                i, graph.getEdges()[i].x, graph.getEdges()[i].y
+            );
+        });
 
         return -1.0F * sum / (float)nEdges;
     }
@@ -356,6 +654,14 @@ public:
     {
         m_nodes.clear();
         m_edges.clear();
+        m_complexNodes.clear();
+        m_packedA.resize(0, N);
+        m_fineNorms.resize(0);
+        m_planeA.resize(0, N);
+        m_planeP.resize(0, N);
+        m_planeRe.resize(0, N);
+        m_planeIm.resize(0, N);
+        m_capacity = 0;
         m_nGraphs = 0;
     }
 
@@ -377,7 +683,9 @@ public:
                 node.push_back(i);
                 m_nodes.push_back(node);
                 node.clear();
+                m_complexNodes.emplace_back(1, ComplexJet<N>(i));
             }
+            packGraph(graph);
 
             for(const auto &i: graph.getEdges()){
                 Edge edge;
@@ -398,7 +706,9 @@ public:
         int nEdges = m_edges.size();
         for(int i=0; i<nNodes; i++) {
             m_nodes[i].push_back(graph.getNodes()[i]);
+            m_complexNodes[i].emplace_back(graph.getNodes()[i]);
         }
+        packGraph(graph);
         for(int i=0; i<nEdges; i++) {
             m_edges[i].x = 
                 (m_nGraphs*m_edges[i].x + graph.getEdges()[i].x) / 
@@ -413,7 +723,8 @@ public:
     }
 
     // compare without phase information
-    float compare(const Graph<N> &graph) const
+    template<int K>
+    float compare(const Graph<N, K> &graph) const
     {
         static_assert(std::numeric_limits<float>::is_iec559, "IEEE 754 required");
         assert(m_nodes.size() == graph.getNodes().size());
@@ -424,25 +735,181 @@ public:
 
         int nNodes = m_nodes.size();
 
-        for(int i=0; i<nNodes; i++){
-            float maxSimi;
-            maxSimi = -std::numeric_limits<float>::infinity();
+        forEachIndex<K>(nNodes, [&](int i) {
+            sum += compareNode(i, graph.getNodes()[i]);
+        });
 
-            for(int j=0; j<m_nGraphs; j++){
-                float simi;
-                simi = m_nodes[i][j].compare(graph.getNodes()[i]);
-                if(simi > maxSimi) {
-                    maxSimi = simi;
+        return sum / (float)nNodes;
+    }
+
+    // Same as compare(), but the similarity of each node is looked up
+    // in memo by the position of the node (SimilarityMemo::MAGNITUDE),
+    // and computed only if it is not there.
+    // memo must be used with the jets of one image only. If the jets
+    // of graph are transformed (e.g. by shiftOrientations()), each
+    // transformation must use its own variant.
+    template<int K>
+    float compare(
+        const Graph<N, K> &graph, 
+        SimilarityMemo &memo, 
+        int variant = 0
+    ) const
+    {
+        static_assert(std::numeric_limits<float>::is_iec559, "IEEE 754 required");
+        assert(m_nodes.size() == graph.getNodes().size());
+        assert(m_edges.size() == graph.getEdges().size());
+        assert(m_nGraphs != 0);
+
+        float sum = 0;
+
+        int nNodes = m_nodes.size();
+
+        forEachIndex<K>(nNodes, [&](int i) {
+            const auto &jet = graph.getNodes()[i];
+            sum += memo.get(SimilarityMemo::MAGNITUDE, variant, i, jet.x, jet.y, 
+                [&]() -> SimilarityMemo::Entry {
+                    return {compareNode(i, jet), 0.0F};
                 }
+            ).simi;
+        });
+
+        return sum / (float)nNodes;
+    }
+
+    // compare without phase information: the similarity between the
+    // node 'node' of this bunch graph and jet (the max over all the
+    // models). compare() is the average of it over all the nodes.
+    float compareNode(int node, const Jet<N> &jet) const
+    {
+        assert(node >= 0 && node < m_nodes.size());
+        assert(m_nGraphs != 0);
+
+        Eigen::Matrix<float, N, 1> probe;
+        normalizeMagnitudes(jet, probe);
+
+        // the similarities with all the models: the dot products with
+        // a chunk of models at a time, into a buffer on the stack.
+        float simi[MODEL_CHUNK];
+        float maxSimi = -std::numeric_limits<float>::infinity();
+        for(int j=0; j<m_nGraphs; j+=MODEL_CHUNK) {
+            int nModels = std::min(MODEL_CHUNK, m_nGraphs - j);
+            dotModels(node, j, nModels, probe.data(), 0, N, simi);
+            maxSimi = std::max(
+                maxSimi, *std::max_element(simi, simi + nModels)
+            );
+        }
+
+        return maxSimi;
+    }
+
+    // The model whose node 'node' is the most similar to jet (compared
+    // without phase information, as compareNode() does). The first one
+    // if there is a tie.
+    int bestModel(int node, const Jet<N> &jet) const
+    {
+        assert(node >= 0 && node < m_nodes.size());
+        assert(m_nGraphs != 0);
+
+        Eigen::Matrix<float, N, 1> probe;
+        normalizeMagnitudes(jet, probe);
+
+        float simi[MODEL_CHUNK];
+        float maxSimi = -std::numeric_limits<float>::infinity();
+        int best = 0;
+        for(int j=0; j<m_nGraphs; j+=MODEL_CHUNK) {
+            int nModels = std::min(MODEL_CHUNK, m_nGraphs - j);
+            dotModels(node, j, nModels, probe.data(), 0, N, simi);
+            int index = std::max_element(simi, simi + nModels) - simi;
+            if(simi[index] > maxSimi) {
+                maxSimi = simi[index];
+                best = j + index;
             }
+        }
 
-            sum += maxSimi;
+        return best;
+    }
+
+    // compare without phase information, node by node:
+    // result[k] = the similarity between the node 'node' of this
+    // bunch graph and jets[k] (the max over all the models), for
+    // k in [0, nJets). The same as the terms summed up in compare().
+    void compareNode(
+        int node,
+        const Jet<N> *jets,
+        int nJets,
+        float *result
+    ) const
+    {
+        assert(node >= 0 && node < m_nodes.size());
+        assert(nJets >= 0);
+        assert(m_nGraphs != 0);
+
+        for(int k=0; k<nJets; k++) {
+            result[k] = compareNode(node, jets[k]);
         }
+    }
+
+    // An upper bound of compareNode(node, jet), from the coarse bands
+    // only (the magnitudes from COARSE_START of BankOf<N> on): the
+    // dot product of the fine bands is at most the product of their
+    // norms. About half the cost of compareNode() with tens of models.
+    float compareNodeBound(int node, const Jet<N> &jet) const
+    {
+        assert(node >= 0 && node < m_nodes.size());
+        assert(m_nGraphs != 0);
+
+        const int coarseStart = BankOf<N>::type::COARSE_START;
+
+        // only the coarse bands of the probe are normalized.
+        Eigen::Map<const Eigen::Matrix<float, N, 1>> a(jet.a);
+        float sumFine = a.template head<coarseStart>().squaredNorm();
+        float sum_aa = sumFine + a.template tail<N_COARSE>().squaredNorm();
+        float scale = sum_aa > 0.0F ? 1.0F / sqrtf(sum_aa) : 0.0F;
+        Eigen::Matrix<float, N_COARSE, 1> probe = 
+            a.template tail<N_COARSE>() * scale;
+        float probeFineNorm = sqrtf(sumFine)*scale;
+
+        float bound[MODEL_CHUNK];
+        float maxBound = -std::numeric_limits<float>::infinity();
+        for(int j=0; j<m_nGraphs; j+=MODEL_CHUNK) {
+            int nModels = std::min(MODEL_CHUNK, m_nGraphs - j);
+            const float *fineNorms = 
+                m_fineNorms.data() + node*m_capacity + j;
+            dotModels(
+                node, j, nModels, probe.data(), coarseStart, N_COARSE, bound
+            );
+            for(int m=0; m<nModels; m++) {
+                maxBound = std::max(
+                    maxBound, bound[m] + probeFineNorm*fineNorms[m]
+                );
+            }
+        }
+
+        return maxBound;
+    }
+
+    // An upper bound of compare(graph): the average of
+    // compareNodeBound(). A graph whose bound is below the similarity
+    // of another graph can be rejected without comparing all the bands.
+    template<int K>
+    float compareBound(const Graph<N, K> &graph) const
+    {
+        assert(m_nodes.size() == graph.getNodes().size());
+        assert(m_nGraphs != 0);
+
+        float sum = 0;
+
+        int nNodes = m_nodes.size();
+
+        forEachIndex<K>(nNodes, [&](int i) {
+            sum += compareNodeBound(i, graph.getNodes()[i]);
+        });
 
         return sum / (float)nNodes;
     }
 
-    float compare(const Graph<N> &graph, float lambda) const
+    template<int K>
+    float compare(const Graph<N, K> &graph, float lambda) const
     {
         return compare(graph) + lambda*compareEdges(graph);
     }
@@ -456,9 +923,10 @@ public:
     //     const Jet<40> &jet2,
     //     int focus
     // )
+    template<int K>
     std::tuple<float/*similarity*/,float/*square sum over displacements*/>
     compareWithPhaseFocus(
-        const Graph<N> &graph,
+        const Graph<N, K> &graph,
         int focus,
         std::function<
             std::tuple<float,float>(const Jet<N>&,const Jet<N>&,int)
@@ -510,9 +978,10 @@ public:
     //     const Jet<40> &jet2,
     //     int focus
     // )
+    template<int K>
     std::tuple<float/*similarity*/,float/*square sum over displacements*/>
     compareWithPhaseFocus(
-        const Graph<N> &graph,
+        const Graph<N, K> &graph,
         int focus,
         std::function<
             std::tuple<float,float> (const Jet<N>&,const Jet<N>&,int)
@@ -526,6 +995,447 @@ public:
         return std::make_tuple(simi, sumDisp2); 
     }
 
+    // Same as compareWithPhaseFocus(), but use ComplexJet: no
+    // trigonometric functions in the inner loop.
+    // You need to implement a function for estimating displacement with focus:
+    // std::tuple<float, float>
+    // complexDisplacementWithFocus(
+    //     const ComplexJet<40> &jet1,
+    //     const ComplexJet<40> &jet2,
+    //     int focus
+    // )
+    template<int K>
+    std::tuple<float/*similarity*/,float/*square sum over displacements*/>
+    compareWithPhaseFocusComplex(
+        const Graph<N, K> &graph,
+        int focus,
+        std::function<
+            std::tuple<float,float>(const ComplexJet<N>&,const ComplexJet<N>&,int)
+        > dispFunc
+    ) const
+    {
+        static_assert(std::numeric_limits<float>::is_iec559, "IEEE 754 required");
+        assert(m_nodes.size() == graph.getNodes().size());
+        assert(m_edges.size() == graph.getEdges().size());
+        assert(m_nGraphs != 0);
+
+        float sumSimi = 0;
+        float sumDisp2 = 0;
+
+        int nNodes = m_nodes.size();
+
+        forEachIndex<K>(nNodes, [&](int i) {
+            float simi, disp2;
+            std::tie(simi, disp2) = compareNodeWithPhaseFocusComplex(
+                i, graph.getNodes()[i], focus, dispFunc
+            );
+            sumSimi += simi;
+            sumDisp2 += disp2;
+        });
+
+        return std::make_tuple(sumSimi / (float)nNodes, sumDisp2);
+    }
+
+    // Same as compareWithPhaseFocusComplex(), but the similarity of each
+    // node is looked up in memo by the position of the node
+    // (SimilarityMemo::PHASE), and computed only if it is not there.
+    // memo must be used with the jets of one image, one focus and
+    // one dispFunc only.
+    template<int K>
+    std::tuple<float/*similarity*/,float/*square sum over displacements*/>
+    compareWithPhaseFocusComplex(
+        const Graph<N, K> &graph,
+        int focus,
+        std::function<
+            std::tuple<float,float>(const ComplexJet<N>&,const ComplexJet<N>&,int)
+        > dispFunc,
+        SimilarityMemo &memo
+    ) const
+    {
+        static_assert(std::numeric_limits<float>::is_iec559, "IEEE 754 required");
+        assert(m_nodes.size() == graph.getNodes().size());
+        assert(m_edges.size() == graph.getEdges().size());
+        assert(m_nGraphs != 0);
+
+        float sumSimi = 0;
+        float sumDisp2 = 0;
+
+        int nNodes = m_nodes.size();
+
+        forEachIndex<K>(nNodes, [&](int i) {
+            const auto &jet = graph.getNodes()[i];
+            auto entry = memo.get(
+                SimilarityMemo::PHASE, orientationShift, i, jet.x, jet.y,
+                [&]() -> SimilarityMemo::Entry {
+                    float simi, disp2;
+                    std::tie(simi, disp2) = compareNodeWithPhaseFocusComplex(
+                        i, jet, focus, dispFunc
+                    );
+                    return {simi, disp2};
+                }
+            );
+            sumSimi += entry.simi;
+            sumDisp2 += entry.disp2;
+        });
+
+        return std::make_tuple(sumSimi / (float)nNodes, sumDisp2);
+    }
+
+    // The terms summed up in compareWithPhaseFocusComplex(), for the
+    // node 'node' of this bunch graph and jet: the max similarity over
+    // all the models, and the square displacement of that model.
+    std::tuple<float/*similarity*/,float/*square displacement*/>
+    compareNodeWithPhaseFocusComplex(
+        int node,
+        const Jet<N> &jet,
+        int focus,
+        const std::function<
+            std::tuple<float,float>(const ComplexJet<N>&,const ComplexJet<N>&,int)
+        > &dispFunc
+    ) const
+    {
+        assert(node >= 0 && node < m_nodes.size());
+        assert(m_nGraphs != 0);
+
+        float maxSimi;
+        float minDisp2;
+        maxSimi = -std::numeric_limits<float>::infinity();
+
+        const ComplexJet<N> jet2(jet);
+        JetRotation<N> rotation;
+
+        for(int j=0; j<m_nGraphs; j++){
+            float simi;
+            const auto &jet1 = m_complexNodes[node][j];
+            float dx, dy;
+
+            std::tie(dx, dy) = dispFunc(jet1, jet2, focus);
+            rotation.init(jet1.getKx(), jet1.getKy(), dx, dy);
+            
+            simi = jet1.compareWithPhase(jet2, rotation);
+
+            if(simi > maxSimi) {
+                maxSimi = simi;
+                minDisp2 = dx*dx + dy*dy;
+            }
+        }
+
+        return std::make_tuple(maxSimi, minDisp2);
+    }
+
+    // Same as compareNodeWithPhaseFocusComplex() with the displacement
+    // of complexDisplacementWithFocus() (see alg.h), but batched: the
+    // models of the node are processed PHASE_LANES at a time from the
+    // planes (m_planeA, ...) by phaseLanes() (see fastmath.h), which
+    // computes their displacements (one 2x2 system each) and
+    // similarities in loops over the models, vectorized for the CPU.
+    // No std::function is called. The results are the same, bit for
+    // bit.
+    std::tuple<float/*similarity*/,float/*square displacement*/>
+    compareNodeWithPhase(int node, const Jet<N> &jet, int focus) const
+    {
+        using Bank = typename BankOf<N>::type;
+        assert(node >= 0 && node < m_nodes.size());
+        assert(focus >= 1 && focus <= Bank::SCALES);
+        assert(m_nGraphs != 0);
+
+        const ComplexJet<N> probe(jet);
+
+        PhaseLanes lanes;
+        lanes.stride = m_planeA.rows();
+        lanes.probeA = jet.a;
+        lanes.probeP = jet.p;
+        lanes.probeRe = probe.re;
+        lanes.probeIm = probe.im;
+        lanes.kx = m_nodes[node][0].getKx();
+        lanes.ky = m_nodes[node][0].getKy();
+        lanes.n = N;
+        // the bands of the displacement: the 'focus' coarsest scales.
+        lanes.start = N - Bank::ORIENTATIONS*focus;
+        lanes.focus = focus;
+
+        float maxSimi = -std::numeric_limits<float>::infinity();
+        float minDisp2 = 0.0F;
+
+        for(int j=0; j<m_nGraphs; j+=PHASE_LANES) {
+            const size_t row = (size_t)node*m_capacity + j;
+            lanes.a = m_planeA.data() + row;
+            lanes.p = m_planeP.data() + row;
+            lanes.re = m_planeRe.data() + row;
+            lanes.im = m_planeIm.data() + row;
+            lanes.nLanes = std::min(PHASE_LANES, m_nGraphs - j);
+
+            float simi[PHASE_LANES], dx[PHASE_LANES], dy[PHASE_LANES];
+            phaseLanes(lanes, simi, dx, dy);
+
+            for(int m=0; m<lanes.nLanes; m++) {
+                if(simi[m] > maxSimi) {
+                    maxSimi = simi[m];
+                    minDisp2 = dx[m]*dx[m] + dy[m]*dy[m];
+                }
+            }
+        }
+
+        return std::make_tuple(maxSimi, minDisp2);
+    }
+
+private:
+    // The similarity of compare(), a callable returning the similarity
+    // and the square displacement of a node, looked up in memo first
+    // if memo is not null.
+    template<typename Compare>
+    float lookupNodeTerm(
+        int node,
+        const Jet<N> &jet,
+        SimilarityMemo *memo,
+        Compare &&compare
+    ) const
+    {
+        if(!memo) {
+            return std::get<0>(compare());
+        }
+        return memo->get(
+            SimilarityMemo::PHASE, orientationShift, node, jet.x, jet.y,
+            [&]() -> SimilarityMemo::Entry {
+                float simi, disp2;
+                std::tie(simi, disp2) = compare();
+                return {simi, disp2};
+            }
+        ).simi;
+    }
+
+    // the similarity of compareNodeWithPhaseFocusComplex(), looked up
+    // in memo first if memo is not null.
+    float compareNodeTerm(
+        int node,
+        const Jet<N> &jet,
+        int focus,
+        const std::function<
+            std::tuple<float,float>(const ComplexJet<N>&,const ComplexJet<N>&,int)
+        > &dispFunc,
+        SimilarityMemo *memo
+    ) const
+    {
+        return lookupNodeTerm(node, jet, memo, [&]() {
+            return compareNodeWithPhaseFocusComplex(node, jet, focus, dispFunc);
+        });
+    }
+
+    // the similarity of compareNodeWithPhase(), looked up in memo first
+    // if memo is not null. The same entries as the compareNodeTerm()
+    // of complexDisplacementWithFocus().
+    float compareNodeTerm(
+        int node,
+        const Jet<N> &jet,
+        int focus,
+        SimilarityMemo *memo
+    ) const
+    {
+        return lookupNodeTerm(node, jet, memo, [&]() {
+            return compareNodeWithPhase(node, jet, focus);
+        });
+    }
+
+public:
+
+    template<int K>
+    std::tuple<float/*similarity*/,float/*square sum over displacements*/>
+    compareWithPhaseFocusComplex(
+        const Graph<N, K> &graph,
+        int focus,
+        std::function<
+            std::tuple<float,float> (const ComplexJet<N>&,const ComplexJet<N>&,int)
+        > dispFunc,
+        float lambda
+    ) const
+    {
+        float simi, sumDisp2;
+        std::tie(simi, sumDisp2) = compareWithPhaseFocusComplex(graph, focus, dispFunc);
+        simi += lambda*compareEdges(graph);
+        return std::make_tuple(simi, sumDisp2); 
+    }
+
+    template<int K>
+    std::tuple<float/*similarity*/,float/*square sum over displacements*/>
+    compareWithPhaseFocusComplex(
+        const Graph<N, K> &graph,
+        int focus,
+        std::function<
+            std::tuple<float,float> (const ComplexJet<N>&,const ComplexJet<N>&,int)
+        > dispFunc,
+        SimilarityMemo &memo,
+        float lambda
+    ) const
+    {
+        float simi, sumDisp2;
+        std::tie(simi, sumDisp2) = 
+            compareWithPhaseFocusComplex(graph, focus, dispFunc, memo);
+        simi += lambda*compareEdges(graph);
+        return std::make_tuple(simi, sumDisp2); 
+    }
+
+    // The terms of the score of a base graph, i.e. the similarity of
+    // compareWithPhaseFocusComplex() with lambda, so that the score of
+    // the graph with one node moved is computed in O(nNodes) instead
+    // of O(nNodes^2) (see initScoreTerms() and moveNodeDelta()).
+    // K: the same as the 'K' of the base graph.
+    template<int K>
+    struct ScoreTerms {
+        int focus;
+        float lambda;
+        Storage<int, K> x, y;       // the positions of the nodes
+        Storage<float, K> nodes;    // the similarity of each node
+        Storage<float, edgeCount(K)> edges;   // the distortion of each edge
+    };
+
+private:
+    // initScoreTerms(), with nodeTerm(i, jet) the similarity of the
+    // node i.
+    template<int K, typename NodeTerm>
+    ScoreTerms<K> initScoreTermsWith(
+        const Graph<N, K> &graph,
+        int focus,
+        float lambda,
+        NodeTerm &&nodeTerm
+    ) const
+    {
+        assert(m_nodes.size() == graph.getNodes().size());
+        assert(m_edges.size() == graph.getEdges().size());
+        assert(m_nGraphs != 0);
+
+        int nNodes = m_nodes.size();
+        int nEdges = m_edges.size();
+
+        ScoreTerms<K> ret;
+        ret.focus = focus;
+        ret.lambda = lambda;
+        ret.x.resize(nNodes);
+        ret.y.resize(nNodes);
+        ret.nodes.resize(nNodes);
+        ret.edges.resize(nEdges);
+
+        forEachIndex<K>(nNodes, [&](int i) {
+            const auto &jet = graph.getNodes()[i];
+            ret.x[i] = jet.x;
+            ret.y[i] = jet.y;
+            ret.nodes[i] = nodeTerm(i, jet);
+        });
+        forEachIndex<edgeCount(K)>(nEdges, [&](int i) {
+            ret.edges[i] = compareEdge(
+                i, graph.getEdges()[i].x, graph.getEdges()[i].y
+            );
+        });
+
+        return ret;
+    }
+
+    // moveNodeDelta(), with simi the similarity of the moved node.
+    template<int K>
+    float moveNodeDeltaWith(
+        const ScoreTerms<K> &terms,
+        int node,
+        const Jet<N> &jet,
+        float simi
+    ) const
+    {
+        assert(node >= 0 && node < m_nodes.size());
+        assert(terms.nodes.size() == m_nodes.size());
+
+        int nNodes = m_nodes.size();
+        float nEdges = m_edges.size();
+
+        float deltaSimi = simi - terms.nodes[node];
+
+        float deltaEdges = 0;
+        forEachIndex<K>(nNodes, [&](int i) {
+            if(i == node) {
+                return;
+            }
+            int edge = Graph<N, K>::getEdgeIndex(i, node);
+            float x2 = (float)(jet.x - terms.x[i]);
+            float y2 = (float)(jet.y - terms.y[i]);
+            if(i > node) {
+                x2 = -x2;
+                y2 = -y2;
+            }
+            deltaEdges += compareEdge(edge, x2, y2) - terms.edges[edge];
+        });
+
+        return 
+            deltaSimi / (float)nNodes - 
+            terms.lambda * deltaEdges / nEdges;
+    }
+
+public:
+    // Compute the score terms of graph. If memo is not null, the
+    // similarities of the nodes are looked up in it first.
+    template<int K>
+    ScoreTerms<K> initScoreTerms(
+        const Graph<N, K> &graph,
+        int focus,
+        const std::function<
+            std::tuple<float,float>(const ComplexJet<N>&,const ComplexJet<N>&,int)
+        > &dispFunc,
+        float lambda,
+        SimilarityMemo *memo = nullptr
+    ) const
+    {
+        return initScoreTermsWith(graph, focus, lambda,
+            [&](int i, const Jet<N> &jet) {
+                return compareNodeTerm(i, jet, focus, dispFunc, memo);
+            }
+        );
+    }
+
+    // Same as initScoreTerms() with complexDisplacementWithFocus(), by
+    // compareNodeWithPhase().
+    template<int K>
+    ScoreTerms<K> initScoreTerms(
+        const Graph<N, K> &graph,
+        int focus,
+        float lambda,
+        SimilarityMemo *memo = nullptr
+    ) const
+    {
+        return initScoreTermsWith(graph, focus, lambda,
+            [&](int i, const Jet<N> &jet) {
+                return compareNodeTerm(i, jet, focus, memo);
+            }
+        );
+    }
+
+    // The change of the score of the base graph of terms, if its node
+    // 'node' is replaced by jet: only the node and its nNodes-1 edges
+    // are compared.
+    template<int K>
+    float moveNodeDelta(
+        const ScoreTerms<K> &terms,
+        int node,
+        const Jet<N> &jet,
+        const std::function<
+            std::tuple<float,float>(const ComplexJet<N>&,const ComplexJet<N>&,int)
+        > &dispFunc,
+        SimilarityMemo *memo = nullptr
+    ) const
+    {
+        return moveNodeDeltaWith(terms, node, jet,
+            compareNodeTerm(node, jet, terms.focus, dispFunc, memo));
+    }
+
+    // Same as moveNodeDelta() with complexDisplacementWithFocus(), by
+    // compareNodeWithPhase().
+    template<int K>
+    float moveNodeDelta(
+        const ScoreTerms<K> &terms,
+        int node,
+        const Jet<N> &jet,
+        SimilarityMemo *memo = nullptr
+    ) const
+    {
+        return moveNodeDeltaWith(terms, node, jet,
+            compareNodeTerm(node, jet, terms.focus, memo));
+    }
+
 
 
 
@@ -1,11 +1,21 @@
 #pragma once
 
 #include "kernels.h"
+#include "jetsfile.h"
+#include "jetcodec.h"
 #include "utils.h"
 
 #include <tuple>
 #include <memory>
+#include <algorithm>
+#include <vector>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <type_traits>
 
 #include <opencv2/core.hpp>
 
@@ -14,6 +24,48 @@
 
 #define PI 3.14159265358979323846F
 
+// A bank of Gabor kernels: SCALES scales (nu) times ORIENTATIONS
+// orientations (mu). The kernel j = mu + ORIENTATIONS*nu has the wave
+// vector of length waveNumber(nu) at the angle mu*PI/ORIENTATIONS.
+// Its jets are Jet<N>, and BankOf<N> must name it.
+template<int Scales, int Orientations>
+struct GaborBank {
+    static_assert(Scales >= 2, "A GaborBank needs at least 2 scales.");
+    static_assert(Orientations >= 1, "A GaborBank needs at least 1 orientation.");
+
+    static constexpr int SCALES = Scales;
+    static constexpr int ORIENTATIONS = Orientations;
+    static constexpr int N = Scales*Orientations;
+
+    // the width of the Gaussian envelope, relative to the wavelength.
+    static constexpr float SIGMA = 2.0F*PI;
+    // each kernel is at most a KERNEL_SIZE*KERNEL_SIZE matrix.
+    static constexpr int KERNEL_SIZE = 101;
+    // the first kernel of the two coarsest scales (the largest nu),
+    // used by the cascade of BunchGraph::compareBound().
+    static constexpr int COARSE_START = (Scales - 2)*Orientations;
+    // the number of scales per octave (waveNumber() spans 2 octaves),
+    // if SCALES is odd. Used by the image pyramid of step1().
+    static constexpr int SCALES_PER_OCTAVE = (Scales - 1)/2;
+
+    // from PI/2 (nu = 0) down to PI/8 (nu = SCALES-1), evenly spaced
+    // on a log scale: the scales of the 5x8 bank are 2^(-1/2) apart.
+    static float waveNumber(int nu)
+    {
+        return powf(2.0F, -2.0F*(float)nu/(float)(SCALES - 1)) * PI/2.0F;
+    }
+};
+
+// The bank of the original algorithm.
+using Bank5x8 = GaborBank<5, 8>;
+// A cheaper bank: less than half the kernels and jet size.
+using Bank3x6 = GaborBank<3, 6>;
+
+// The bank whose jets are Jet<N>.
+template<int N> struct BankOf;
+template<> struct BankOf<Bank5x8::N> { using type = Bank5x8; };
+template<> struct BankOf<Bank3x6::N> { using type = Bank3x6; };
+
 // The kernels used to calculate a jet
 template <int N>
 struct Kernels {
@@ -29,22 +81,85 @@ struct Kernels {
     // reduce memory usage.
     std::shared_ptr<float[]> kx;
     std::shared_ptr<float[]> ky;
+
+    // DO NOT modify re and im after the spectra have been used!
+    // The spectra of the kernels used by ConvMethod::FFT. They are
+    // generated when first needed, and shared by all the images
+    // (and all the copies of this struct) with the same DFT size.
+    std::shared_ptr<KernelSpectrumCache> spectra =
+        std::make_shared<KernelSpectrumCache>();
+
+    // DO NOT modify re, im, kx and ky after calling getFingerprint()!
+    // The result of getFingerprint() (0 if not calculated yet), shared
+    // by all the copies of this struct.
+    std::shared_ptr<std::atomic<std::uint64_t>> fingerprint =
+        std::make_shared<std::atomic<std::uint64_t>>(0);
+
+    // The kernels may have different sizes (see genGaborKernels()).
+    // Pass the result to CalcJet::init().
+    std::tuple<int/*maxKernelRows*/, int/*maxKernelCols*/>
+    getMaxSize() const
+    {
+        int maxRows = 0, maxCols = 0;
+        for(int i=0; i<N; i++) {
+            maxRows = std::max(maxRows, std::max(re[i].rows, im[i].rows));
+            maxCols = std::max(maxCols, std::max(re[i].cols, im[i].cols));
+        }
+        return std::make_tuple(maxRows, maxCols);
+    }
+
+    // The id of kx and ky in KernelRegistry. Used by Jet::bank.
+    int getBankId() const
+    {
+        return KernelRegistry::intern(kx.get(), ky.get(), N);
+    }
+
+    // A hash of the sizes and coefficients of all the kernels, and
+    // of kx and ky. Jets cached on disk are only valid for the
+    // kernels with the same fingerprint.
+    std::uint64_t getFingerprint() const
+    {
+        std::uint64_t hash = *fingerprint;
+        if(hash != 0) {
+            return hash;
+        }
+
+        hash = fnv1a(kx.get(), sizeof(float)*N);
+        hash = fnv1a(ky.get(), sizeof(float)*N, hash);
+
+        for(const cv::Mat *kernels: {re, im}) {
+            for(int i=0; i<N; i++) {
+                const cv::Mat &kernel = kernels[i];
+                hash = fnv1a(&kernel.rows, sizeof(kernel.rows), hash);
+                hash = fnv1a(&kernel.cols, sizeof(kernel.cols), hash);
+                for(int r=0; r<kernel.rows; r++) {
+                    hash = fnv1a(
+                        kernel.ptr(r), 
+                        kernel.cols*kernel.elemSize(), 
+                        hash
+                    );
+                }
+            }
+        }
+
+        *fingerprint = hash;
+        return hash;
+    }
 };
 
 
 // The definition of a jet, functions for comparing
 // and displacement estimation
+// A plain struct: trivially copyable, no heap memory.
 template <int N>
 struct Jet {
     static_assert(N > 0, "The 'N' in Jet<N> must be a positive integer.");
 
-    // DO NOT modify kx and ky in a jet!
-    // The ks used to generate Garbor kernels.
-    // Different jets generated by the same set of Garbor
-    // kernels will have the same ks, so I use heap to
-    // reduce memory usage.
-    std::shared_ptr<float[]> kx;
-    std::shared_ptr<float[]> ky;
+    // The ks used to generate Garbor kernels, as an id in
+    // KernelRegistry (see Kernels::getBankId()). All the jets
+    // generated by the same set of Garbor kernels share one copy
+    // of the ks. Use getKx() and getKy() to get them.
+    int bank;
 
     int x;
     int y;
@@ -55,6 +170,16 @@ struct Jet {
     // phases
     float p[N];
 
+    const float *getKx() const
+    {
+        return KernelRegistry::getKx(bank);
+    }
+
+    const float *getKy() const
+    {
+        return KernelRegistry::getKy(bank);
+    }
+
     // compare without phase information
     float compare(const Jet<N> &jet) const
     {
@@ -79,25 +204,25 @@ struct Jet {
 
     float compareWithPhase(const Jet<N> &jet, float dx, float dy) const
     {
+        if(fastMath()) {
+            return fastCompareWithPhase(jet, dx, dy);
+        }
+
         float sum_abcos = 0;
         float sum_aa = 0;
         float sum_bb = 0;
 
-        auto kx_p = kx.get();
-        auto ky_p = ky.get();
+        // cosf(p1 - p2 - (dx*kx + dy*ky)) of each band
+        float cosValues[N];
+        libmPhaseCos(p, jet.p, getKx(), getKy(), dx, dy, cosValues, N);
+
         for(int i=0; i<N; i++) {
             float a1, a2;   // a and a'
-            float kx, ky;
-            float p1, p2;   // phi and phi'
 
             a1 = a[i];
             a2 = jet.a[i];
-            p1 = p[i];
-            p2 = jet.p[i];
-            kx = kx_p[i];
-            ky = ky_p[i];
             
-            sum_abcos += a1*a2 * cosf(p1 - p2 - (dx*kx + dy*ky));
+            sum_abcos += a1*a2 * cosValues[i];
             sum_aa += a1*a1;
             sum_bb += a2*a2;
         }
@@ -105,6 +230,27 @@ struct Jet {
         return sum_abcos / sqrtf(sum_aa*sum_bb);
     }
 
+    // Same as compareWithPhase(), with fastSinCos() and fastRsqrt()
+    // (the fast math mode).
+    float fastCompareWithPhase(const Jet<N> &jet, float dx, float dy) const
+    {
+        float sum_abcos = 0;
+        float sum_aa = 0;
+        float sum_bb = 0;
+
+        // first all the cosines, in a loop that is vectorized.
+        float cosValues[N];
+        fastPhaseCos(p, jet.p, getKx(), getKy(), dx, dy, cosValues, N);
+
+        for(int i=0; i<N; i++) {
+            sum_abcos += a[i]*jet.a[i] * cosValues[i];
+            sum_aa += a[i]*a[i];
+            sum_bb += jet.a[i]*jet.a[i];
+        }
+
+        return sum_abcos * fastRsqrt(sum_aa*sum_bb);
+    }
+
 
     // DO NOT calculate the displacement of jets generated by DIFFERENT
     // sets of Garbor kernels!
@@ -132,8 +278,8 @@ struct Jet {
         float Gamma_xy = 0;
         float Gamma_yx = 0;
 
-        auto kx_p = kx.get();
-        auto ky_p = ky.get();
+        auto kx_p = getKx();
+        auto ky_p = getKy();
         for(int i=0; i<count; i++){
             float a1, a2, kx, ky, phi1, phi2, deltaPhi;
             a1 = a[startIndex + i];
@@ -153,7 +299,7 @@ struct Jet {
             // and the estimated d will not be precise.
             float ddotk, adjust;
             ddotk = dx0*kx + dy0*ky;
-            adjust = (wrapAngle(deltaPhi - ddotk + PI) - PI) - (deltaPhi - ddotk);
+            adjust = (fastWrapAngle(deltaPhi - ddotk + PI) - PI) - (deltaPhi - ddotk);
             deltaPhi += adjust;
             //if(abs(adjust) > 0.01) {
                 //std::cout << startIndex + i << "\t" << adjust << "\n";
@@ -177,6 +323,89 @@ struct Jet {
     
 };
 
+static_assert(std::is_trivially_copyable<Jet<40>>::value, 
+    "Jet<N> should be trivially copyable.");
+
+
+// exp(-i*(dx*kx[j] + dy*ky[j])) for j = 0, 1, ..., N-1.
+// Used by ComplexJet::compareWithPhase(). Compute it once for each
+// displacement, and reuse it for all the jets compared with the
+// same displacement.
+template <int N>
+struct JetRotation {
+    float c[N];    // cos(dx*kx + dy*ky)
+    float s[N];    // sin(dx*kx + dy*ky)
+
+    void init(const float *kx, const float *ky, float dx, float dy)
+    {
+        for(int i=0; i<N; i++) {
+            fastSinCos(dx*kx[i] + dy*ky[i], s[i], c[i]);
+        }
+    }
+
+    JetRotation() noexcept {}
+    JetRotation(const float *kx, const float *ky, float dx, float dy) noexcept
+    {init(kx, ky, dx, dy);}
+};
+
+
+// A jet plus its responses in complex form: 
+// c[j] = a[j]*exp(i*p[j]) / sqrt(sum of a[j]^2).
+// compareWithPhase() gives the same results as Jet::compareWithPhase(),
+// but only uses multiply-adds (no trigonometric functions).
+// displacement() is inherited from Jet.
+template <int N>
+struct ComplexJet: public Jet<N> {
+    // the real and imaginary parts of the normalized responses
+    float re[N];
+    float im[N];
+
+    void init(const Jet<N> &jet)
+    {
+        static_cast<Jet<N>&>(*this) = jet;
+
+        float sum_aa = 0;
+        for(int i=0; i<N; i++) {
+            sum_aa += jet.a[i]*jet.a[i];
+        }
+        float scale = sum_aa > 0.0F ? 1.0F / sqrtf(sum_aa) : 0.0F;
+
+        for(int i=0; i<N; i++) {
+            float sinp, cosp;
+            fastSinCos(jet.p[i], sinp, cosp);
+            re[i] = jet.a[i]*scale*cosp;
+            im[i] = jet.a[i]*scale*sinp;
+        }
+    }
+
+    // same as Jet::compareWithPhase(jet, dx, dy), rotation is the
+    // JetRotation of (dx, dy).
+    float compareWithPhase(
+        const ComplexJet<N> &jet, 
+        const JetRotation<N> &rotation
+    ) const
+    {
+        // Re(c1 * conj(c2) * exp(-i*(d*k)))
+        float sum = 0;
+        for(int i=0; i<N; i++) {
+            float zre = re[i]*jet.re[i] + im[i]*jet.im[i];
+            float zim = im[i]*jet.re[i] - re[i]*jet.im[i];
+            sum += zre*rotation.c[i] + zim*rotation.s[i];
+        }
+        return sum;
+    }
+
+    // same as Jet::compareWithPhase()
+    float compareWithPhase(const ComplexJet<N> &jet, float dx, float dy) const
+    {
+        JetRotation<N> rotation(this->getKx(), this->getKy(), dx, dy);
+        return compareWithPhase(jet, rotation);
+    }
+
+    ComplexJet() noexcept {}
+    explicit ComplexJet(const Jet<N> &jet) noexcept {init(jet);}
+};
+
 
  
 
@@ -281,27 +510,218 @@ struct Jet {
 //};
 
 
+// -------------- Lazy Cache ----------------
+// Used by CalcJet in lazy mode.
+// The image is split into tiles of tileSize*tileSize pixels, and the
+// jets of a tile are computed on the first access to it. When the
+// tiles would use more than maxMemory bytes, the least recently used
+// one is released.
+// Thread-safe. A released tile stays valid for the threads that are
+// still reading it, so the memory used may briefly exceed maxMemory.
+template <int N>
+class LazyJetCache {
+private:
+    struct Tile {
+        std::once_flag computed;
+        std::atomic<std::uint64_t> lastUse{0};
+        std::unique_ptr<float[]> a;
+        std::unique_ptr<float[]> p;
+    };
+
+    Convolution m_conv;
+    KernelBank m_bank;
+    int m_width = 0;
+    int m_height = 0;
+    int m_tileSize = 0;
+    int m_tilesX = 0;        // the number of tiles in a row
+    size_t m_maxTiles = 0;   // the max number of resident tiles
+
+    // m_tiles[tileY*m_tilesX + tileX], nullptr if not resident.
+    // Always accessed by std::atomic_load() and std::atomic_store().
+    std::vector<std::shared_ptr<Tile>> m_tiles;
+
+    std::mutex m_mutex;               // protects m_resident
+    std::vector<int> m_resident;      // indices of the resident tiles
+
+    // Increases by one when a tile is loaded. Used as the time of
+    // the last use of tiles.
+    std::atomic<std::uint64_t> m_clock{0};
+
+    void computeTile(Tile &tile, int tileX, int tileY)
+    {
+        size_t n = size_t(N)*m_tileSize*m_tileSize;
+        tile.a.reset(new float[n]);
+        tile.p.reset(new float[n]);
+
+        int x0 = tileX*m_tileSize;
+        int y0 = tileY*m_tileSize;
+        int x1 = std::min(x0 + m_tileSize, m_width);
+        int y1 = std::min(y0 + m_tileSize, m_height);
+        const bool fast = fastMath();
+
+        for(int iy=y0; iy<y1; iy++){
+            for(int ix=x0; ix<x1; ix++){
+                int index = N*((iy - y0)*m_tileSize + (ix - x0));
+                float *a = tile.a.get() + index;
+                float *p = tile.p.get() + index;
+                float result[2*N];
+
+                m_conv.calcConvBank(m_bank, ix, iy, result);
+
+                if(fast){
+                    fastComplex2mag(result, result + N, a, p, N);
+                    continue;
+                }
+                libmComplex2mag(result, result + N, a, p, N);
+            }
+        }
+    }
+
+    // Create an empty tile at index, and release the least
+    // recently used tiles if needed.
+    std::shared_ptr<Tile> loadTile(int index)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // another thread may have loaded it.
+        auto tile = std::atomic_load(&m_tiles[index]);
+        if(tile){
+            return tile;
+        }
+
+        while(m_resident.size() >= m_maxTiles){
+            auto lru = std::min_element(
+                m_resident.begin(), 
+                m_resident.end(), 
+                [this](int a, int b){
+                    return std::atomic_load(&m_tiles[a])->lastUse <
+                        std::atomic_load(&m_tiles[b])->lastUse;
+                }
+            );
+            std::atomic_store(&m_tiles[*lru], std::shared_ptr<Tile>());
+            *lru = m_resident.back();
+            m_resident.pop_back();
+        }
+
+        tile = std::make_shared<Tile>();
+        tile->lastUse = ++m_clock;
+        std::atomic_store(&m_tiles[index], tile);
+        m_resident.push_back(index);
+
+        return tile;
+    }
+
+public:
+    // src, kernels, maxKernelRows, maxKernelCols: see CalcJet::init().
+    // maxMemory: the max bytes used by the resident tiles. At least
+    //     one tile will be resident. Should be large enough to hold
+    //     a few tiles per thread.
+    // tileSize: the width and height of tiles in pixels.
+    LazyJetCache(
+        const cv::Mat &src,
+        const Kernels<N> &kernels,
+        int maxKernelRows,
+        int maxKernelCols,
+        size_t maxMemory,
+        int tileSize
+    )
+    {
+        static_assert(2*N <= KernelBank::MAX_KERNELS, "Too many kernels.");
+        assert(tileSize > 0);
+
+        m_conv.init(src, maxKernelRows, maxKernelCols);
+
+        // re[0], ..., re[N-1], im[0], ..., im[N-1]
+        std::vector<cv::Mat> bankKernels(kernels.re, kernels.re + N);
+        bankKernels.insert(bankKernels.end(), kernels.im, kernels.im + N);
+        m_bank.init(bankKernels);
+
+        m_width = src.cols;
+        m_height = src.rows;
+        m_tileSize = tileSize;
+        m_tilesX = (m_width + tileSize - 1) / tileSize;
+        int tilesY = (m_height + tileSize - 1) / tileSize;
+        m_tiles.resize(m_tilesX * tilesY);
+
+        size_t tileMemory = 2*sizeof(float)*N*tileSize*tileSize;
+        m_maxTiles = std::max<size_t>(maxMemory / tileMemory, 1U);
+        m_resident.reserve(std::min(m_maxTiles, m_tiles.size()));
+    }
+
+    // Copy the jet at (x, y) into a[N] and p[N].
+    void getJet(int x, int y, float *a, float *p)
+    {
+        assert(x >= 0 && x < m_width);
+        assert(y >= 0 && y < m_height);
+
+        int tileX = x / m_tileSize;
+        int tileY = y / m_tileSize;
+        int index = tileY*m_tilesX + tileX;
+
+        auto tile = std::atomic_load(&m_tiles[index]);
+        if(!tile){
+            tile = loadTile(index);
+        }
+        else {
+            std::uint64_t now = m_clock.load(std::memory_order_relaxed);
+            if(tile->lastUse.load(std::memory_order_relaxed) != now){
+                tile->lastUse.store(now, std::memory_order_relaxed);
+            }
+        }
+
+        std::call_once(tile->computed, [&](){
+            computeTile(*tile, tileX, tileY);
+        });
+
+        int offset = N*((y - tileY*m_tileSize)*m_tileSize + (x - tileX*m_tileSize));
+        memcpy(a, tile->a.get() + offset, N*sizeof(float));
+        memcpy(p, tile->p.get() + offset, N*sizeof(float));
+    }
+
+    // the number of the resident tiles
+    size_t getResidentTiles()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_resident.size();
+    }
+};
+
+
 // -------------- Cache Version ----------------
 // Calculates jets at different points of one image
 // Only support one-channel matrices.
 template <int N>
 class CalcJet {
-public:
-    // When constructed by deserialization:
-    //     If not set, the kx and ky of jets will use the value saved in file.
-    //     If set, the kx and ky of jets will use these variables directly.
-    // When constructed by init():
-    //     These variables will be the same as Kernels::kx and Kernels::ky.
-    std::shared_ptr<float[]> m_kx;
-    std::shared_ptr<float[]> m_ky;
-
 private:
     bool m_init = false;    
     int m_width = 0;
     int m_height = 0;
 
+    // the id of the ks in KernelRegistry, see Jet::bank.
+    int m_bank = -1;
+
     std::unique_ptr<float[]> m_cachea;
     std::unique_ptr<float[]> m_cachep;
+
+    // Not null if the jets are mapped from a ".jets" file.
+    // See mapFile().
+    std::shared_ptr<const JetsFile> m_jetsFile;
+
+    // m_cachea and m_cachep encoded by m_codec, if the storage is
+    // not JetStorage::FLOAT32. See init().
+    std::unique_ptr<unsigned char[]> m_codeda;
+    std::unique_ptr<unsigned char[]> m_codedp;
+
+    // The jets read by calcJet(), encoded by m_codec: m_cachea and 
+    // m_cachep, m_codeda and m_codedp, or the planes of m_jetsFile.
+    // Null in lazy mode.
+    JetCodec m_codec;
+    const unsigned char *m_jetsa = nullptr;
+    const unsigned char *m_jetsp = nullptr;
+
+    // Not null in lazy mode. See initLazy().
+    std::unique_ptr<LazyJetCache<N>> m_lazyCache;
+
     int cacheIndex(int x, int y) const {
         return N*(y*m_width + x);
     }
@@ -311,25 +731,25 @@ private:
     template<class Archive>
     void load(Archive & ar, const unsigned int version)
     {
+        m_lazyCache.reset();
+        m_jetsFile.reset();
+        m_codeda.reset();
+        m_codedp.reset();
+        m_codec.init(JetStorage::FLOAT32);
+
         ar & m_init;
         ar & m_width;
         ar & m_height;
         
         if(m_init){
-            std::shared_ptr<float[]> tmpkx(new float[N]);
-            std::shared_ptr<float[]> tmpky(new float[N]);
-            float *kx = tmpkx.get();
-            float *ky = tmpky.get();
+            float kx[N], ky[N];
             for(int i=0; i<N; i++) {
                 ar & kx[i];
             }
             for(int i=0; i<N; i++) {
                 ar & ky[i];
             }
-            if(!m_kx || !m_ky) {
-                m_kx = tmpkx;
-                m_ky = tmpky;
-            }
+            m_bank = KernelRegistry::intern(kx, ky, N);
 
             int nCache = N*m_width*m_height;
             m_cachea.reset(new float[nCache]);
@@ -342,19 +762,24 @@ private:
             for(int i=0; i<nCache; i++){
                 ar & cachep[i];
             }
+            m_jetsa = reinterpret_cast<const unsigned char *>(cachea);
+            m_jetsp = reinterpret_cast<const unsigned char *>(cachep);
         }
     }
 
     template<class Archive>
     void save(Archive & ar, const unsigned int version) const
     {
+        // the jets are not computed yet in lazy mode.
+        assert(!m_lazyCache);
+
         ar & m_init;
         ar & m_width;
         ar & m_height;
         
         if(m_init){
-            float *kx = m_kx.get();
-            float *ky = m_ky.get();
+            const float *kx = KernelRegistry::getKx(m_bank);
+            const float *ky = KernelRegistry::getKy(m_bank);
             for(int i=0; i<N; i++) {
                 ar & kx[i];
             }
@@ -362,30 +787,176 @@ private:
                 ar & ky[i];
             }
 
-            int nCache = N*m_width*m_height;
-            float *cachea = m_cachea.get();
-            float *cachep = m_cachep.get();
-            for(int i=0; i<nCache; i++){
-                ar & cachea[i];
+            // always saved as floats
+            int nPixels = m_width*m_height;
+            float a[N], p[N];
+            for(int i=0; i<nPixels; i++){
+                decodeJet(i, a, p);
+                for(int j=0; j<N; j++){
+                    ar & a[j];
+                }
             }
-            for(int i=0; i<nCache; i++){
-                ar & cachep[i];
+            for(int i=0; i<nPixels; i++){
+                decodeJet(i, a, p);
+                for(int j=0; j<N; j++){
+                    ar & p[j];
+                }
             }
         }
     }
 
     BOOST_SERIALIZATION_SPLIT_MEMBER()
 
+    // Decode the jet of the pixel (y*m_width + x) into a[N] and p[N].
+    void decodeJet(int pixel, float *a, float *p) const
+    {
+        m_codec.decode(
+            m_jetsa + size_t(N)*pixel*m_codec.getMagnitudeSize(),
+            m_jetsp + size_t(N)*pixel*m_codec.getPhaseSize(),
+            N,
+            a,
+            p
+        );
+    }
+
+    // Encode m_cachea and m_cachep into m_codeda and m_codedp, then
+    // release m_cachea and m_cachep.
+    void encodeCache(JetStorage storage)
+    {
+        int nCache = N*m_width*m_height;
+
+        float maxMagnitude = 0.0F;
+        #pragma omp parallel for reduction(max:maxMagnitude)
+        for(int i=0; i<nCache; i++){
+            maxMagnitude = std::max(maxMagnitude, m_cachea[i]);
+        }
+        m_codec.init(storage, maxMagnitude);
+
+        m_codeda.reset(new unsigned char[nCache*m_codec.getMagnitudeSize()]);
+        m_codedp.reset(new unsigned char[nCache*m_codec.getPhaseSize()]);
+
+        #pragma omp parallel for schedule(static)
+        for(int iy=0; iy<m_height; iy++){
+            int index = cacheIndex(0, iy);
+            m_codec.encode(
+                m_cachea.get() + index,
+                m_cachep.get() + index,
+                N*m_width,
+                m_codeda.get() + index*m_codec.getMagnitudeSize(),
+                m_codedp.get() + index*m_codec.getPhaseSize()
+            );
+        }
+
+        m_cachea.reset();
+        m_cachep.reset();
+        m_jetsa = m_codeda.get();
+        m_jetsp = m_codedp.get();
+    }
+
+    // Fill the cache using Convolution::calcConvBank() at each point.
+    void initDirect(
+        const cv::Mat &src,
+        const Kernels<N> &kernels,
+        int maxKernelRows,
+        int maxKernelCols
+    )
+    {
+        static_assert(2*N <= KernelBank::MAX_KERNELS, "Too many kernels.");
+
+        Convolution conv;
+        conv.init(src, maxKernelRows, maxKernelCols);
+
+        // re[0], ..., re[N-1], im[0], ..., im[N-1]
+        std::vector<cv::Mat> bankKernels(kernels.re, kernels.re + N);
+        bankKernels.insert(bankKernels.end(), kernels.im, kernels.im + N);
+        KernelBank bank(bankKernels);
+        const bool fast = fastMath();
+
+        #pragma omp parallel for collapse(2) schedule(static)
+        for(int ix=0; ix<m_width; ix++){
+            for(int iy=0; iy<m_height; iy++){
+                float *cachea = m_cachea.get() + cacheIndex(ix, iy);
+                float *cachep = m_cachep.get() + cacheIndex(ix, iy);
+                float result[2*N];
+
+                conv.calcConvBank(bank, ix, iy, result);
+
+                if(fast){
+                    fastComplex2mag(result, result + N, cachea, cachep, N);
+                    continue;
+                }
+                libmComplex2mag(result, result + N, cachea, cachep, N);
+            }
+        }
+    }
+
+    // Fill the cache using FFTConvolution: one forward DFT of src,
+    // plus one inverse DFT for each kernel.
+    void initFFT(
+        const cv::Mat &src,
+        const Kernels<N> &kernels,
+        int maxKernelRows,
+        int maxKernelCols
+    )
+    {
+        FFTConvolution conv;
+        conv.init(src, maxKernelRows, maxKernelCols);
+
+        auto spectra = kernels.spectra->get(conv, kernels.re, kernels.im, N);
+        const bool fast = fastMath();
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int i = 0; i < N; i++){
+            cv::Mat re, im;
+            std::tie(re, im) = conv.calcConv(
+                (*spectra)[i],
+                kernels.re[i].rows,
+                kernels.re[i].cols
+            );
+
+            // one row of magnitudes and phases
+            std::vector<float> rowa(m_width);
+            std::vector<float> rowp(m_width);
+
+            for(int iy=0; iy<m_height; iy++){
+                const float *re_p = re.ptr<float>(iy);
+                const float *im_p = im.ptr<float>(iy);
+
+                if(fast){
+                    fastComplex2mag(
+                        re_p, im_p, rowa.data(), rowp.data(), m_width
+                    );
+                }
+                else{
+                    libmComplex2mag(
+                        re_p, im_p, rowa.data(), rowp.data(), m_width
+                    );
+                }
+                for(int ix=0; ix<m_width; ix++){
+                    int index = cacheIndex(ix, iy) + i;
+                    m_cachea[index] = rowa[ix];
+                    m_cachep[index] = rowp[ix];
+                }
+            }
+        }
+    }
+
 public:
     // Will copy the data of src into an internal Mat in this class, and
     // this internel Mat will be used in other functions of this class.
     // So you do not need to call Mat::clone() when passing src.
     // Will copy the data of kernels into an internal structure in this class.
+    // method: how to compute the convolutions. Both give the same jets
+    // (within the floating-point error), ConvMethod::FFT is much faster.
+    // storage: how the jets are kept in memory (see JetStorage). The
+    // jets are computed as floats and encoded afterwards.
     void init(
         const cv::Mat &src,
         const Kernels<N> &kernels,
         int maxKernelRows,
-        int maxKernelCols
+        int maxKernelCols,
+        ConvMethod method = ConvMethod::FFT,
+        JetStorage storage = JetStorage::FLOAT32
     )
     {
         assert(!kernels.re[0].empty());
@@ -395,32 +966,144 @@ public:
         m_height = src.rows;
         m_cachea.reset(new float[N*m_width*m_height]);
         m_cachep.reset(new float[N*m_width*m_height]);
+        m_codeda.reset();
+        m_codedp.reset();
+        m_jetsFile.reset();
+        m_lazyCache.reset();
+
+        switch(method) {
+            case ConvMethod::DIRECT:
+                initDirect(src, kernels, maxKernelRows, maxKernelCols);
+                break;
+
+            case ConvMethod::FFT:
+                initFFT(src, kernels, maxKernelRows, maxKernelCols);
+                break;
+        }
 
-        Convolution conv;
-        conv.init(src, maxKernelRows, maxKernelCols);
+        if(storage == JetStorage::FLOAT32){
+            m_codec.init(JetStorage::FLOAT32);
+            m_jetsa = reinterpret_cast<const unsigned char *>(m_cachea.get());
+            m_jetsp = reinterpret_cast<const unsigned char *>(m_cachep.get());
+        }
+        else {
+            encodeCache(storage);
+        }
 
-        #pragma omp parallel for collapse(2) schedule(static)
-        for(int ix=0; ix<m_width; ix++){
-            for(int iy=0; iy<m_height; iy++){
-                float *cachea = m_cachea.get() + cacheIndex(ix, iy);
-                float *cachep = m_cachep.get() + cacheIndex(ix, iy);
+        m_bank = kernels.getBankId();
 
-                for(int i = 0; i < N; i++){
-                    float re, im;
-                    re = conv.calcConv(kernels.re[i], ix, iy);
-                    im = conv.calcConv(kernels.im[i], ix, iy);
-                    
-                    std::tie(cachea[i], cachep[i]) = complex2mag(re, im);
-                }
-            }
-        }
+        m_init = true;
+    }
 
-        m_kx = kernels.kx;
-        m_ky = kernels.ky;
+    // Lazy mode: the jets are computed tile by tile on the first
+    // calcJet() into each tile, and at most maxMemory bytes of tiles
+    // are kept (see LazyJetCache). Uses much less memory than init()
+    // for large images when only a part of the image is used.
+    // A CalcJet in lazy mode can not be serialized.
+    void initLazy(
+        const cv::Mat &src,
+        const Kernels<N> &kernels,
+        int maxKernelRows,
+        int maxKernelCols,
+        size_t maxMemory,
+        int tileSize = 32
+    )
+    {
+        assert(!kernels.re[0].empty());
+        assert(src.type() == kernels.re[0].type());
+
+        m_width = src.cols;
+        m_height = src.rows;
+        m_cachea.reset();
+        m_cachep.reset();
+        m_codeda.reset();
+        m_codedp.reset();
+        m_codec.init(JetStorage::FLOAT32);
+        m_jetsa = nullptr;
+        m_jetsp = nullptr;
+        m_jetsFile.reset();
+        m_lazyCache.reset(new LazyJetCache<N>(
+            src,
+            kernels,
+            maxKernelRows,
+            maxKernelCols,
+            maxMemory,
+            tileSize
+        ));
+
+        m_bank = kernels.getBankId();
 
         m_init = true;
     }
 
+    bool isLazy() const
+    {
+        return bool(m_lazyCache);
+    }
+
+    // Serve the jets directly from a ".jets" file mapped into memory
+    // (see JetsFile). Nothing is copied, and the pages that are never
+    // used are never read from disk.
+    // Throw a runtime_error if the file can not be mapped, or was not
+    // generated by kernels, or its storage is not storage, or it was
+    // not generated in the current mode of fastMath().
+    void mapFile(
+        const std::string &filename, 
+        const Kernels<N> &kernels,
+        JetStorage storage = JetStorage::FLOAT32
+    )
+    {
+        auto file = std::make_shared<JetsFile>();
+        file->open(
+            filename, N, kernels.getFingerprint(), storage, fastMath()
+        );
+
+        m_width = file->getWidth();
+        m_height = file->getHeight();
+        m_cachea.reset();
+        m_cachep.reset();
+        m_codeda.reset();
+        m_codedp.reset();
+        m_lazyCache.reset();
+        m_jetsFile = file;
+        m_codec = file->getCodec();
+        m_jetsa = static_cast<const unsigned char *>(file->getA());
+        m_jetsp = static_cast<const unsigned char *>(file->getP());
+
+        m_bank = kernels.getBankId();
+
+        m_init = true;
+    }
+
+    // Save the jets into a ".jets" file, which can be used by
+    // mapFile(). The storage of the file is the same as this object.
+    // kernels: the kernels passed to init(), in the current mode of
+    // fastMath().
+    // Throw a runtime_error on failure.
+    void saveFile(const std::string &filename, const Kernels<N> &kernels) const
+    {
+        assert(m_init);
+        // the jets are not computed yet in lazy mode.
+        assert(!m_lazyCache);
+
+        JetsFile::write(
+            filename,
+            N,
+            m_width,
+            m_height,
+            kernels.getFingerprint(),
+            fastMath(),
+            m_codec,
+            m_jetsa,
+            m_jetsp
+        );
+    }
+
+    JetStorage getStorage() const
+    {
+        return m_codec.getStorage();
+    }
+
     Jet<N> calcJet(int x, int y) const
     {
         assert(m_init);
@@ -430,14 +1113,70 @@ public:
         Jet<N> ret;
         ret.x = x;
         ret.y = y;
-        ret.kx = m_kx;
-        ret.ky = m_ky;
+        ret.bank = m_bank;
 
-        float *cachea = m_cachea.get() + cacheIndex(x, y);
-        float *cachep = m_cachep.get() + cacheIndex(x, y);
+        if(m_lazyCache){
+            m_lazyCache->getJet(x, y, ret.a, ret.p);
+            return ret;
+        }
 
-        memcpy(ret.a, cachea, 40*sizeof(float));
-        memcpy(ret.p, cachep, 40*sizeof(float));
+        decodeJet(y*m_width + x, ret.a, ret.p);
+
+        return ret;
+    }
+
+    // The jet at the sub-pixel position (x, y): the complex responses
+    // (not the magnitudes and phases) of the 4 nearest jets are
+    // interpolated bilinearly. The same as calcJet(int, int) at the
+    // integer positions. ret.x and ret.y are rounded.
+    Jet<N> calcJet(float x, float y) const
+    {
+        assert(m_init);
+        assert(x >= 0.0F && x <= (float)(m_width - 1));
+        assert(y >= 0.0F && y <= (float)(m_height - 1));
+
+        int x0 = (int)x, y0 = (int)y;
+        float fx = x - (float)x0, fy = y - (float)y0;
+        if(fx == 0.0F && fy == 0.0F) {
+            return calcJet(x0, y0);
+        }
+        int x1 = std::min(x0 + 1, m_width - 1);
+        int y1 = std::min(y0 + 1, m_height - 1);
+
+        const int cornerX[4] = {x0, x1, x0, x1};
+        const int cornerY[4] = {y0, y0, y1, y1};
+        const float weight[4] = {
+            (1.0F - fx)*(1.0F - fy), fx*(1.0F - fy),
+            (1.0F - fx)*fy, fx*fy
+        };
+
+        float re[N] = {}, im[N] = {};
+        for(int c=0; c<4; c++){
+            // e.g. only 2 corners on a vertical or horizontal line.
+            if(weight[c] == 0.0F) {
+                continue;
+            }
+            Jet<N> corner = calcJet(cornerX[c], cornerY[c]);
+            for(int i=0; i<N; i++){
+                float sinp, cosp;
+                fastSinCos(corner.p[i], sinp, cosp);
+                re[i] += weight[c]*corner.a[i]*cosp;
+                im[i] += weight[c]*corner.a[i]*sinp;
+            }
+        }
+
+        Jet<N> ret;
+        ret.x = (int)round(x);
+        ret.y = (int)round(y);
+        ret.bank = m_bank;
+        for(int i=0; i<N; i++){
+            ret.a[i] = sqrtf(re[i]*re[i] + im[i]*im[i]);
+            ret.p[i] = fastAtan2(im[i], re[i]);
+            // within [-0.5pi, 1.5pi), like complex2mag() (see utils.h).
+            if(ret.p[i] < -0.5F*PI) {
+                ret.p[i] += 2.0F*PI;
+            }
+        }
 
         return ret;
     }
@@ -458,14 +1197,18 @@ public:
         const cv::Mat &src,
         const Kernels<N> &kernels,
         int maxKernelRows,
-        int maxKernelCols
+        int maxKernelCols,
+        ConvMethod method = ConvMethod::FFT,
+        JetStorage storage = JetStorage::FLOAT32
     ) noexcept
     {
         init(
             src, 
             kernels, 
             maxKernelRows, 
-            maxKernelCols
+            maxKernelCols,
+            method,
+            storage
         );
     }
 
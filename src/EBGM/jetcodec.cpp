@@ -0,0 +1,126 @@
+#include "jetcodec.h"
+
+#include <cmath>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <initializer_list>
+
+using namespace std;
+
+static const float TWO_PI = 6.28318530717958647692F;
+
+
+// "float32", "fp16" or "log8"
+const char *jetStorageName(JetStorage storage)
+{
+    switch(storage){
+        case JetStorage::FLOAT32: return "float32";
+        case JetStorage::FP16: return "fp16";
+        case JetStorage::LOG8: return "log8";
+    }
+    return "unknown";
+}
+
+// Parse the result of jetStorageName(). Return false if name is invalid.
+bool parseJetStorage(const char *name, JetStorage &storage)
+{
+    for(JetStorage i: {JetStorage::FLOAT32, JetStorage::FP16, JetStorage::LOG8}){
+        if(!strcmp(name, jetStorageName(i))){
+            storage = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// maxMagnitude: the max magnitude of all the jets (of an image).
+//     Only used by JetStorage::LOG8.
+void JetCodec::init(JetStorage storage, float maxMagnitude)
+{
+    m_storage = storage;
+    m_maxMagnitude = maxMagnitude;
+
+    // code 0: 0
+    // code c (1 <= c <= 255): maxMagnitude * 2^((c-255)*LOG8_RANGE/254)
+    m_log8Table[0] = 0.0F;
+    for(int c=1; c<256; c++){
+        m_log8Table[c] = maxMagnitude * exp2((c - 255) * LOG8_RANGE / 254.0F);
+    }
+}
+
+// bytes per magnitude
+size_t JetCodec::getMagnitudeSize() const
+{
+    switch(m_storage){
+        case JetStorage::FLOAT32: return sizeof(float);
+        case JetStorage::FP16: return sizeof(uint16_t);
+        case JetStorage::LOG8: return sizeof(uint8_t);
+    }
+    return 0;
+}
+
+// bytes per phase
+size_t JetCodec::getPhaseSize() const
+{
+    return getMagnitudeSize();
+}
+
+
+// Map an angle to a fixed-point number with 'bits' bits.
+// [0, 2pi) -> [0, 2^bits)
+static uint32_t encodePhase(float phase, int bits)
+{
+    float scale = float(1U << bits) / TWO_PI;
+    float turns = phase - TWO_PI*floor(phase/TWO_PI);
+    return uint32_t(lround(turns*scale)) & ((1U << bits) - 1U);
+}
+
+static uint8_t encodeLog8(float a, float maxMagnitude)
+{
+    if(!(a > 0.0F) || !(maxMagnitude > 0.0F)){
+        return 0;
+    }
+    float c = 255.0F + log2(a / maxMagnitude) * (254.0F / JetCodec::LOG8_RANGE);
+    // round to nearest, code 0 is 0
+    return uint8_t(min(max(lround(c), 0L), 255L));
+}
+
+// a, p: n floats each.
+// qa: n*getMagnitudeSize() bytes, qp: n*getPhaseSize() bytes.
+void JetCodec::encode(
+    const float *a, 
+    const float *p, 
+    size_t n, 
+    void *qa, 
+    void *qp
+) const
+{
+    switch(m_storage){
+        case JetStorage::FLOAT32:
+            memcpy(qa, a, n*sizeof(float));
+            memcpy(qp, p, n*sizeof(float));
+            break;
+
+        case JetStorage::FP16: {
+            uint16_t *qa_p = static_cast<uint16_t *>(qa);
+            uint16_t *qp_p = static_cast<uint16_t *>(qp);
+            for(size_t i=0; i<n; i++){
+                qa_p[i] = floatToHalf(a[i]);
+                qp_p[i] = encodePhase(p[i], 16);
+            }
+            break;
+        }
+
+        case JetStorage::LOG8: {
+            uint8_t *qa_p = static_cast<uint8_t *>(qa);
+            uint8_t *qp_p = static_cast<uint8_t *>(qp);
+            for(size_t i=0; i<n; i++){
+                qa_p[i] = encodeLog8(a[i], m_maxMagnitude);
+                qp_p[i] = encodePhase(p[i], 8);
+            }
+            break;
+        }
+    }
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+// How the magnitudes and phases of jets are stored in CalcJet and
+// ".jets" files.
+enum class JetStorage : std::uint32_t {
+    // float magnitudes, float phases
+    FLOAT32 = 0,
+    // fp16 magnitudes, 16-bit fixed-point phases
+    FP16 = 1,
+    // 8-bit log-quantized magnitudes (with a per-image scale),
+    // 8-bit fixed-point phases
+    LOG8 = 2
+};
+
+// "float32", "fp16" or "log8"
+const char *jetStorageName(JetStorage storage);
+
+// Parse the result of jetStorageName(). Return false if name is invalid.
+bool parseJetStorage(const char *name, JetStorage &storage);
+
+
+// IEEE 754 half precision. Round to nearest even, overflow to infinity.
+inline std::uint16_t floatToHalf(float f)
+{
+#if defined(__F16C__)
+    return _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+    std::uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    std::uint16_t sign = (bits >> 16) & 0x8000U;
+    bits &= 0x7fffffffU;
+    memcpy(&f, &bits, sizeof(f));
+
+    if(!(f < 65520.0F)){
+        // infinity (or NaN)
+        return sign | (bits > 0x7f800000U ? 0x7e00U : 0x7c00U);
+    }
+    if(f < 6.103515625e-05F){
+        // subnormal: the unit is 2^-24
+        return sign | std::uint16_t(f * 16777216.0F + 0.5F);
+    }
+
+    // rebias the exponent from 127 to 15, and round the mantissa
+    bits -= 112U << 23;
+    bits += 0x0fffU + ((bits >> 13) & 1U);
+    return sign | std::uint16_t(bits >> 13);
+#endif
+}
+
+inline float halfToFloat(std::uint16_t h)
+{
+#if defined(__F16C__)
+    return _cvtsh_ss(h);
+#else
+    std::uint32_t sign = std::uint32_t(h & 0x8000U) << 16;
+    std::uint32_t bits = std::uint32_t(h & 0x7fffU) << 13;
+    float f;
+
+    if((h & 0x7c00U) == 0x7c00U){
+        // infinity or NaN
+        bits |= 0x7f800000U;
+        memcpy(&f, &bits, sizeof(f));
+    }
+    else {
+        // rebias the exponent from 15 to 127 (also works for subnormals)
+        memcpy(&f, &bits, sizeof(f));
+        f *= 5.192296858534828e+33F;    // 2^112
+    }
+
+    memcpy(&bits, &f, sizeof(bits));
+    bits |= sign;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+#endif
+}
+
+
+// Encode jets into, and decode jets from a JetStorage.
+// Magnitudes and phases are stored in two separate arrays, in the
+// same order as the float arrays.
+class JetCodec {
+public:
+    // LOG8: the smallest non-zero magnitude is 2^-LOG8_RANGE of
+    // the max magnitude.
+    static constexpr float LOG8_RANGE = 16.0F;
+
+private:
+    JetStorage m_storage = JetStorage::FLOAT32;
+    float m_maxMagnitude = 0.0F;
+
+    // LOG8: code -> magnitude
+    float m_log8Table[256];
+
+public:
+    // maxMagnitude: the max magnitude of all the jets (of an image).
+    //     Only used by JetStorage::LOG8.
+    void init(JetStorage storage, float maxMagnitude = 0.0F);
+
+    JetStorage getStorage() const {return m_storage;}
+    float getMaxMagnitude() const {return m_maxMagnitude;}
+
+    // bytes per magnitude
+    std::size_t getMagnitudeSize() const;
+    // bytes per phase
+    std::size_t getPhaseSize() const;
+
+    // a, p: n floats each.
+    // qa: n*getMagnitudeSize() bytes, qp: n*getPhaseSize() bytes.
+    void encode(
+        const float *a, 
+        const float *p, 
+        std::size_t n, 
+        void *qa, 
+        void *qp
+    ) const;
+
+    // qa: n*getMagnitudeSize() bytes, qp: n*getPhaseSize() bytes.
+    // a, p: n floats each. The phases are within [-0.5pi, 1.5pi),
+    // same as complex2mag().
+    void decode(
+        const void *qa, 
+        const void *qp, 
+        std::size_t n, 
+        float *a, 
+        float *p
+    ) const
+    {
+        const float twoPi = 6.28318530717958647692F;
+        const float onePointFivePi = 4.71238898038468985769F;
+
+        switch(m_storage){
+            case JetStorage::FLOAT32:
+                memcpy(a, qa, n*sizeof(float));
+                memcpy(p, qp, n*sizeof(float));
+                break;
+
+            case JetStorage::FP16: {
+                const std::uint16_t *qa_p = static_cast<const std::uint16_t *>(qa);
+                const std::uint16_t *qp_p = static_cast<const std::uint16_t *>(qp);
+                for(std::size_t i=0; i<n; i++){
+                    a[i] = halfToFloat(qa_p[i]);
+                    p[i] = qp_p[i] * (twoPi / 65536.0F);
+                    p[i] -= p[i] >= onePointFivePi ? twoPi : 0.0F;
+                }
+                break;
+            }
+
+            case JetStorage::LOG8: {
+                const std::uint8_t *qa_p = static_cast<const std::uint8_t *>(qa);
+                const std::uint8_t *qp_p = static_cast<const std::uint8_t *>(qp);
+                for(std::size_t i=0; i<n; i++){
+                    a[i] = m_log8Table[qa_p[i]];
+                    p[i] = qp_p[i] * (twoPi / 256.0F);
+                    p[i] -= p[i] >= onePointFivePi ? twoPi : 0.0F;
+                }
+                break;
+            }
+        }
+    }
+
+    JetCodec() noexcept {init(JetStorage::FLOAT32);}
+    explicit JetCodec(JetStorage storage, float maxMagnitude = 0.0F) noexcept
+    {init(storage, maxMagnitude);}
+};
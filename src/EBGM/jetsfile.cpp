@@ -0,0 +1,173 @@
+#include "jetsfile.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+using namespace std;
+namespace bip = boost::interprocess;
+
+const char JETS_FILE_MAGIC[8] = {'E', 'B', 'G', 'M', 'J', 'E', 'T', 'S'};
+const uint32_t JETS_FILE_VERSION = 3;
+const size_t JETS_FILE_ALIGNMENT = 4096;
+
+
+uint64_t fnv1a(const void *data, size_t size, uint64_t hash)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for(size_t i=0; i<size; i++){
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+struct JetsFile::Mapping {
+    bip::file_mapping file;
+    bip::mapped_region region;
+};
+
+
+static uint64_t alignUp(uint64_t offset)
+{
+    return (offset + JETS_FILE_ALIGNMENT - 1) / 
+        JETS_FILE_ALIGNMENT * JETS_FILE_ALIGNMENT;
+}
+
+
+// Map filename into memory.
+// Throw a runtime_error if the file can not be opened, or the
+// header does not match n, fingerprint, storage and fastMath, or
+// the file is too short.
+void JetsFile::open(
+    const string &filename, 
+    int n, 
+    uint64_t fingerprint,
+    JetStorage storage,
+    bool fastMath
+)
+{
+    auto mapping = make_shared<Mapping>();
+    try {
+        mapping->file = bip::file_mapping(filename.c_str(), bip::read_only);
+        mapping->region = bip::mapped_region(mapping->file, bip::read_only);
+    }
+    catch(const bip::interprocess_exception &e) {
+        throw runtime_error(string("Failed to map '") + filename + "': " + e.what());
+    }
+
+    size_t fileSize = mapping->region.get_size();
+    const char *base = static_cast<const char *>(mapping->region.get_address());
+
+    JetsFileHeader header;
+    if(fileSize < sizeof(header)){
+        throw runtime_error("The file is too short.");
+    }
+    memcpy(&header, base, sizeof(header));
+
+    if(memcmp(header.magic, JETS_FILE_MAGIC, sizeof(header.magic))){
+        throw runtime_error("Not a \".jets\" file, or in an old format.");
+    }
+    if(header.version != JETS_FILE_VERSION){
+        throw runtime_error("Unsupported version.");
+    }
+    if(header.n != uint32_t(n) || header.fingerprint != fingerprint){
+        throw runtime_error("Generated by different kernels.");
+    }
+    if(header.storage != uint32_t(storage)){
+        throw runtime_error(string("The storage is not ") + 
+            jetStorageName(storage) + ".");
+    }
+    if(header.fastMath != uint32_t(fastMath)){
+        throw runtime_error(fastMath ? 
+            "Not generated in the fast math mode." :
+            "Generated in the fast math mode.");
+    }
+
+    JetCodec codec(storage, header.maxMagnitude);
+    uint64_t nValues = uint64_t(n) * header.width * header.height;
+    uint64_t planeSizeA = nValues * codec.getMagnitudeSize();
+    uint64_t planeSizeP = nValues * codec.getPhaseSize();
+    if(header.offsetA % JETS_FILE_ALIGNMENT || 
+        header.offsetP % JETS_FILE_ALIGNMENT ||
+        header.offsetA < sizeof(header) ||
+        header.offsetA + planeSizeA > fileSize ||
+        header.offsetP + planeSizeP > fileSize){
+        throw runtime_error("The file is corrupted.");
+    }
+
+    m_mapping = mapping;
+    m_header = header;
+    m_codec = codec;
+    m_a = base + header.offsetA;
+    m_p = base + header.offsetP;
+}
+
+
+// Write a new ".jets" file. 
+// a and p: N*width*height magnitudes and phases encoded by codec,
+// calculated in the fast math mode if fastMath.
+// The data is written to a temporary file first and then renamed
+// to filename, so other processes never map a partial file.
+// Throw a runtime_error on failure, after removing the temporary file.
+void JetsFile::write(
+    const string &filename,
+    int n,
+    int width,
+    int height,
+    uint64_t fingerprint,
+    bool fastMath,
+    const JetCodec &codec,
+    const void *a,
+    const void *p
+)
+{
+    uint64_t nValues = uint64_t(n) * width * height;
+    uint64_t planeSizeA = nValues * codec.getMagnitudeSize();
+    uint64_t planeSizeP = nValues * codec.getPhaseSize();
+
+    JetsFileHeader header{};
+    memcpy(header.magic, JETS_FILE_MAGIC, sizeof(header.magic));
+    header.version = JETS_FILE_VERSION;
+    header.n = n;
+    header.width = width;
+    header.height = height;
+    header.fingerprint = fingerprint;
+    header.offsetA = alignUp(sizeof(header));
+    header.offsetP = alignUp(header.offsetA + planeSizeA);
+    header.storage = uint32_t(codec.getStorage());
+    header.maxMagnitude = codec.getMaxMagnitude();
+    header.fastMath = fastMath;
+
+    string tmpname = filename + ".tmp";
+    {
+        ofstream file(tmpname, ios::binary | ios::trunc);
+        vector<char> padding(JETS_FILE_ALIGNMENT, 0);
+
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(padding.data(), header.offsetA - sizeof(header));
+        file.write(static_cast<const char *>(a), planeSizeA);
+        file.write(padding.data(), header.offsetP - header.offsetA - planeSizeA);
+        file.write(static_cast<const char *>(p), planeSizeP);
+
+        if(!file){
+            file.close();
+            boost::system::error_code ec;
+            boost::filesystem::remove(tmpname, ec);
+            throw runtime_error(string("Failed to write '") + tmpname + "'.");
+        }
+    }
+
+    boost::system::error_code ec;
+    boost::filesystem::rename(tmpname, filename, ec);
+    if(ec){
+        boost::filesystem::remove(tmpname, ec);
+        throw runtime_error(string("Failed to rename '") + tmpname + "'.");
+    }
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <memory>
+
+#include "jetcodec.h"
+
+// The format of ".jets" files (little-endian):
+//     JetsFileHeader
+//     the magnitude plane: N*width*height magnitudes, at header.offsetA
+//     the phase plane: N*width*height phases, at header.offsetP
+// The magnitudes and phases are encoded by JetCodec.
+// The planes are in the same order as the cache of CalcJet, and are
+// aligned to JETS_FILE_ALIGNMENT bytes, so that they can be used
+// directly after mapping the file into memory.
+struct JetsFileHeader {
+    char magic[8];                 // JETS_FILE_MAGIC
+    std::uint32_t version;         // JETS_FILE_VERSION
+    std::uint32_t n;               // the number of kernels
+    std::uint32_t width;           // the size of the image
+    std::uint32_t height;
+    std::uint64_t fingerprint;     // see Kernels::getFingerprint()
+    std::uint64_t offsetA;         // in bytes, from the beginning
+    std::uint64_t offsetP;
+    std::uint32_t storage;         // JetStorage
+    float maxMagnitude;            // see JetCodec::init()
+    std::uint32_t fastMath;        // 1 if the jets were calculated in the
+                                   // fast math mode (see fastmath.h)
+};
+
+extern const char JETS_FILE_MAGIC[8];
+extern const std::uint32_t JETS_FILE_VERSION;
+extern const std::size_t JETS_FILE_ALIGNMENT;
+
+// 64-bit FNV-1a hash. Pass the previous result as hash to hash
+// several blocks of data.
+std::uint64_t fnv1a(
+    const void *data, 
+    std::size_t size, 
+    std::uint64_t hash = 0xcbf29ce484222325ULL
+);
+
+
+// A ".jets" file mapped into memory (read-only).
+// The pages of the file are read on demand by the OS.
+class JetsFile {
+private:
+    // boost::interprocess::file_mapping and mapped_region
+    struct Mapping;
+    std::shared_ptr<Mapping> m_mapping;
+
+    JetsFileHeader m_header{};
+    JetCodec m_codec;
+    const void *m_a = nullptr;
+    const void *m_p = nullptr;
+
+public:
+    // Map filename into memory.
+    // Throw a runtime_error if the file can not be opened, or the
+    // header does not match n, fingerprint, storage and fastMath, or
+    // the file is too short.
+    void open(
+        const std::string &filename, 
+        int n, 
+        std::uint64_t fingerprint,
+        JetStorage storage,
+        bool fastMath
+    );
+
+    // Write a new ".jets" file. 
+    // a and p: N*width*height magnitudes and phases encoded by codec,
+    // calculated in the fast math mode if fastMath.
+    // The data is written to a temporary file first and then renamed
+    // to filename, so other processes never map a partial file.
+    // Throw a runtime_error on failure.
+    static void write(
+        const std::string &filename,
+        int n,
+        int width,
+        int height,
+        std::uint64_t fingerprint,
+        bool fastMath,
+        const JetCodec &codec,
+        const void *a,
+        const void *p
+    );
+
+    // the encoded magnitude and phase planes
+    const void *getA() const {return m_a;}
+    const void *getP() const {return m_p;}
+    const JetCodec &getCodec() const {return m_codec;}
+    int getWidth() const {return m_header.width;}
+    int getHeight() const {return m_header.height;}
+
+    JetsFile() noexcept {}
+};
@@ -1,12 +1,24 @@
 #include "kernels.h"
 #include "cvutils.h"
+#include "cpu.h"
 
 #include <tuple>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <atomic>
+#include <stdexcept>
 //#include <memory>
 
 #include <opencv2/core.hpp>
 #include <Eigen/Core>
 
+#if defined(__SSE2__) || defined(_M_X64) || defined(EBGM_CPU_DISPATCH)
+#include <immintrin.h>
+#endif
+
 
 using namespace std;
 using namespace cv;
@@ -106,7 +118,7 @@ void Convolution::init(
 
     m_src = Mat::zeros(
         src.rows + paddingWidthOnCols*2U,
-        src.cols + paddingWidthOnRows*2U,
+        src.cols + paddingWidthOnRows*2U + KernelBank::CHUNK,
         src.type()
     );
 
@@ -155,3 +167,529 @@ float Convolution::calcConv(
     return mul_sum[0];
 
 }
+
+
+namespace {
+
+struct RegistryEntry {
+    std::vector<float> kx;
+    std::vector<float> ky;
+};
+
+std::mutex registryMutex;   // protects registrySize, and registration
+int registrySize = 0;
+std::atomic<const RegistryEntry *> registryEntries[KernelRegistry::MAX_BANKS];
+
+const RegistryEntry &getRegistryEntry(int id)
+{
+    assert(id >= 0 && id < KernelRegistry::MAX_BANKS);
+    const RegistryEntry *entry = registryEntries[id].load(memory_order_acquire);
+    assert(entry);
+    return *entry;
+}
+
+}
+
+
+// Return the id of the bank (kx[n], ky[n]). Register it if it
+// has not been registered.
+// Throw a runtime_error if there are too many banks.
+int KernelRegistry::intern(const float *kx, const float *ky, int n)
+{
+    lock_guard<mutex> lock(registryMutex);
+
+    for(int id=0; id<registrySize; id++){
+        const RegistryEntry &entry = getRegistryEntry(id);
+        if(
+            entry.kx.size() == size_t(n) &&
+            equal(kx, kx + n, entry.kx.begin()) &&
+            equal(ky, ky + n, entry.ky.begin())
+        ){
+            return id;
+        }
+    }
+
+    if(registrySize >= MAX_BANKS){
+        throw runtime_error("Too many kernel banks.");
+    }
+
+    // never deleted
+    RegistryEntry *entry = new RegistryEntry;
+    entry->kx.assign(kx, kx + n);
+    entry->ky.assign(ky, ky + n);
+    registryEntries[registrySize].store(entry, memory_order_release);
+
+    return registrySize++;
+}
+
+const float *KernelRegistry::getKx(int id)
+{
+    return getRegistryEntry(id).kx.data();
+}
+
+const float *KernelRegistry::getKy(int id)
+{
+    return getRegistryEntry(id).ky.data();
+}
+
+int KernelRegistry::getSize(int id)
+{
+    return getRegistryEntry(id).kx.size();
+}
+
+
+// acc[k*CHUNK + i] += patch[i] * coeffs[k*CHUNK + i]
+// for k = 0, 1, ..., count-1 and i = 0, 1, ..., CHUNK-1.
+// patch is loaded only once for all the kernels.
+static inline void fmaChunk(
+    float *acc,            // aligned to 64 bytes
+    const float *patch,
+    const float *coeffs,
+    int count
+)
+{
+    static_assert(KernelBank::CHUNK == 16, "fmaChunk() assumes CHUNK == 16");
+
+#if defined(__AVX512F__)
+    __m512 p = _mm512_loadu_ps(patch);
+    for(int k=0; k<count; k++){
+        float *a = acc + k*16;
+        const float *c = coeffs + k*16;
+        _mm512_store_ps(a, _mm512_fmadd_ps(p, _mm512_loadu_ps(c), _mm512_load_ps(a)));
+    }
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256 p0 = _mm256_loadu_ps(patch);
+    __m256 p1 = _mm256_loadu_ps(patch + 8);
+    for(int k=0; k<count; k++){
+        float *a = acc + k*16;
+        const float *c = coeffs + k*16;
+        _mm256_store_ps(a,     _mm256_fmadd_ps(p0, _mm256_loadu_ps(c),     _mm256_load_ps(a)));
+        _mm256_store_ps(a + 8, _mm256_fmadd_ps(p1, _mm256_loadu_ps(c + 8), _mm256_load_ps(a + 8)));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128 p0 = _mm_loadu_ps(patch);
+    __m128 p1 = _mm_loadu_ps(patch + 4);
+    __m128 p2 = _mm_loadu_ps(patch + 8);
+    __m128 p3 = _mm_loadu_ps(patch + 12);
+    for(int k=0; k<count; k++){
+        float *a = acc + k*16;
+        const float *c = coeffs + k*16;
+        _mm_store_ps(a,      _mm_add_ps(_mm_load_ps(a),      _mm_mul_ps(p0, _mm_loadu_ps(c))));
+        _mm_store_ps(a + 4,  _mm_add_ps(_mm_load_ps(a + 4),  _mm_mul_ps(p1, _mm_loadu_ps(c + 4))));
+        _mm_store_ps(a + 8,  _mm_add_ps(_mm_load_ps(a + 8),  _mm_mul_ps(p2, _mm_loadu_ps(c + 8))));
+        _mm_store_ps(a + 12, _mm_add_ps(_mm_load_ps(a + 12), _mm_mul_ps(p3, _mm_loadu_ps(c + 12))));
+    }
+#else
+    for(int k=0; k<count; k++){
+        float *a = acc + k*16;
+        const float *c = coeffs + k*16;
+        for(int i=0; i<16; i++){
+            a[i] += patch[i] * c[i];
+        }
+    }
+#endif
+}
+
+#ifdef EBGM_CPU_DISPATCH
+
+// fmaChunk() with AVX2 and FMA (see cpu.h).
+EBGM_TARGET("avx2,fma")
+static inline void fmaChunkAvx2(
+    float *acc,            // aligned to 64 bytes
+    const float *patch,
+    const float *coeffs,
+    int count
+)
+{
+    __m256 p0 = _mm256_loadu_ps(patch);
+    __m256 p1 = _mm256_loadu_ps(patch + 8);
+    for(int k=0; k<count; k++){
+        float *a = acc + k*16;
+        const float *c = coeffs + k*16;
+        _mm256_store_ps(a,     _mm256_fmadd_ps(p0, _mm256_loadu_ps(c),     _mm256_load_ps(a)));
+        _mm256_store_ps(a + 8, _mm256_fmadd_ps(p1, _mm256_loadu_ps(c + 8), _mm256_load_ps(a + 8)));
+    }
+}
+
+// fmaChunk() with AVX-512F (see cpu.h).
+EBGM_TARGET("avx512f")
+static inline void fmaChunkAvx512(
+    float *acc,            // aligned to 64 bytes
+    const float *patch,
+    const float *coeffs,
+    int count
+)
+{
+    __m512 p = _mm512_loadu_ps(patch);
+    for(int k=0; k<count; k++){
+        float *a = acc + k*16;
+        const float *c = coeffs + k*16;
+        _mm512_store_ps(a, _mm512_fmadd_ps(p, _mm512_loadu_ps(c), _mm512_load_ps(a)));
+    }
+}
+
+#endif
+
+// The loop of Convolution::calcConvBank() over the rows and chunks of
+// a bank, with the fmaChunk() function of a level (see cpu.h).
+struct BankPass {
+    float *acc;            // aligned to 64 bytes
+    const cv::Mat *src;
+    int patchX;            // the top-left corner of the image patch
+    int patchY;
+    int rows;
+    int nChunks;
+    const float *coeffs;
+    const int *offsets;
+    const int *counts;
+};
+
+template<void (*FmaChunk)(float *, const float *, const float *, int)>
+static EBGM_ALWAYS_INLINE void accumulateBank(const BankPass &pass)
+{
+    const int CHUNK = KernelBank::CHUNK;
+
+    for(int r=0; r<pass.rows; r++){
+        const float *patch = pass.src->ptr<float>(pass.patchY + r) + pass.patchX;
+        int index = r * pass.nChunks;
+
+        for(int ch=0; ch<pass.nChunks; ch++){
+            FmaChunk(
+                pass.acc,
+                patch + ch*CHUNK,
+                pass.coeffs + pass.offsets[index + ch],
+                pass.counts[index + ch]
+            );
+        }
+    }
+}
+
+static void accumulateBankGeneric(const BankPass &pass)
+{
+    accumulateBank<fmaChunk>(pass);
+}
+
+#ifdef EBGM_CPU_DISPATCH
+
+// SSE4.2 adds nothing to the multiply-adds of fmaChunk(), but the loop
+// is compiled for it all the same.
+EBGM_TARGET("sse4.2")
+static void accumulateBankSse42(const BankPass &pass)
+{
+    accumulateBank<fmaChunk>(pass);
+}
+
+EBGM_TARGET("avx2,fma")
+static void accumulateBankAvx2(const BankPass &pass)
+{
+    accumulateBank<fmaChunkAvx2>(pass);
+}
+
+EBGM_TARGET("avx512f")
+static void accumulateBankAvx512(const BankPass &pass)
+{
+    accumulateBank<fmaChunkAvx512>(pass);
+}
+
+#endif
+
+// Compute the convolution of all the kernels in bank at a
+// specific point in source matrix, in one pass over the image
+// patch. Does not allocate any memory.
+// result: an array of bank.size() elements, in the same order
+// as the kernels passed to KernelBank::init().
+void Convolution::calcConvBank(
+    const KernelBank &bank,
+    int x,
+    int y,
+    float *result
+) const
+{
+    const int CHUNK = KernelBank::CHUNK;
+
+    assert(m_maxKernelRows > 0);
+    assert(bank.m_nKernels > 0);
+    assert(bank.m_rows <= m_maxKernelRows);
+    assert(bank.m_cols <= m_maxKernelCols);
+    // otherwise the kernels will be shifted by half a pixel.
+    assert((m_maxKernelRows - bank.m_rows) % 2 == 0);
+    assert((m_maxKernelCols - bank.m_cols) % 2 == 0);
+    assert(m_src.type() == CV_32FC1);
+    assert(x >= 0 && x < m_origWidth);
+    assert(y >= 0 && y < m_origHeight);
+
+    alignas(64) float acc[KernelBank::MAX_KERNELS * CHUNK];
+    memset(acc, 0, sizeof(float) * bank.m_nKernels * CHUNK);
+
+    BankPass pass;
+    pass.acc = acc;
+    pass.src = &m_src;
+    // the top-left corner of the image patch in m_src
+    pass.patchX = x + (m_maxKernelCols - bank.m_cols)/2U;
+    pass.patchY = y + (m_maxKernelRows - bank.m_rows)/2U;
+    pass.rows = bank.m_rows;
+    pass.nChunks = bank.m_nChunks;
+    pass.coeffs = bank.m_coeffs.data();
+    pass.offsets = bank.m_offsets.data();
+    pass.counts = bank.m_counts.data();
+
+    switch(cpuLevel()){
+#ifdef EBGM_CPU_DISPATCH
+    case CpuLevel::AVX512:
+        accumulateBankAvx512(pass);
+        break;
+    case CpuLevel::AVX2:
+        accumulateBankAvx2(pass);
+        break;
+    case CpuLevel::SSE42:
+        accumulateBankSse42(pass);
+        break;
+#endif
+    default:
+        accumulateBankGeneric(pass);
+    }
+
+    for(int k=0; k<bank.m_nKernels; k++){
+        float sum = 0.0F;
+        for(int i=0; i<CHUNK; i++){
+            sum += acc[k*CHUNK + i];
+        }
+        result[bank.m_order[k]] = sum;
+    }
+}
+
+
+// Will copy the data of kernels into this class.
+// The depth of kernels must be CV_32F.
+void KernelBank::init(const std::vector<cv::Mat> &kernels)
+{
+    assert(!kernels.empty());
+    assert(kernels.size() <= MAX_KERNELS);
+
+    m_nKernels = kernels.size();
+    m_rows = 0;
+    m_cols = 0;
+    for(const auto &i: kernels){
+        assert(i.type() == CV_32FC1);
+        m_rows = max(m_rows, i.rows);
+        m_cols = max(m_cols, i.cols);
+    }
+    m_nChunks = (m_cols + CHUNK - 1) / CHUNK;
+
+    // sort by size (descending)
+    m_order.resize(m_nKernels);
+    iota(m_order.begin(), m_order.end(), 0);
+    stable_sort(m_order.begin(), m_order.end(), [&](int a, int b){
+        return kernels[a].total() > kernels[b].total();
+    });
+
+    // the position of each kernel when placed at the center of the
+    // largest one. Same as the ROI in Convolution::calcConv().
+    vector<int> row0(m_nKernels), col0(m_nKernels);
+    for(int k=0; k<m_nKernels; k++){
+        const Mat &kernel = kernels[m_order[k]];
+        row0[k] = (m_rows - kernel.rows)/2U;
+        col0[k] = (m_cols - kernel.cols)/2U;
+    }
+
+    m_coeffs.clear();
+    m_offsets.resize(m_rows * m_nChunks);
+    m_counts.resize(m_rows * m_nChunks);
+
+    for(int r=0; r<m_rows; r++){
+        for(int ch=0; ch<m_nChunks; ch++){
+            int index = r*m_nChunks + ch;
+            int count = 0;
+
+            m_offsets[index] = m_coeffs.size();
+
+            for(int k=0; k<m_nKernels; k++){
+                const Mat &kernel = kernels[m_order[k]];
+                bool covered = 
+                    r >= row0[k] && r < row0[k] + kernel.rows &&
+                    ch*CHUNK < col0[k] + kernel.cols &&
+                    (ch+1)*CHUNK > col0[k];
+
+                if(!covered){
+                    continue;
+                }
+
+                // The kernels covering (r, ch) must be kernels [0, count).
+                assert(count == k);
+                count++;
+
+                const float *kernel_p = kernel.ptr<float>(r - row0[k]);
+                for(int i=0; i<CHUNK; i++){
+                    int col = ch*CHUNK + i - col0[k];
+                    if(col >= 0 && col < kernel.cols){
+                        m_coeffs.push_back(kernel_p[col]);
+                    }
+                    else {
+                        m_coeffs.push_back(0.0F);
+                    }
+                }
+            }
+
+            m_counts[index] = count;
+        }
+    }
+}
+
+
+// Will do the forward DFT of src immediately. src will not be
+// used after this function returns.
+void FFTConvolution::init(
+    const cv::Mat &src,
+    int maxKernelRows,  // the max number of rows of kernels
+    int maxKernelCols   // the max number of cols of kernels
+)
+{
+    assert(maxKernelRows > 0);
+    assert(maxKernelCols > 0);
+    assert(src.type() == CV_32FC1);
+
+    m_maxKernelRows = maxKernelRows;
+    m_maxKernelCols = maxKernelCols;
+    m_origWidth = src.cols;
+    m_origHeight = src.rows;
+
+    // Same padding as Convolution::init().
+    int paddingWidthOnRows = m_maxKernelCols / 2U;
+    int paddingWidthOnCols = m_maxKernelRows / 2U;
+
+    // The convolution is a circular correlation in frequency domain.
+    // With the DFT size below, a kernel never wraps around the
+    // padded matrix, so no extra padding is needed.
+    int dftRows = getOptimalDFTSize(src.rows + m_maxKernelRows - 1);
+    int dftCols = getOptimalDFTSize(src.cols + m_maxKernelCols - 1);
+
+    Mat padded = Mat::zeros(dftRows, dftCols, CV_32FC1);
+
+    // padded_sub POINTS TO a sub-area of padded
+    auto padded_sub = padded(Rect(
+        paddingWidthOnRows,  // x
+        paddingWidthOnCols,  // y
+        src.cols,            // width
+        src.rows             // height
+    ));
+
+    src.copyTo(padded_sub);
+
+    dft(padded, m_srcSpectrum, DFT_COMPLEX_OUTPUT);
+}
+
+std::tuple<int/*rows*/, int/*cols*/>
+FFTConvolution::getDFTSize() const
+{
+    return make_tuple(m_srcSpectrum.rows, m_srcSpectrum.cols);
+}
+
+// Compute the spectrum of kernel (re + j*im), which can be
+// passed to calcConv().
+cv::Mat FFTConvolution::calcKernelSpectrum(
+    const cv::Mat &re,
+    const cv::Mat &im
+) const
+{
+    assert(m_maxKernelRows > 0);
+    assert(re.rows <= m_maxKernelRows);
+    assert(re.cols <= m_maxKernelCols);
+    assert(re.size == im.size);
+    assert(CV_TYPE2DEPTH(re.type()) == CV_32F);
+    assert(re.type() == im.type());
+
+    // Convolution::calcConv() computes sum(src_sub .* kernel), which
+    // is the correlation of src and kernel. In frequency domain:
+    //     sum(src_sub .* (re + j*im)) = IDFT(SRC .* conj(DFT(re - j*im)))
+    // so the spectrum of (re - j*im) is stored, and calcConv() will
+    // use its conjugation.
+    Mat planes[2];
+    planes[0] = Mat::zeros(m_srcSpectrum.rows, m_srcSpectrum.cols, CV_32FC1);
+    planes[1] = Mat::zeros(m_srcSpectrum.rows, m_srcSpectrum.cols, CV_32FC1);
+
+    // The kernel is placed at the top-left corner.
+    // re_sub and im_sub POINT TO sub-areas of planes.
+    auto re_sub = planes[0](Rect(0, 0, re.cols, re.rows));
+    auto im_sub = planes[1](Rect(0, 0, im.cols, im.rows));
+    re.copyTo(re_sub);
+    Mat negIm = im * (-1.0F);
+    negIm.copyTo(im_sub);
+
+    Mat kernel, ret;
+    merge(planes, 2, kernel);
+    dft(kernel, ret);
+
+    return ret;
+}
+
+// Compute the convolution at all points in source matrix.
+// kernelRows, kernelCols: the size of the kernel used to
+// generate kernelSpectrum.
+// return value: two matrices of the same size as source matrix
+std::tuple<cv::Mat/*Re*/,cv::Mat/*Im*/>
+FFTConvolution::calcConv(
+    const cv::Mat &kernelSpectrum,
+    int kernelRows,
+    int kernelCols
+) const
+{
+    assert(m_maxKernelRows > 0);
+    assert(kernelRows <= m_maxKernelRows);
+    assert(kernelCols <= m_maxKernelCols);
+    assert(kernelSpectrum.type() == m_srcSpectrum.type());
+    assert(kernelSpectrum.size == m_srcSpectrum.size);
+
+    Mat product, result;
+    mulSpectrums(m_srcSpectrum, kernelSpectrum, product, 0, true);
+    idft(product, result, DFT_SCALE);
+
+    // The element (x, y) of the convolution is at the same place
+    // as the top-left corner of src_sub in Convolution::calcConv().
+    auto result_sub = result(Rect(
+        (m_maxKernelCols - kernelCols)/2U,  // x
+        (m_maxKernelRows - kernelRows)/2U,  // y
+        m_origWidth,                        // width
+        m_origHeight                        // height
+    ));
+
+    Mat planes[2];
+    split(result_sub, planes);
+
+    return make_tuple(planes[0], planes[1]);
+}
+
+
+// Get the spectra of kernels (re[i] + j*im[i]) for the DFT size
+// of conv. Will compute them if not cached.
+std::shared_ptr<const std::vector<cv::Mat>>
+KernelSpectrumCache::get(
+    const FFTConvolution &conv,
+    const cv::Mat *re,
+    const cv::Mat *im,
+    int nKernels
+)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto &ret = m_spectra[conv.getDFTSize()];
+    if(ret) {
+        assert(ret->size() == nKernels);
+        return ret;
+    }
+
+    auto spectra = make_shared<Spectra>(nKernels);
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int i=0; i<nKernels; i++){
+        (*spectra)[i] = conv.calcKernelSpectrum(re[i], im[i]);
+    }
+
+    ret = spectra;
+    return ret;
+}
+
+void KernelSpectrumCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_spectra.clear();
+}
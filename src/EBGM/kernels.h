@@ -1,6 +1,10 @@
 #pragma once
 
 #include <tuple>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <vector>
 
 #include <opencv2/core.hpp>
 
@@ -31,12 +35,94 @@ public:
 };
 
 
+// A global registry of the wave vectors (kx, ky) of kernel banks.
+// Equal banks are interned into the same id, so a jet only stores
+// the id, and all the jets and graphs of a bank share one copy.
+// Thread-safe. Banks are never removed, so the pointers returned by
+// getKx() and getKy() stay valid.
+class KernelRegistry {
+public:
+    static constexpr int MAX_BANKS = 256;
+
+    // Return the id of the bank (kx[n], ky[n]). Register it if it
+    // has not been registered.
+    // Throw a runtime_error if there are too many banks.
+    static int intern(const float *kx, const float *ky, int n);
+
+    // id: the return value of intern().
+    static const float *getKx(int id);
+    static const float *getKy(int id);
+    static int getSize(int id);
+};
+
+
+// A set of kernels packed for Convolution::calcConvBank().
+// The kernels may have different sizes, but their rectangles must
+// be nested when placed at the center of the largest one (e.g. the
+// kernels generated by genGaborKernels()).
+class KernelBank {
+public:
+    // The number of floats processed together. Each row of a kernel
+    // is split into chunks of this size.
+    static constexpr int CHUNK = 16;
+
+    // The max number of kernels in a bank.
+    static constexpr int MAX_KERNELS = 128;
+
+private:
+    friend class Convolution;
+
+    int m_nKernels = 0;
+    int m_rows = 0;       // the size of the largest kernel
+    int m_cols = 0;
+    int m_nChunks = 0;    // the number of chunks in a row
+
+    // For each (row, chunk), the kernels covering it are always
+    // kernels [0, count) after sorting by size (descending), and
+    // their coefficients are stored contiguously:
+    //     m_coeffs[offset + k*CHUNK + i], i = 0, 1, ..., CHUNK-1
+    // Coefficients outside a kernel are zero.
+    std::vector<float> m_coeffs;
+    std::vector<int> m_offsets;   // [row*m_nChunks + chunk]
+    std::vector<int> m_counts;    // [row*m_nChunks + chunk]
+
+    // m_order[k]: the original index of k-th kernel after sorting.
+    std::vector<int> m_order;
+
+public:
+    // Will copy the data of kernels into this class.
+    // The depth of kernels must be CV_32F.
+    void init(const std::vector<cv::Mat> &kernels);
+
+    int size() const
+    {
+        return m_nKernels;
+    }
+
+    // the size of the largest kernel
+    std::tuple<int/*rows*/, int/*cols*/>
+    getMaxSize() const
+    {
+        return std::make_tuple(m_rows, m_cols);
+    }
+
+    KernelBank() noexcept {}
+
+    // Will copy the data of kernels into this class.
+    // The depth of kernels must be CV_32F.
+    explicit KernelBank(const std::vector<cv::Mat> &kernels) noexcept
+    {init(kernels);}
+};
+
+
 // Compute the convolution of source matrix and a kernel
 // at a specific point. 
 // Only support one-channel matrices!
 class Convolution {
 private:
-    // Padded source matrix
+    // Padded source matrix.
+    // Has KernelBank::CHUNK extra zero columns on the right, so that
+    // calcConvBank() can always read whole chunks.
     cv::Mat m_src;
 
     int m_maxKernelRows = 0;
@@ -64,6 +150,18 @@ public:
         int y
     ) const;
 
+    // Compute the convolution of all the kernels in bank at a
+    // specific point in source matrix, in one pass over the image
+    // patch. Does not allocate any memory.
+    // result: an array of bank.size() elements, in the same order
+    // as the kernels passed to KernelBank::init().
+    void calcConvBank(
+        const KernelBank &bank,
+        int x,
+        int y,
+        float *result
+    ) const;
+
     Convolution() noexcept {}
 
     // Will copy the data of src into an internel Mat in this class, and
@@ -75,4 +173,98 @@ public:
         int maxKernelCols   // the max number of cols of kernels
     ) noexcept 
     {init(src, maxKernelRows, maxKernelCols);}
+};
+
+
+// The ways of computing the convolution at all points of a matrix.
+enum class ConvMethod {
+    DIRECT,    // Convolution::calcConv() at each point
+    FFT        // FFTConvolution, in frequency domain
+};
+
+
+// Compute the convolution of source matrix and a complex kernel
+// (re + j*im) at all points at once, in frequency domain.
+// Gives the same results as Convolution::calcConv() (within the
+// floating-point error), but the cost does not depend on the size
+// of kernels.
+// Only support one-channel matrices!
+class FFTConvolution {
+private:
+    // The spectrum of padded source matrix, CV_32FC2.
+    cv::Mat m_srcSpectrum;
+
+    int m_maxKernelRows = 0;
+    int m_maxKernelCols = 0;
+
+    int m_origWidth = 0;
+    int m_origHeight = 0;
+
+public:
+
+    // Will do the forward DFT of src immediately. src will not be
+    // used after this function returns.
+    void init(
+        const cv::Mat &src,
+        int maxKernelRows,  // the max number of rows of kernels
+        int maxKernelCols   // the max number of cols of kernels
+    );
+
+    // The spectrum of a kernel can be shared by all the FFTConvolution
+    // objects with the same DFT size.
+    std::tuple<int/*rows*/, int/*cols*/>
+    getDFTSize() const;
+
+    // Compute the spectrum of kernel (re + j*im), which can be
+    // passed to calcConv().
+    cv::Mat calcKernelSpectrum(
+        const cv::Mat &re,
+        const cv::Mat &im
+    ) const;
+
+    // Compute the convolution at all points in source matrix.
+    // kernelRows, kernelCols: the size of the kernel used to
+    // generate kernelSpectrum.
+    // return value: two matrices of the same size as source matrix
+    std::tuple<cv::Mat/*Re*/,cv::Mat/*Im*/>
+    calcConv(
+        const cv::Mat &kernelSpectrum,
+        int kernelRows,
+        int kernelCols
+    ) const;
+
+    FFTConvolution() noexcept {}
+
+    // Will do the forward DFT of src immediately. src will not be
+    // used after this function returns.
+    FFTConvolution(
+        const cv::Mat &src,
+        int maxKernelRows,  // the max number of rows of kernels
+        int maxKernelCols   // the max number of cols of kernels
+    ) noexcept
+    {init(src, maxKernelRows, maxKernelCols);}
+};
+
+
+// Caches the spectra of a set of kernels for every DFT size, so
+// that images of the same size will not recompute them.
+// Thread-safe.
+class KernelSpectrumCache {
+private:
+    using Spectra = std::vector<cv::Mat>;
+
+    std::mutex m_mutex;
+    std::map<std::tuple<int,int>, std::shared_ptr<const Spectra>> m_spectra;
+
+public:
+    // Get the spectra of kernels (re[i] + j*im[i]) for the DFT size
+    // of conv. Will compute them if not cached.
+    std::shared_ptr<const Spectra> get(
+        const FFTConvolution &conv,
+        const cv::Mat *re,
+        const cv::Mat *im,
+        int nKernels
+    );
+
+    void clear();
 };
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <cmath>
 #include <type_traits>
 
+#include "fixedvector.hpp"
 
 #ifndef NDEBUG
 #include <iostream>
@@ -19,8 +20,14 @@
 // transformations on these points.
 // T: original type for the coordinates. This class will
 // always use float for internal operations.
-template<typename T>
+// K: the number of points, if it is fixed at compile time: the points
+// are stored in a std::array (see Storage). 0: any number of points.
+template<typename T, int K = 0>
 class Points {
+    static_assert(K >= 0, "The 'K' in Points<T, K> must not be negative.");
+
+    template<typename, int> friend class Points;
+
 public:
     using Point = struct {T x; T y;};
 
@@ -28,7 +35,7 @@ private:
     // internal type for storing and transforming
     using _Point = struct {float x; float y;};
 
-    std::vector<_Point> m_points;
+    Storage<_Point, K> m_points;
 
     // function for converting float to T
     // (int)1.999F = 1, (int)round(1.999F) = 2
@@ -76,6 +83,22 @@ public:
         addPoint(points);
     }
 
+    // Convert between the fixed and the dynamic number of points.
+    // The coordinates are copied as they are (not rounded to T).
+    template<int K2>
+    explicit Points(const Points<T, K2> &points)
+    {
+        assert(K == 0 || points.size() <= K);
+
+        for(const auto &i: points.m_points) {
+            m_points.push_back({i.x, i.y});
+        }
+        m_maxX = points.m_maxX;
+        m_maxY = points.m_maxY;
+        m_minX = points.m_minX;
+        m_minY = points.m_minY;
+    }
+
     int size() const 
     {
         return m_points.size();
@@ -138,6 +161,26 @@ public:
         recalcMinMax();
     }
 
+    // Same as modifyPoint(), but the coordinates are stored as they
+    // are, e.g. the sub-pixel positions of Points<int>. get() still
+    // converts them to T.
+    void modifyPointExact(float x, float y, int index)
+    {
+        assert(index < m_points.size() && index >=0);
+
+        m_points[index] = _Point{x, y};
+
+        recalcMinMax();
+    }
+
+    // The coordinates as they are stored (not converted to T).
+    std::tuple<float/*x*/, float/*y*/> getExact(int i) const
+    {
+        assert(i < m_points.size() && i >=0);
+
+        return std::make_tuple(m_points[i].x, m_points[i].y);
+    }
+
     Point get(int i) const
     {
         assert(i < m_points.size() && i >=0);
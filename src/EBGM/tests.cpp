@@ -11,6 +11,7 @@
 #include "gui.h"
 #include "iofiles.h"
 #include "ebgm.h"
+#include "cpu.h"
 
 #include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
@@ -24,6 +25,9 @@
 #include <iostream>
 #include <fstream>
 #include <tuple>
+#include <chrono>
+
+#include <omp.h>
 
 
 
@@ -333,7 +337,7 @@ void test8()
 
     simi = bunch.compare(graph0);
     tie(simiph, sumdisp2) = bunch.compareWithPhaseFocus(
-        graph0, 5, displacementWithFocus
+        graph0, 5, displacementWithFocus<40>
     );
     cout << "bunch: (graph0); graph: graph0\n";
     cout << "simi = " << simi << "\n";
@@ -342,7 +346,7 @@ void test8()
 
     simi = bunch.compare(graph1);
     tie(simiph, sumdisp2) = bunch.compareWithPhaseFocus(
-        graph1, 5, displacementWithFocus
+        graph1, 5, displacementWithFocus<40>
     );
     cout << "bunch: (graph0); graph: graph1\n";
     cout << "simi = " << simi << "\n";
@@ -351,7 +355,7 @@ void test8()
 
     simi = bunch.compare(graph2);
     tie(simiph, sumdisp2) = bunch.compareWithPhaseFocus(
-        graph2, 5, displacementWithFocus
+        graph2, 5, displacementWithFocus<40>
     );
     cout << "bunch: (graph0); graph: graph2\n";
     cout << "simi = " << simi << "\n";
@@ -362,7 +366,7 @@ void test8()
 
     simi = bunch.compare(graph0);
     tie(simiph, sumdisp2) = bunch.compareWithPhaseFocus(
-        graph0, 5, displacementWithFocus
+        graph0, 5, displacementWithFocus<40>
     );
     cout << "bunch: (graph0, graph1); graph: graph0\n";
     cout << "simi = " << simi << "\n";
@@ -371,7 +375,7 @@ void test8()
 
     simi = bunch.compare(graph2);
     tie(simiph, sumdisp2) = bunch.compareWithPhaseFocus(
-        graph2, 5, displacementWithFocus
+        graph2, 5, displacementWithFocus<40>
     );
     cout << "bunch: (graph0, graph1); graph: graph2\n";
     cout << "simi = " << simi << "\n";
@@ -385,7 +389,7 @@ void test8()
 
     simi = bunch.compare(graph0);
     tie(simiph, sumdisp2) = bunch.compareWithPhaseFocus(
-        graph0, 5, displacementWithFocus
+        graph0, 5, displacementWithFocus<40>
     );
     cout << "bunch: (graph2, graph0, graph1); graph: graph0\n";
     cout << "simi = " << simi << "\n";
@@ -1241,4 +1245,1080 @@ void test21()
 
 
 }
+
+
+// compare the jets calculated by ConvMethod::DIRECT and
+// ConvMethod::FFT.
+void test22()
+{
+    Kernels<40> kernels;
+    genGaborKernels(101, kernels);
+    
+    Mat image;
+    // image: 8UC1 (if test.png is 8-bit)
+    image = imread("test.png", CV_LOAD_IMAGE_GRAYSCALE);
+    image.convertTo(image, CV_32F);
+
+    CalcJet<40> calcJet1(image, kernels, 101, 101, ConvMethod::DIRECT);
+    CalcJet<40> calcJet2(image, kernels, 101, 101, ConvMethod::FFT);
+
+    float maxDiffA = 0.0F;
+    float minSimiph = 1.0F;
+    for(int i=0; i<image.cols; i++){
+        for(int j=0; j<image.rows; j++){
+            auto jet1 = calcJet1.calcJet(i, j);
+            auto jet2 = calcJet2.calcJet(i, j);
+
+            for(int k=0; k<40; k++) {
+                float diff = fabs(jet1.a[k] - jet2.a[k]) / jet1.a[k];
+                if(diff > maxDiffA) {
+                    maxDiffA = diff;
+                }
+            }
+
+            float simiph = jet1.compareWithPhase(jet2, 0.0F, 0.0F);
+            if(simiph < minSimiph) {
+                minSimiph = simiph;
+            }
+        }
+    }
+
+    cout << "max relative difference of magnitudes = " << maxDiffA << "\n";
+    cout << "min similarity with phase = " << minSimiph << "\n";
+}
+
+
+// compare the jets calculated by truncated kernels and
+// full-size kernels.
+void test23()
+{
+    Kernels<40> kernels1, kernels2;
+    genGaborKernels(101, kernels1);
+    genGaborKernels(101, kernels2, 0.001F);
+
+    for(int i=0; i<40; i+=8) {
+        cout << "nu = " << i/8 << ": " << kernels2.re[i].cols << "\n";
+    }
+    
+    Mat image;
+    // image: 8UC1 (if test.png is 8-bit)
+    image = imread("test.png", CV_LOAD_IMAGE_GRAYSCALE);
+    image.convertTo(image, CV_32F);
+
+    CalcJet<40> calcJet1(image, kernels1, 101, 101, ConvMethod::DIRECT);
+    CalcJet<40> calcJet2(image, kernels2, 101, 101, ConvMethod::DIRECT);
+
+    float minSimi = 1.0F;
+    float minSimiph = 1.0F;
+    for(int i=0; i<image.cols; i++){
+        for(int j=0; j<image.rows; j++){
+            auto jet1 = calcJet1.calcJet(i, j);
+            auto jet2 = calcJet2.calcJet(i, j);
+
+            minSimi = min(minSimi, jet1.compare(jet2));
+            minSimiph = min(minSimiph, jet1.compareWithPhase(jet2, 0.0F, 0.0F));
+        }
+    }
+
+    cout << "min similarity = " << minSimi << "\n";
+    cout << "min similarity with phase = " << minSimiph << "\n";
+}
+
+void test24()
+{
+    Kernels<40> kernels;
+    genGaborKernels(101, kernels, 0.001F);
+
+    Mat image;
+    // image: 8UC1 (if test.png is 8-bit)
+    image = imread("test.png", CV_LOAD_IMAGE_GRAYSCALE);
+    image.convertTo(image, CV_32F);
+
+    std::vector<Mat> bankKernels(kernels.re, kernels.re + 40);
+    bankKernels.insert(bankKernels.end(), kernels.im, kernels.im + 40);
+    KernelBank bank(bankKernels);
+
+    Convolution conv(image, 101, 101);
+
+    float maxDiff = 0.0F;
+    float result[80];
+    for(int i=0; i<image.cols; i++){
+        for(int j=0; j<image.rows; j++){
+            conv.calcConvBank(bank, i, j, result);
+            for(int k=0; k<80; k++) {
+                maxDiff = max(maxDiff, 
+                    abs(result[k] - conv.calcConv(bankKernels[k], i, j)));
+            }
+        }
+    }
+
+    cout << "max difference = " << maxDiff << "\n";
+}
+
+void test25()
+{
+    Kernels<40> kernels;
+    genGaborKernels(101, kernels, 0.001F);
+
+    Mat image;
+    // image: 8UC1 (if test.png is 8-bit)
+    image = imread("test.png", CV_LOAD_IMAGE_GRAYSCALE);
+    image.convertTo(image, CV_32F);
+
+    int maxKernelRows, maxKernelCols;
+    std::tie(maxKernelRows, maxKernelCols) = kernels.getMaxSize();
+
+    CalcJet<40> calcJet1(image, kernels, maxKernelRows, maxKernelCols, 
+        ConvMethod::DIRECT);
+    CalcJet<40> calcJet2;
+    // 4 tiles of 32*32 pixels
+    calcJet2.initLazy(image, kernels, maxKernelRows, maxKernelCols, 
+        4*2*40*32*32*sizeof(float));
+
+    int nDiff = 0;
+    #pragma omp parallel for collapse(2) reduction(+:nDiff)
+    for(int i=0; i<image.cols; i++){
+        for(int j=0; j<image.rows; j++){
+            auto jet1 = calcJet1.calcJet(i, j);
+            auto jet2 = calcJet2.calcJet(i, j);
+
+            if(memcmp(jet1.a, jet2.a, sizeof(jet1.a)) ||
+                memcmp(jet1.p, jet2.p, sizeof(jet1.p))){
+                nDiff++;
+            }
+        }
+    }
+
+    cout << "different jets: " << nDiff << "\n";
+}
+
+void test26()
+{
+    Kernels<40> kernels1, kernels2;
+    genGaborKernels(101, kernels1);
+    genGaborKernels(101, kernels2, 0.001F);
+
+    Mat image;
+    // image: 8UC1 (if test.png is 8-bit)
+    image = imread("test.png", CV_LOAD_IMAGE_GRAYSCALE);
+    image.convertTo(image, CV_32F);
+
+    CalcJet<40> calcJet1(image, kernels1, 101, 101);
+    calcJet1.saveFile("test.png.jets", kernels1);
+
+    CalcJet<40> calcJet2;
+    calcJet2.mapFile("test.png.jets", kernels1);
+
+    int nDiff = 0;
+    for(int i=0; i<image.cols; i++){
+        for(int j=0; j<image.rows; j++){
+            auto jet1 = calcJet1.calcJet(i, j);
+            auto jet2 = calcJet2.calcJet(i, j);
+
+            if(memcmp(jet1.a, jet2.a, sizeof(jet1.a)) ||
+                memcmp(jet1.p, jet2.p, sizeof(jet1.p))){
+                nDiff++;
+            }
+        }
+    }
+    cout << "different jets: " << nDiff << "\n";
+
+    // should be rejected
+    try {
+        CalcJet<40> calcJet3;
+        calcJet3.mapFile("test.png.jets", kernels2);
+        cout << "the file is not rejected\n";
+    }
+    catch(const std::exception &e) {
+        cout << "rejected: " << e.what() << "\n";
+    }
+}
+
+void test27()
+{
+    Kernels<40> kernels;
+    genGaborKernels(101, kernels);
+
+    Mat image;
+    // image: 8UC1 (if test.png is 8-bit)
+    image = imread("test.png", CV_LOAD_IMAGE_GRAYSCALE);
+    image.convertTo(image, CV_32F);
+
+    CalcJet<40> calcJet0(image, kernels, 101, 101);
+
+    for(JetStorage storage: {JetStorage::FP16, JetStorage::LOG8}) {
+        CalcJet<40> calcJet1(image, kernels, 101, 101, 
+            ConvMethod::FFT, storage);
+
+        float minSimi = 1.0F, minSimiph = 1.0F;
+        double sumSimi = 0.0, sumSimiph = 0.0;
+        double sumDiffD = 0.0;
+        float maxDiffD = 0.0F;
+        int n = 0;
+
+        // compare the displacement between (i, j) and (i+2, j+1)
+        for(int i=0; i<image.cols-2; i++){
+            for(int j=0; j<image.rows-1; j++){
+                auto jet0 = calcJet0.calcJet(i, j);
+                auto jet1 = calcJet1.calcJet(i, j);
+                float simi = jet0.compare(jet1);
+                float simiph = jet0.compareWithPhase(jet1, 0.0F, 0.0F);
+
+                float dx0, dy0, dx1, dy1;
+                std::tie(dx0, dy0) = jet0.displacement(calcJet0.calcJet(i+2, j+1));
+                std::tie(dx1, dy1) = jet1.displacement(calcJet1.calcJet(i+2, j+1));
+                float diffD = sqrt((dx0-dx1)*(dx0-dx1) + (dy0-dy1)*(dy0-dy1));
+
+                minSimi = min(minSimi, simi);
+                minSimiph = min(minSimiph, simiph);
+                sumSimi += simi;
+                sumSimiph += simiph;
+                maxDiffD = max(maxDiffD, diffD);
+                sumDiffD += diffD;
+                n++;
+            }
+        }
+
+        cout << jetStorageName(storage) << ":\n";
+        cout << "    similarity:            min = " << minSimi 
+             << ", mean = " << sumSimi/n << "\n";
+        cout << "    similarity with phase: min = " << minSimiph
+             << ", mean = " << sumSimiph/n << "\n";
+        cout << "    displacement error:    max = " << maxDiffD
+             << ", mean = " << sumDiffD/n << "\n";
+    }
+}
+
+void test28()
+{
+    Kernels<40> kernels;
+    genGaborKernels(101, kernels);
+
+    Mat image;
+    // image: 8UC1 (if test.png is 8-bit)
+    image = imread("test.png", CV_LOAD_IMAGE_GRAYSCALE);
+    image.convertTo(image, CV_32F);
+
+    CalcJet<40> calcJet(image, kernels, 101, 101);
+
+    float maxDiff = 0.0F;
+    for(int i=0; i<image.cols-3; i++){
+        for(int j=0; j<image.rows-2; j++){
+            auto jet1 = calcJet.calcJet(i, j);
+            auto jet2 = calcJet.calcJet(i+3, j+2);
+            ComplexJet<40> cjet1(jet1), cjet2(jet2);
+
+            float dx, dy;
+            std::tie(dx, dy) = displacementWithFocus(jet1, jet2, 5);
+
+            maxDiff = max(maxDiff, abs(
+                jet1.compareWithPhase(jet2, dx, dy) - 
+                cjet1.compareWithPhase(cjet2, dx, dy)
+            ));
+        }
+    }
+
+    cout << "max difference = " << maxDiff << "\n";
+}
+
+// imread() filename as a 32FC1 grayscale image.
+static Mat readTestImage(const char *filename)
+{
+    Mat image;
+    // image: 8UC1 (if filename is 8-bit)
+    image = imread(filename, CV_LOAD_IMAGE_GRAYSCALE);
+    image.convertTo(image, CV_32F);
+    return image;
+}
+
+// the points of the face in test.png.
+static Points<int> testPoints()
+{
+    return Points<int>{
+        {49, 59}, {73, 57}, {60, 74}, {52, 88}, {71, 87},
+        {32, 60}, {33, 77}, {37, 91}, {50, 108}, 
+        {67, 108}, {81, 91}, {87, 76}, {92, 59},
+        {59, 39}
+    };
+}
+
+// The setup shared by the matching tests: the jets of test.png and
+// test2.png with 40 kernels, the points of the face in test.png, and a
+// bunch graph with one model, the graph of test.png at these points.
+struct TestFaces {
+    Kernels<40> kernels;
+    Mat image = readTestImage("test.png");
+    Mat image2 = readTestImage("test2.png");
+    CalcJet<40> calcJet;
+    CalcJet<40> calcJet2;
+    Points<int> points = testPoints();
+    BunchGraph<40> bunch;
+
+    TestFaces()
+    {
+        genGaborKernels(101, kernels);
+        calcJet.init(image, kernels, 101, 101);
+        calcJet2.init(image2, kernels, 101, 101);
+        bunch.addGraph(pointsToGraph(calcJet, points));
+    }
+};
+
+void test29()
+{
+    TestFaces faces;
+
+    MatchOptions options;
+    options.step1Maps = true;
+
+    for(const CalcJet<40> *c: {&faces.calcJet, &faces.calcJet2}) {
+        Graph<40> graph1, graph2;
+        Points<int> points1, points2;
+
+        auto t0 = chrono::steady_clock::now();
+        tie(graph1, points1) = step1(*c, faces.bunch, faces.points);
+        auto t1 = chrono::steady_clock::now();
+        tie(graph2, points2) = step1(*c, faces.bunch, faces.points, options);
+        auto t2 = chrono::steady_clock::now();
+
+        // step1Maps() scores all the translations step1() scores, so
+        // its similarity is never lower.
+        cout << "lattice: (" << points1.get(0).x << ", " << points1.get(0).y
+             << "), similarity = " << faces.bunch.compare(graph1) << ", "
+             << chrono::duration<double, milli>(t1 - t0).count() << " ms\n";
+        cout << "maps:    (" << points2.get(0).x << ", " << points2.get(0).y
+             << "), similarity = " << faces.bunch.compare(graph2) << ", "
+             << chrono::duration<double, milli>(t2 - t1).count() << " ms\n";
+    }
+}
+
+void test30()
+{
+    TestFaces faces;
+
+    Points<int> step1Points = std::get<1>(
+        step1(faces.calcJet2, faces.bunch, faces.points)
+    );
+
+    BunchGraph<40> bunch1 = faces.bunch, bunch2 = faces.bunch;
+    Graph<40> graph;
+    Points<int> points1, points2;
+    SimilarityMemo memo;
+
+    auto t0 = chrono::steady_clock::now();
+    graph = std::get<0>(step3(faces.calcJet2, bunch1, step1Points));
+    points1 = std::get<1>(step4(faces.calcJet2, bunch1, graph));
+    auto t1 = chrono::steady_clock::now();
+    graph = std::get<0>(step3(faces.calcJet2, bunch2, step1Points, &memo));
+    points2 = std::get<1>(step4(faces.calcJet2, bunch2, graph, &memo));
+    auto t2 = chrono::steady_clock::now();
+
+    bool same = true;
+    for(int i=0; i<points1.size(); i++){
+        same = same && 
+            points1.get(i).x == points2.get(i).x &&
+            points1.get(i).y == points2.get(i).y;
+    }
+
+    cout << "same result: " << (same ? "yes" : "no") << "\n";
+    cout << "without memo: " 
+         << chrono::duration<double, milli>(t1 - t0).count() << " ms\n";
+    cout << "with memo:    " 
+         << chrono::duration<double, milli>(t2 - t1).count() << " ms, "
+         << memo.getHits() << " hits, " << memo.getMisses() << " misses\n";
+}
+
+void test31()
+{
+    TestFaces faces;
+
+    const float lambda = 2.0F;
+    Graph<40> graph0 = pointsToGraph(faces.calcJet2, faces.points);
+    auto terms = faces.bunch.initScoreTerms(
+        graph0, 5, complexDisplacementWithFocus<40>, lambda
+    );
+    float score0 = std::get<0>(faces.bunch.compareWithPhaseFocusComplex(
+        graph0, 5, complexDisplacementWithFocus<40>, lambda
+    ));
+
+    // move each node by up to 4 pixels, compare the score change
+    // with the score of the whole graph.
+    float maxDiff = 0.0F;
+    for(int n=0; n<faces.points.size(); n++){
+        for(int ix=-4; ix<=4; ix++){
+            for(int iy=-4; iy<=4; iy++){
+                auto point = faces.points.get(n);
+                auto jet = faces.calcJet2.calcJet(point.x + ix, point.y + iy);
+                Graph<40> graph = graph0;
+                graph.replaceNode(jet, n);
+
+                float score = std::get<0>(
+                    faces.bunch.compareWithPhaseFocusComplex(
+                        graph, 5, complexDisplacementWithFocus<40>, lambda
+                    )
+                );
+                float delta = faces.bunch.moveNodeDelta(
+                    terms, n, jet, complexDisplacementWithFocus<40>
+                );
+                maxDiff = max(maxDiff, abs(score - score0 - delta));
+            }
+        }
+    }
+
+    cout << "max difference = " << maxDiff << "\n";
+}
+
+void test32()
+{
+    TestFaces faces;
+
+    Points<int> step1Points = std::get<1>(
+        step1(faces.calcJet2, faces.bunch, faces.points)
+    );
+
+    for(Step3Search search: {Step3Search::GRID, Step3Search::PATTERN}) {
+        BunchGraph<40> bunch = faces.bunch;
+        SimilarityMemo memo;
+        MatchOptions options;
+        options.step3Search = search;
+
+        auto t0 = chrono::steady_clock::now();
+        Graph<40> graph = std::get<0>(step3(
+            faces.calcJet2, bunch, step1Points, &memo, options
+        ));
+        auto t1 = chrono::steady_clock::now();
+
+        // each graph evaluated looks up all of its nodes in memo.
+        cout << (search == Step3Search::GRID ? "grid:    " : "pattern: ")
+             << "similarity = " << faces.bunch.compare(graph)
+             << ", scale = (" << bunch.xScale << ", " << bunch.yScale 
+             << "), graphs = " 
+             << (memo.getHits() + memo.getMisses()) / faces.points.size()
+             << ", " << chrono::duration<double, milli>(t1 - t0).count()
+             << " ms\n";
+    }
+
+    // the budget is not exceeded, even in the middle of a round.
+    BunchGraph<40> bunch = faces.bunch;
+    SimilarityMemo memo;
+    MatchOptions options;
+    options.step3Search = Step3Search::PATTERN;
+    options.step3Budget = 13;
+    step3(faces.calcJet2, bunch, step1Points, &memo, options);
+    cout << "pattern, budget " << options.step3Budget << ": graphs = "
+         << (memo.getHits() + memo.getMisses()) / faces.points.size() << "\n";
+}
+
+void test33()
+{
+    TestFaces faces;
+
+    // test.png rotated
+    Mat image2;
+
+    int minX, minY, maxX, maxY;
+    std::tie(minX, minY, maxX, maxY) = faces.points.getMinMax();
+    float centerX = (minX + maxX) / 2.0F;
+    float centerY = (minY + maxY) / 2.0F;
+
+    for(float degrees: {-40.0F, -20.0F, 20.0F, 40.0F}) {
+        // rotate test.png around the center of the points, in the
+        // direction of Points::rotate().
+        Mat rotation = getRotationMatrix2D(
+            Point2f(centerX, centerY), -degrees, 1.0
+        );
+        warpAffine(faces.image, image2, rotation, faces.image.size(), 
+            INTER_LINEAR, BORDER_REPLICATE);
+        CalcJet<40> calcJet2(image2, faces.kernels, 101, 101);
+
+        Points<int> truth = faces.points;
+        truth.rotate(centerX, centerY, degrees * PI/180.0F);
+        auto meanError = [&](const Points<int> &result) {
+            double error = 0.0;
+            for(int i=0; i<truth.size(); i++){
+                error += hypot(
+                    result.get(i).x - truth.get(i).x,
+                    result.get(i).y - truth.get(i).y
+                );
+            }
+            return error / truth.size();
+        };
+
+        for(bool rotate: {false, true}) {
+            BunchGraph<40> bunch = faces.bunch;
+            SimilarityMemo memo;
+            MatchOptions options;
+            options.step3Rotation = rotate;
+            double rotationMs = 0;
+
+            auto t0 = chrono::steady_clock::now();
+            Graph<40> graph;
+            Points<int> result;
+            std::tie(graph, result) = step3(
+                calcJet2, bunch, faces.points, &memo, options, &rotationMs
+            );
+            auto t1 = chrono::steady_clock::now();
+
+            cout << degrees << " degrees, " 
+                 << (rotate ? "with rotation:    " : "without rotation: ")
+                 << "mean error = " << meanError(result)
+                 << " pixels, "
+                 << chrono::duration<double, milli>(t1 - t0).count()
+                 << " ms (rotation search: " << rotationMs << " ms)\n";
+
+            // step4() compares the jets in the orientations of the
+            // rotation found by step3().
+            for(Step4Search search: {Step4Search::WINDOW, 
+                                     Step4Search::PREDICT}) {
+                options.step4Search = search;
+                Points<int> refined = std::get<1>(step4(
+                    calcJet2, bunch, graph, &memo, options
+                ));
+                cout << "    step4 " 
+                     << (search == Step4Search::WINDOW ? 
+                         "window:  " : "predict: ")
+                     << "mean error = " << meanError(refined) 
+                     << " pixels\n";
+            }
+        }
+    }
+}
+
+void test34()
+{
+    TestFaces faces;
+
+    // step1 - step4 with 1 to max threads.
+    int maxThreads = omp_get_max_threads();
+    vector<Points<int>> results;
+    for(int nThreads: {1, 2, 3, maxThreads}) {
+        omp_set_num_threads(nThreads);
+
+        BunchGraph<40> bunch = faces.bunch;
+        Graph<40> graph;
+        Points<int> result;
+        tie(graph, result) = step1(faces.calcJet2, bunch, faces.points);
+        tie(graph, result) = step3(faces.calcJet2, bunch, result);
+        tie(graph, result) = step4(faces.calcJet2, bunch, graph);
+        results.push_back(result);
+    }
+    omp_set_num_threads(maxThreads);
+
+    bool same = true;
+    for(const auto &result: results){
+        for(int i=0; i<result.size(); i++){
+            same = same && 
+                result.get(i).x == results[0].get(i).x &&
+                result.get(i).y == results[0].get(i).y;
+        }
+    }
+
+    cout << "same result for any number of threads: " 
+         << (same ? "yes" : "no") << "\n";
+}
+
+void test35()
+{
+    TestFaces faces;
+
+#ifndef EBGM_COUNT_ALLOCS
+    cout << "Compile with EBGM_COUNT_ALLOCS to count the allocations.\n";
+#endif
+
+    uint64_t count0 = allocCount();
+    Points<int> step1Points = std::get<1>(
+        step1(faces.calcJet2, faces.bunch, faces.points)
+    );
+    uint64_t count1 = allocCount();
+    std::get<1>(step3(faces.calcJet2, faces.bunch, step1Points));
+    uint64_t count2 = allocCount();
+
+    // a few per thread, none per candidate.
+    cout << "step1: " << count1 - count0 << " allocations\n";
+    cout << "step3: " << count2 - count1 << " allocations\n";
+}
+
+void test36()
+{
+    TestFaces faces;
+
+    // 0: Graph<40>, 14: Graph<40, 14>.
+    Points<int> results[2];
+    double ms[2];
+    for(int i=0; i<2; i++) {
+        BunchGraph<40> bunch = faces.bunch;
+        SimilarityMemo memo;
+
+        auto start = std::chrono::steady_clock::now();
+        if(i == 0) {
+            results[i] = std::get<1>(__matchGraph<40, 0>(
+                faces.calcJet2, bunch, faces.points, &memo, MatchOptions(),
+                nullptr, nullptr, nullptr
+            ));
+        }
+        else {
+            results[i] = std::get<1>(__matchGraph<40, 14>(
+                faces.calcJet2, bunch, faces.points, &memo, MatchOptions(),
+                nullptr, nullptr, nullptr
+            ));
+        }
+        auto end = std::chrono::steady_clock::now();
+        ms[i] = std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    bool same = true;
+    for(int i=0; i<results[0].size(); i++){
+        same = same && 
+            results[1].get(i).x == results[0].get(i).x &&
+            results[1].get(i).y == results[0].get(i).y;
+    }
+
+    cout << "Graph<40>: " << ms[0] << " ms\n";
+    cout << "Graph<40, 14>: " << ms[1] << " ms\n";
+    cout << "same result: " << (same ? "yes" : "no") << "\n";
+}
+
+template<typename Bank>
+static Points<int> test37Match(const Mat &image, const Mat &image2)
+{
+    Kernels<Bank::N> kernels;
+    genGaborKernels(Bank::KERNEL_SIZE, kernels);
+
+    auto start = std::chrono::steady_clock::now();
+    CalcJet<Bank::N> calcJet(image, kernels, 101, 101);
+    CalcJet<Bank::N> calcJet2(image2, kernels, 101, 101);
+    auto end = std::chrono::steady_clock::now();
+    double jetsMs = 
+        std::chrono::duration<double, std::milli>(end - start).count();
+
+    Points<int> points = testPoints();
+
+    BunchGraph<Bank::N> bunch;
+    bunch.addGraph(pointsToGraph(calcJet, points));
+
+    SimilarityMemo memo;
+    start = std::chrono::steady_clock::now();
+    Points<int> result = std::get<1>(matchGraph(calcJet2, bunch, points, &memo));
+    end = std::chrono::steady_clock::now();
+    double matchMs = 
+        std::chrono::duration<double, std::milli>(end - start).count();
+
+    cout << Bank::SCALES << "x" << Bank::ORIENTATIONS << ": "
+         << "jets " << jetsMs << " ms, match " << matchMs << " ms\n";
+
+    return result;
+}
+
+void test37()
+{
+    Mat image = readTestImage("test.png");
+    Mat image2 = readTestImage("test2.png");
+
+    Points<int> result5x8 = test37Match<Bank5x8>(image, image2);
+    Points<int> result3x6 = test37Match<Bank3x6>(image, image2);
+
+    // the distances between the points found by both banks.
+    for(int i=0; i<result5x8.size(); i++){
+        float dx = result3x6.get(i).x - result5x8.get(i).x;
+        float dy = result3x6.get(i).y - result5x8.get(i).y;
+        cout << "point " << i << ": " << sqrtf(dx*dx + dy*dy) << "\n";
+    }
+}
+
+void test38()
+{
+    TestFaces faces;
+
+    Points<int> results[2][2];
+    for(int cascade=0; cascade<2; cascade++){
+        MatchOptions options;
+        options.cascade = cascade;
+        CascadeStats stats[2];
+        // step3() changes the scale of the bunch graph.
+        BunchGraph<40> bunch2 = faces.bunch;
+        Graph<40> graph;
+
+        auto start = std::chrono::steady_clock::now();
+        std::tie(graph, results[cascade][0]) = step1(
+            faces.calcJet2, bunch2, faces.points, options, &stats[0]
+        );
+        auto mid = std::chrono::steady_clock::now();
+        std::tie(graph, results[cascade][1]) = step3(faces.calcJet2, bunch2, 
+            results[cascade][0], nullptr, options, nullptr, &stats[1]);
+        auto end = std::chrono::steady_clock::now();
+
+        cout << "cascade " << cascade << ": step1 " 
+             << std::chrono::duration<double, std::milli>(mid - start).count()
+             << " ms, step3 "
+             << std::chrono::duration<double, std::milli>(end - mid).count()
+             << " ms\n";
+        for(int i=0; i<2 && cascade; i++){
+            cout << "    step" << (i == 0 ? 1 : 3) << ": " 
+                 << stats[i].coarse - stats[i].full << " of " 
+                 << stats[i].coarse << " graphs rejected\n";
+        }
+    }
+
+    for(int i=0; i<2; i++){
+        bool same = true;
+        for(int j=0; j<results[0][i].size(); j++){
+            same = same && 
+                results[0][i].get(j).x == results[1][i].get(j).x &&
+                results[0][i].get(j).y == results[1][i].get(j).y;
+        }
+        cout << "step" << (i == 0 ? 1 : 3) << ": " 
+             << (same ? "same points" : "DIFFERENT points") << "\n";
+    }
+}
+
+void test39()
+{
+    TestFaces faces;
+
+    Points<int> results[3];
+    for(int levels=0; levels<3; levels++){
+        MatchOptions options;
+        options.step1Levels = levels;
+        CalcJet<40> levelJets;
+        if(levels > 0){
+            initDownsampledJets(
+                levelJets, faces.image2, faces.kernels, levels
+            );
+        }
+        Graph<40> graph;
+
+        auto start = std::chrono::steady_clock::now();
+        std::tie(graph, results[levels]) = step1(
+            faces.calcJet2, faces.bunch, faces.points, options, nullptr,
+            &levelJets
+        );
+        auto end = std::chrono::steady_clock::now();
+
+        int maxDistance = 0;
+        for(int j=0; j<results[levels].size(); j++){
+            maxDistance = std::max(maxDistance, std::max(
+                std::abs(results[levels].get(j).x - results[0].get(j).x),
+                std::abs(results[levels].get(j).y - results[0].get(j).y)
+            ));
+        }
+        cout << "levels " << levels << ": step1 " 
+             << std::chrono::duration<double, std::milli>(end - start).count()
+             << " ms, similarity " << faces.bunch.compare(graph)
+             << ", max distance from levels 0: " << maxDistance << "\n";
+    }
+}
+
+void test40()
+{
+    TestFaces faces;
+
+    Graph<40> step3Graph;
+    Points<int> step3Points;
+    std::tie(step3Graph, step3Points) = step1(
+        faces.calcJet2, faces.bunch, faces.points
+    );
+    std::tie(step3Graph, step3Points) = step3(
+        faces.calcJet2, faces.bunch, step3Points
+    );
+
+    const char *names[2] = {"window", "predict"};
+    for(int i=0; i<2; i++){
+        MatchOptions options;
+        options.step4Search = i == 0 ? Step4Search::WINDOW :
+            Step4Search::PREDICT;
+        Graph<40> graph;
+        Points<int> result;
+
+        auto start = std::chrono::steady_clock::now();
+        std::tie(graph, result) = step4(
+            faces.calcJet2, faces.bunch, step3Graph, nullptr, options
+        );
+        auto end = std::chrono::steady_clock::now();
+
+        cout << names[i] << ": "
+             << std::chrono::duration<double, std::milli>(end - start).count()
+             << " ms, score "
+             << std::get<0>(faces.bunch.compareWithPhaseFocusComplex(
+                    graph, 5, complexDisplacementWithFocus<40>, 2.0F
+                ))
+             << "\n    points:";
+        for(int j=0; j<result.size(); j++){
+            float x, y;
+            std::tie(x, y) = result.getExact(j);
+            cout << " (" << x << ", " << y << ")";
+        }
+        cout << "\n";
+    }
+}
+
+void test41()
+{
+    TestFaces faces;
+
+    Jet<40> jet = faces.calcJet.calcJet(60, 74);
+    Jet<40> interpolated = faces.calcJet.calcJet(60.0F, 74.0F);
+    bool same = true;
+    for(int i=0; i<40; i++){
+        same = same &&
+            fabs(jet.a[i] - interpolated.a[i]) <= 1e-5F*jet.a[i] &&
+            fabs(wrapAngle(jet.p[i] - interpolated.p[i] + PI) - PI) <= 1e-4F;
+    }
+    cout << "integer position: " << (same ? "same jet" : "DIFFERENT jet")
+         << "\n";
+
+    for(float offset: {0.25F, 0.5F, 0.75F}){
+        Jet<40> shifted = faces.calcJet.calcJet(60.0F + offset, 74.0F);
+        // the same convention as the jets at integer positions.
+        bool inRange = true;
+        for(int i=0; i<40; i++){
+            inRange = inRange && 
+                shifted.p[i] >= -0.5F*PI && shifted.p[i] < 1.5F*PI;
+        }
+        float dx, dy;
+        std::tie(dx, dy) = displacementWithFocus(shifted, jet, 5);
+        cout << "offset " << offset << ": displacement (" << dx << ", "
+             << dy << "), phases " 
+             << (inRange ? "within" : "NOT within") << " [-0.5pi, 1.5pi)\n";
+    }
+
+    Points<int> step2Points = std::get<1>(step2(faces.calcJet2, faces.bunch,
+        std::get<1>(step1(faces.calcJet2, faces.bunch, faces.points))));
+
+    for(int subpixel=0; subpixel<2; subpixel++){
+        MatchOptions options;
+        options.step3Search = Step3Search::PATTERN;
+        options.subpixel = subpixel;
+        // step3() changes the scale of the bunch graph.
+        BunchGraph<40> bunch2 = faces.bunch;
+        Graph<40> graph;
+
+        auto start = std::chrono::steady_clock::now();
+        graph = std::get<0>(step3(
+            faces.calcJet2, bunch2, step2Points, nullptr, options
+        ));
+        auto end = std::chrono::steady_clock::now();
+
+        cout << "subpixel " << subpixel << ": step3 "
+             << std::chrono::duration<double, std::milli>(end - start).count()
+             << " ms, scales (" << bunch2.xScale << ", " << bunch2.yScale
+             << "), score "
+             << std::get<0>(bunch2.compareWithPhaseFocusComplex(
+                    graph, 5, complexDisplacementWithFocus<40>, 2.0F
+                ))
+             << "\n";
+    }
+}
+
+
+void test42()
+{
+    TestFaces faces;
+
+    // models: the graph of test.png at shifted points.
+    BunchGraph<40> bunch;
+    for(int k=0; k<20; k++){
+        Points<int> shifted = faces.points;
+        for(int i=0; i<shifted.size(); i++){
+            auto point = shifted.get(i);
+            shifted.modifyPoint({point.x + k%5 - 2, point.y + k/5 - 2}, i);
+        }
+        bunch.addGraph(pointsToGraph(faces.calcJet, shifted));
+    }
+
+    for(int focus=1; focus<=5; focus++){
+        bool same = true;
+        double batchMs = 0, functionMs = 0;
+
+        for(int n=0; n<faces.points.size(); n++){
+            auto point = faces.points.get(n);
+            Jet<40> jet = faces.calcJet2.calcJet(point.x, point.y);
+
+            auto start = std::chrono::steady_clock::now();
+            auto batch = bunch.compareNodeWithPhase(n, jet, focus);
+            auto middle = std::chrono::steady_clock::now();
+            auto function = bunch.compareNodeWithPhaseFocusComplex(
+                n, jet, focus, complexDisplacementWithFocus<40>
+            );
+            auto end = std::chrono::steady_clock::now();
+
+            same = same && batch == function;
+            batchMs += std::chrono::duration<double, std::milli>(
+                middle - start).count();
+            functionMs += std::chrono::duration<double, std::milli>(
+                end - middle).count();
+        }
+
+        cout << "focus " << focus << ": " << (same ? "same" : "DIFFERENT")
+             << ", batch " << batchMs << " ms, std::function "
+             << functionMs << " ms\n";
+    }
+}
+
+void test43()
+{
+    // the max errors of the approximations.
+    double sinError = 0, cosError = 0, atanError = 0, rsqrtError = 0;
+    for(double x=-1000; x<1000; x+=0.001){
+        float sinValue, cosValue;
+        fastSinCos((float)x, sinValue, cosValue);
+        double xf = (float)x;
+        sinError = std::max(sinError, fabs(sinValue - sin(xf)));
+        cosError = std::max(cosError, fabs(cosValue - cos(xf)));
+    }
+    for(int i=-1000; i<=1000; i++){
+        for(int j=-1000; j<=1000; j+=7){
+            float y = i/1000.0F, x = j/1000.0F;
+            atanError = std::max(atanError,
+                fabs(fastAtan2(y, x) - atan2((double)y, (double)x)));
+        }
+    }
+    for(double e=-30; e<30; e+=0.0001){
+        float x = pow(10.0, e);
+        rsqrtError = std::max(rsqrtError,
+            fabs(fastRsqrt(x)*sqrt((double)x) - 1.0));
+    }
+    cout << "max error: sin " << sinError << ", cos " << cosError
+         << ", atan2 " << atanError << ", rsqrt (relative) " << rsqrtError
+         << "\n";
+
+    Mat image = readTestImage("test.png");
+    Mat image2 = readTestImage("test2.png");
+
+    Kernels<40> kernels;
+    genGaborKernels(101, kernels);
+
+    Points<int> points = testPoints();
+
+    // the same matching in both modes: the jets, their comparisons and
+    // the points found.
+    Points<int> found[2];
+    Jet<40> jets[2];
+    for(int fast=0; fast<2; fast++){
+        setFastMath(fast);
+
+        auto start = std::chrono::steady_clock::now();
+        CalcJet<40> calcJet(image, kernels, 101, 101);
+        CalcJet<40> calcJet2(image2, kernels, 101, 101);
+        auto middle = std::chrono::steady_clock::now();
+
+        BunchGraph<40> bunch;
+        bunch.addGraph(pointsToGraph(calcJet, points));
+        Graph<40> graph;
+        Points<int> step3Points;
+        std::tie(graph, step3Points) = step3(calcJet2, bunch,
+            std::get<1>(step2(calcJet2, bunch,
+                std::get<1>(step1(calcJet2, bunch, points)))));
+        std::tie(graph, found[fast]) = step4(calcJet2, bunch, graph);
+        auto end = std::chrono::steady_clock::now();
+
+        jets[fast] = calcJet2.calcJet(60, 74);
+        float score = std::get<0>(bunch.compareWithPhaseFocus(
+            graph, 5, displacementWithFocus<40>, 2.0F
+        ));
+
+        cout << "fast math " << fast << ": jets "
+             << std::chrono::duration<double, std::milli>(
+                    middle - start).count()
+             << " ms, matching "
+             << std::chrono::duration<double, std::milli>(
+                    end - middle).count()
+             << " ms, score " << score << "\n";
+    }
+    setFastMath(false);
+
+    float magnitudeError = 0, phaseError = 0;
+    for(int i=0; i<40; i++){
+        magnitudeError = std::max(magnitudeError,
+            fabsf(jets[1].a[i] - jets[0].a[i])/jets[0].a[i]);
+        phaseError = std::max(phaseError,
+            fabsf(wrapAngle(jets[1].p[i] - jets[0].p[i] + PI) - PI));
+    }
+    int moved = 0;
+    for(int i=0; i<found[0].size(); i++){
+        moved += found[0].get(i).x != found[1].get(i).x ||
+            found[0].get(i).y != found[1].get(i).y;
+    }
+    cout << "jet (60, 74): magnitudes " << magnitudeError
+         << " (relative), phases " << phaseError << " apart; "
+         << moved << " of " << found[0].size() << " points differ\n";
+}
+
+void test44()
+{
+    Mat image = readTestImage("test.png");
+    Mat image2 = readTestImage("test2.png");
+
+    Kernels<40> kernels;
+    genGaborKernels(101, kernels);
+    CalcJet<40> calcJet2(image2, kernels, 101, 101);
+
+    Points<int> points = testPoints();
+
+    // the jets of the bunch graph are calculated at the generic level.
+    setCpuLevel(CpuLevel::GENERIC);
+    BunchGraph<40> bunch;
+    {
+        CalcJet<40> calcJet(image, kernels, 101, 101);
+        for(int k=0; k<20; k++){
+            Points<int> shifted = points;
+            shifted.translate(k%5 - 2, k/5 - 2);
+            bunch.addGraph(pointsToGraph(calcJet, shifted));
+        }
+    }
+
+    cout << "detected: " << cpuLevelName(detectedCpuLevel()) << "\n";
+
+    Jet<40> firstJet;
+    vector<float> firstScores;
+    for(int level=0; level<=(int)detectedCpuLevel(); level++){
+        setCpuLevel((CpuLevel)level);
+
+        auto start = std::chrono::steady_clock::now();
+        CalcJet<40> calcJet(image, kernels, 101, 101, ConvMethod::DIRECT);
+        auto middle = std::chrono::steady_clock::now();
+
+        vector<float> scores;
+        for(int n=0; n<points.size(); n++){
+            auto point = points.get(n);
+            Jet<40> jet = calcJet2.calcJet(point.x, point.y);
+            scores.push_back(
+                std::get<0>(bunch.compareNodeWithPhase(n, jet, 5))
+            );
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        // the jets by the FFT (libmComplex2mag()), compared with the
+        // bunch graph (planeDots()) and with each other (libmPhaseCos()).
+        CalcJet<40> calcJetFFT(image2, kernels, 101, 101);
+        Graph<40> graph = pointsToGraph(calcJetFFT, points);
+        scores.push_back(bunch.compare(graph));
+        scores.push_back(
+            graph.getNodes()[0].compareWithPhase(graph.getNodes()[1], 1, 2)
+        );
+        scores.push_back(graph.getNodes()[2].a[7]);
+        scores.push_back(graph.getNodes()[2].p[7]);
+
+        // the convolution is the same up to the rounding of FMA.
+        Jet<40> jet = calcJet.calcJet(60, 74);
+        if(level == 0){
+            firstJet = jet;
+            firstScores = scores;
+        }
+        float jetError = 0;
+        for(int i=0; i<40; i++){
+            jetError = std::max(jetError,
+                fabsf(jet.a[i] - firstJet.a[i])/firstJet.a[i]);
+        }
+
+        cout << cpuLevelName(cpuLevel()) << ": convolution "
+             << std::chrono::duration<double, std::milli>(
+                    middle - start).count()
+             << " ms (" << jetError << " from generic), node scores "
+             << std::chrono::duration<double, std::milli>(
+                    end - middle).count()
+             << " ms (" << (scores == firstScores ? "same" : "DIFFERENT")
+             << ")\n";
+    }
+    setCpuLevel(detectedCpuLevel());
+}
+
 #endif
\ No newline at end of file
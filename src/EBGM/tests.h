@@ -69,4 +69,98 @@ void test20();
 // test recognition
 void test21();
 
+// compare the jets calculated by ConvMethod::DIRECT and
+// ConvMethod::FFT.
+void test22();
+
+// compare the jets calculated by truncated kernels and
+// full-size kernels.
+void test23();
+
+// compare Convolution::calcConvBank() with Convolution::calcConv().
+void test24();
+
+// compare the jets calculated by CalcJet in lazy mode with those
+// calculated in normal mode.
+void test25();
+
+// save the jets into a ".jets" file, then map it and compare.
+void test26();
+
+// report the accuracy of JetStorage::FP16 and JetStorage::LOG8:
+// compare with the jets stored as floats.
+void test27();
+
+// compare Jet::compareWithPhase() with ComplexJet::compareWithPhase().
+void test28();
+
+// compare step1() on the 4-pixel lattice with step1Maps().
+void test29();
+
+// compare step3() and step4() with and without a SimilarityMemo.
+void test30();
+
+// compare BunchGraph::moveNodeDelta() with the score of the whole graph.
+void test31();
+
+// compare step3() with Step3Search::GRID and Step3Search::PATTERN, and
+// check the budget of the pattern search.
+void test32();
+
+// find the points in rotated images by step3() with and without
+// MatchOptions::step3Rotation, then by step4() (both searches), and
+// report the errors and the time taken.
+void test33();
+
+// check that step1() - step4() give the same result for any number
+// of threads.
+void test34();
+
+// count the heap allocations of step1() and step3().
+void test35();
+
+// check that matchGraph() gives the same result with Graph<40, 14>
+// as with Graph<40>, and compare their time.
+void test36();
+
+// find the points in test2.png with the 5x8 and the 3x6 kernel
+// banks, and compare their time.
+void test37();
+
+// check that step1() and step3() (without a memo) give the same points
+// with the cascade as without it, and print their time and the number
+// of graphs rejected on the coarse bands.
+void test38();
+
+// find the face position by step1() with the image pyramid (1 and 2
+// levels) and without it, and print their time and the distance of
+// their points.
+void test39();
+
+// refine the points in test2.png by step4() with the window and the
+// predicted search, and print their time, score and sub-pixel points.
+void test40();
+
+// check that CalcJet::calcJet(float, float) gives the same jets as
+// calcJet(int, int) at the integer positions, and print the
+// displacement and the phase range of the interpolated jets and the
+// scores of step3() with and without options.subpixel.
+void test41();
+
+// check that BunchGraph::compareNodeWithPhase() gives the same
+// similarities and displacements as compareNodeWithPhaseFocusComplex()
+// with complexDisplacementWithFocus(), and print their time.
+void test42();
+
+// print the max errors of the approximations of fastmath.h, and match
+// test2.png with and without the fast math mode: the time, the score,
+// and how far apart the jets and the points are.
+void test43();
+
+// for each level of cpu.h the CPU supports: print the time of the
+// direct convolution and of BunchGraph::compareNodeWithPhase(), and
+// check that they, the jets by the FFT, BunchGraph::compare() and
+// Jet::compareWithPhase() give the same results as the generic level.
+void test44();
+
 #endif
\ No newline at end of file
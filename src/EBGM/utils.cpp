@@ -5,6 +5,9 @@
 #include <iostream>
 #include <exception>
 #include <regex>
+#include <atomic>
+#include <new>
+#include <cstdlib>
 
 #include <boost/filesystem.hpp>
 
@@ -13,6 +16,60 @@ using namespace std;
 ostream *Log::os = &std::clog;
 
 
+#ifdef EBGM_COUNT_ALLOCS
+
+static atomic<uint64_t> g_allocCount(0);
+
+void *operator new(size_t size)
+{
+    g_allocCount.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if(!p) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+uint64_t allocCount()
+{
+    return g_allocCount.load(memory_order_relaxed);
+}
+
+#else
+
+uint64_t allocCount()
+{
+    return 0;
+}
+
+#endif
+
+
 // if path doesn't exist, return false
 // if path is a zero-length file, return false
 // if path is a directory, return false
@@ -1,9 +1,14 @@
 #pragma once
 
+#include "fastmath.h"
+
 #include <tuple>
 #include <type_traits>
 #include <string>
 #include <ostream>
+#include <cmath>
+#include <limits>
+#include <cstdint>
 
 #include <boost/filesystem.hpp>
 
@@ -35,6 +40,66 @@ T wrapAngle(T angle)
     return angle - twoPi*floor(angle/twoPi);
 }
 
+// The number of heap allocations by operator new so far (all threads).
+// Always 0 unless compiled with EBGM_COUNT_ALLOCS (the CMake option of
+// the same name), which replaces the global operator new and delete.
+uint64_t allocCount();
+
+// The argmax of a parallel search. Each thread updates its own ArgMax
+// with its candidates (only the score, the index and the parameters of
+// a candidate, e.g. its translation), and the ArgMax of all threads
+// are merged once at the end:
+//
+//     ArgMax<Candidate> best;
+//     #pragma omp parallel
+//     {
+//         ArgMax<Candidate> local;
+//         #pragma omp for nowait
+//         for(...) local.update(score, index, candidate);
+//         #pragma omp critical
+//         best.merge(local);
+//     }
+//
+// Ties are broken by the smallest index, so the result is the same for
+// any number of threads and any schedule.
+template<typename Candidate>
+class ArgMax {
+    float m_score = -std::numeric_limits<float>::infinity();
+    long m_index = std::numeric_limits<long>::max();
+    Candidate m_candidate{};
+
+public:
+    void update(float score, long index, const Candidate &candidate)
+    {
+        if(score > m_score || (score == m_score && index < m_index)) {
+            m_score = score;
+            m_index = index;
+            m_candidate = candidate;
+        }
+    }
+
+    void merge(const ArgMax &other)
+    {
+        update(other.m_score, other.m_index, other.m_candidate);
+    }
+
+    // false if no candidate with a score above -infinity was updated.
+    bool found() const
+    {
+        return m_score > -std::numeric_limits<float>::infinity();
+    }
+
+    float getScore() const
+    {
+        return m_score;
+    }
+
+    const Candidate &getCandidate() const
+    {
+        return m_candidate;
+    }
+};
+
 class Log {
 public:
     enum class MsgType {